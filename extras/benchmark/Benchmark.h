@@ -0,0 +1,231 @@
+/*
+MIT License
+
+Copyright (c) 2024 sub1inear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+// The benchmark sketch, run by benchmark.cpp on every player of the simulator (see run.sh).
+// The player with id 0 is the controller: for each bus frequency, case and payload size it times a few transactions
+// to the player with id 1 (or to everyone for general calls), prints a CSV line per measurement, then stops the simulator.
+// Only transactions which succeeded count towards the throughput and latencies; the others are counted as errors.
+// The player with id 1 answers, every player checks the payloads it receives and the controller checks those it reads,
+// reporting wrong data with Simulator::fail (and counting wrong reads as errors). Once the measurements have started,
+// the players from id 2 on each write
+// backgroundSize bytes to it every frame, so with more players the measurements wait for the bus and lose arbitration
+// like in a game. Every player follows the frequency of the controller, as a slower TWI waits longer for a free bus
+// and would never get it.
+// In the simulator, time passes on the bus and in the fixed I2C_HOST_ISR_CYCLES of each interrupt, but not in the code
+// around them, so the latencies are those of the bus and the cases only differ where the bus does.
+#define I2C_IMPLEMENTATION
+// every payload size up to 255 bytes fits in one transaction, and a few async writes can be queued at once
+#define I2C_BUFFER_SIZE 255
+#define I2C_QUEUE_SIZE 4
+#ifndef I2C_MAX_PLAYERS
+#define I2C_MAX_PLAYERS 2
+#endif
+#include "ArduboyI2C.h"
+#include <stdio.h>
+#include <string.h>
+
+// Transactions per measurement. The simulator is deterministic, so there is no noise to average out,
+// but the first transaction after a change of settings pays for it.
+constexpr uint8_t repeats = 8;
+
+constexpr uint32_t frequencies[] = { 100000, 400000, 1000000 };
+constexpr uint8_t  sizes[] = { 1, 2, 4, 8, 16, 32, 64, 128, 255 };
+
+enum Case : uint8_t {
+    WRITE,        // I2C::write, waiting for each
+    WRITE_ASYNC,  // I2C::write without waiting, I2C_QUEUE_SIZE at a time
+    READ,         // I2C::read, the target answering with I2C::transmitNoCopy
+    TRANSMIT,     // I2C::read, the target answering with I2C::transmit, which copies into the transmit buffer
+    GENERAL_CALL, // I2C::write to address 0, received by every other player
+    CASES,
+};
+
+const char *const caseNames[] = { "write", "write_async", "read", "transmit", "general_call" };
+
+// background traffic, starting with the id so the writes of two players are never the same and arbitration separates them
+constexpr uint8_t backgroundSize = 8;
+constexpr uint8_t backgroundPeriod = 16; // in milliseconds, a frame at 60 FPS
+uint8_t           background[backgroundSize];
+unsigned long     backgroundTime;
+
+uint8_t id;
+uint8_t payload[255]; // payload[i] is i, so a payload always starts with 0
+
+// every other player
+volatile uint8_t requestSize;
+volatile uint8_t requestCase;
+volatile uint8_t frequencyIndex;
+uint8_t          appliedFrequencyIndex;
+volatile bool    measuring; // set by the first announcement, as writes to id 1 would keep the controller from reading it in the handshake
+
+// controller
+i2c_host::cycles_t issued[repeats];
+i2c_host::cycles_t completed[repeats];
+bool               succeeded[repeats];
+uint8_t            received[255];
+volatile uint8_t   completions;
+
+i2c_host::cycles_t now() {
+    return i2c_detail::hostNode.cycles;
+}
+
+// Returns true if the data is the first size bytes of the payload.
+bool isPayload(const uint8_t *data, uint8_t size) {
+    for (uint8_t i = 0; i < size; i++) {
+        if (data[i] != i) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The controller announces each measurement with a general call of 0xFF, the index of the frequency, the payload size
+// and the case, which reads answer with. The payloads start with 0 and the background writes with an id of 2 or more,
+// so neither is taken for an announcement.
+void onReceive() {
+    uint8_t *buffer = I2C::getBuffer();
+    uint8_t size = I2C::getReceivedSize();
+    if (size == 4 && buffer[0] == 0xFF) {
+        frequencyIndex = buffer[1];
+        requestSize = buffer[2];
+        requestCase = buffer[3];
+        measuring = true;
+    } else if (size && buffer[0] == 0 && (size != requestSize || !isPayload(buffer, size))) {
+        i2c_host::Simulator::instance().fail("received %u bytes of a %u-byte payload, or wrong ones", size, requestSize);
+    }
+}
+
+void onRequest() {
+    if (requestCase == TRANSMIT) {
+        I2C::transmit(payload, requestSize);
+    } else {
+        I2C::transmitNoCopy(payload, requestSize);
+    }
+}
+
+void onComplete(uint8_t, uint8_t error) {
+    if (completions < repeats) {
+        succeeded[completions] = error == TW_SUCCESS;
+        completed[completions++] = now();
+    }
+}
+
+void announce(uint8_t frequency, uint8_t benchmarkCase, uint8_t size) {
+    uint8_t announcement[4] = { 0xFF, frequency, size, benchmarkCase };
+    I2C::write(0x00, announcement, 4, true);
+}
+
+void measure(uint8_t frequency, uint8_t benchmarkCase, uint8_t size) {
+    uint8_t target = I2C::getAddressFromId(1);
+    announce(frequency, benchmarkCase, size);
+
+    completions = 0;
+    for (uint8_t i = 0; i < repeats; i++) {
+        issued[i] = now();
+        switch (benchmarkCase) {
+        case WRITE:
+            I2C::write(target, payload, size, true);
+            break;
+        case WRITE_ASYNC:
+            I2C::write(target, payload, size, false);
+            break;
+        case READ:
+        case TRANSMIT:
+            memset(received, 0, size);
+            // Completed once read, so a wrong read is taken back from the successes
+            if (I2C::read(target, received, size, true) == TW_SUCCESS && !isPayload(received, size)) {
+                succeeded[i] = false;
+                i2c_host::Simulator::instance().fail("read %u wrong bytes", size);
+            }
+            break;
+        case GENERAL_CALL:
+            I2C::write(0x00, payload, size, true);
+            break;
+        }
+    }
+    while (completions < repeats) {
+        delayMicroseconds(10);
+    }
+
+    // The cycles of the node are those of the bus, as benchmark.cpp leaves the clock errors at 0
+    uint8_t successes = 0;
+    double total = 0;
+    double latencyMin = 0;
+    double latencyMax = 0;
+    for (uint8_t i = 0; i < repeats; i++) {
+        if (!succeeded[i]) {
+            continue;
+        }
+        double latency = (double)(completed[i] - issued[i]) / (F_CPU / 1000000);
+        total += latency;
+        latencyMin = !successes || latency < latencyMin ? latency : latencyMin;
+        latencyMax = latency > latencyMax ? latency : latencyMax;
+        successes++;
+    }
+    double seconds = (double)(completed[repeats - 1] - issued[0]) / F_CPU;
+    printf("%s,%u,%lu,%u,%u,%u,%.0f,%.1f,%.1f,%.1f\n", caseNames[benchmarkCase], I2C_MAX_PLAYERS, (unsigned long)frequencies[frequency],
+           size, successes, repeats - successes, successes * size / seconds, latencyMin, successes ? total / successes : 0, latencyMax);
+}
+
+void setup() {
+    for (uint16_t i = 0; i < sizeof(payload); i++) {
+        payload[i] = i;
+    }
+    I2C::init();
+    id = I2C::handshake();
+    background[0] = id;
+    I2C::onReceive(onReceive);
+    I2C::onRequest(onRequest);
+    I2C::onComplete(onComplete);
+    if (id != 0) {
+        return;
+    }
+
+    printf("case,players,frequency,size,successes,errors,bytes_per_second,latency_min_us,latency_mean_us,latency_max_us\n");
+    for (uint8_t frequency = 0; frequency < sizeof(frequencies) / sizeof(frequencies[0]); frequency++) {
+        I2C::setFrequency(frequencies[frequency]);
+        // A write still waiting at the last frequency only gets the bus while it is free
+        announce(frequency, READ, 0);
+        delay(10);
+        for (uint8_t benchmarkCase = 0; benchmarkCase < CASES; benchmarkCase++) {
+            for (uint8_t size : sizes) {
+                measure(frequency, benchmarkCase, size);
+            }
+        }
+    }
+    fflush(stdout);
+    i2c_host::Simulator::instance().stop();
+}
+
+void loop() {
+    // Between transactions, so TWBR is never changed during one
+    if (frequencyIndex != appliedFrequencyIndex) {
+        appliedFrequencyIndex = frequencyIndex;
+        I2C::setFrequency(frequencies[appliedFrequencyIndex]);
+    }
+    if (id >= 2 && measuring && millis() - backgroundTime >= backgroundPeriod) {
+        backgroundTime = millis();
+        I2C::write(I2C::getAddressFromId(1), background, backgroundSize, true);
+    }
+    delay(1);
+}
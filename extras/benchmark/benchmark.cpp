@@ -0,0 +1,71 @@
+/*
+MIT License
+
+Copyright (c) 2024 sub1inear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+// Runs Benchmark.h on the players linked in (see run.sh). The CSV goes to stdout.
+// Returns 1 if the benchmark did not finish or a player received wrong data.
+//   --rise N      rise time of the lines in cycles (default 0)
+//   --isr N       cycles of the TWI interrupt (default I2C_HOST_ISR_CYCLES)
+//   --timeout S   simulated seconds after which the benchmark is given up (default 600)
+#include "Simulator.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace i2c_host;
+
+int main(int argc, char **argv) {
+    unsigned long timeout = 600;
+    unsigned long isrCycles = I2C_HOST_ISR_CYCLES;
+    Simulator &simulator = Simulator::instance();
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        unsigned long value = strtoul(argv[i + 1], nullptr, 0);
+        if (!strcmp(argv[i], "--rise")) {
+            defaultBus().riseCycles = value;
+        } else if (!strcmp(argv[i], "--isr")) {
+            isrCycles = value;
+        } else if (!strcmp(argv[i], "--timeout")) {
+            timeout = value;
+        } else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (simulator.size() < 2) {
+        fprintf(stderr, "at least 2 players must be linked in\n");
+        return 1;
+    }
+
+    // Powered on a millisecond apart so the handshake gives the ids in order, with exact clocks so cycles are microseconds
+    for (size_t i = 0; i < simulator.size(); i++) {
+        Node &node = *simulator.player(i).node;
+        node.origin = i * (F_CPU / 1000);
+        node.isrCycles = isrCycles;
+    }
+
+    if (simulator.run((cycles_t)timeout * F_CPU)) {
+        fprintf(stderr, "the benchmark did not finish in %lu s\n", timeout);
+        return 1;
+    }
+    return simulator.failures() ? 1 : 0;
+}
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Builds and runs the benchmark for 2 to 8 players (or the counts given) and writes every result to benchmark.csv.
+#   ./run.sh          every player count from 2 to 8
+#   ./run.sh 2 4      only 2 and 4 players
+# CXXFLAGS can be set to add flags, such as -DI2C_HOST_ISR_CYCLES=100.
+set -e
+cd "$(dirname "$0")"
+counts=${*:-2 3 4 5 6 7 8}
+build=build
+mkdir -p $build
+rm -f benchmark.csv
+for players in $counts; do
+    objects=
+    i=0
+    while [ $i -lt "$players" ]; do
+        g++ -std=gnu++11 -O2 $CXXFLAGS -I../../src -I../simulator -DI2C_SIMULATOR_PLAYER=$i \
+            -DI2C_SIMULATOR_SKETCH='"../benchmark/Benchmark.h"' -DI2C_MAX_PLAYERS="$players" \
+            -c ../simulator/player.cpp -o $build/player$i.o
+        objects="$objects $build/player$i.o"
+        i=$((i + 1))
+    done
+    g++ -std=gnu++11 -O2 $CXXFLAGS -I../../src -I../simulator benchmark.cpp $objects -o $build/benchmark
+    # Through a file, so a benchmark which received wrong data stops the script
+    $build/benchmark > $build/benchmark.csv
+    if [ -f benchmark.csv ]; then
+        tail -n +2 $build/benchmark.csv >> benchmark.csv
+    else
+        cp $build/benchmark.csv benchmark.csv
+    fi
+    echo "$players players done" >&2
+done
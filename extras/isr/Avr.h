@@ -0,0 +1,1070 @@
+/*
+MIT License
+
+Copyright (c) 2024 sub1inear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/** @file
+ * \brief
+ * A small assembler and interpreter for the AVR instructions of the asm TWI interrupt, so extras/isr can run it on the host.
+ * \details
+ * The assembler takes the GNU assembler dialect avr-gcc hands inline asm to: `;` comments, labels, numeric local labels
+ * (`1:` with `1f` and `1b`), `.equ`, `.if`/`.else`/`.endif`, and expressions with lo8, hi8, pm_lo8 and pm_hi8 and the
+ * operator precedence of the GNU assembler. Operands out of range are errors, also where the GNU assembler only warns.
+ * Only the instructions the interrupt uses and a few related ones are known, anything else is an error. \n
+ * The interpreter runs them with the flags and cycle counts of the ATmega32u4 (AVRe+ core, 2-byte PC).
+ * Calls to addresses outside the program are handed to Cpu::external, which is how the host calls the callbacks.
+ * Not part of the library.
+ */
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace i2c_avr {
+
+enum Op : uint8_t {
+    OP_ADC, OP_ADD, OP_ADIW, OP_AND, OP_ANDI, OP_BRBC, OP_BRBS, OP_COM, OP_CP, OP_CPC, OP_CPI, OP_DEC, OP_EOR,
+    OP_ICALL, OP_IJMP, OP_IN, OP_INC, OP_LD, OP_LDD, OP_LDI, OP_LDS, OP_LPM, OP_LSR, OP_MOV, OP_NOP, OP_OR, OP_ORI,
+    OP_OUT, OP_POP, OP_PUSH, OP_RCALL, OP_RET, OP_RETI, OP_RJMP, OP_SBC, OP_SBCI, OP_SBIW, OP_SBRC, OP_SBRS, OP_ST,
+    OP_STD, OP_STS, OP_SUB, OP_SUBI,
+};
+
+// How ld, st and lpm move their pointer register
+enum PointerMode : uint8_t { PLAIN, POST_INCREMENT, PRE_DECREMENT };
+
+// Bits of SREG
+enum : uint8_t { FLAG_C, FLAG_Z, FLAG_N, FLAG_V, FLAG_S, FLAG_H, FLAG_T, FLAG_I };
+
+struct Instruction {
+    Op          op = OP_NOP;
+    uint8_t     d = 0;        // destination register (the source of st, sts, std and push), or the SREG bit of a branch
+    uint8_t     r = 0;        // source register, pointer register (26, 28 or 30), or the bit tested by sbrc/sbrs
+    PointerMode mode = PLAIN;
+    int32_t     k = 0;        // immediate, data space address, displacement, or the target word address of a jump
+    uint8_t     words = 1;
+    uint32_t    address = 0;  // word address
+    int         line = 0;     // in the assembled source, for messages
+    std::string text;
+};
+
+/** \brief
+ * Assembles a piece of source into Instructions and labels.
+ */
+class Program {
+public:
+    std::vector<Instruction>        code;
+    std::map<std::string, uint32_t> labels; // byte addresses, like the GNU assembler
+    uint32_t                        origin = 0; // byte address of the first instruction
+    std::string                     error;      // the first error of assemble, with its line
+
+    // Symbols are given like the operands of an asm statement after substitution, for example "i2c_error" for a "m" operand.
+    bool assemble(const std::string &source, uint32_t origin, const std::map<std::string, int64_t> &symbols) {
+        this->origin = origin;
+        this->symbols = symbols;
+        this->symbols["__SREG__"] = 0x3F;
+        this->symbols["__SP_H__"] = 0x3E;
+        this->symbols["__SP_L__"] = 0x3D;
+        lines.clear();
+        size_t start = 0;
+        while (start <= source.size()) {
+            size_t end = source.find('\n', start);
+            if (end == std::string::npos) {
+                end = source.size();
+            }
+            lines.push_back(source.substr(start, end - start));
+            start = end + 1;
+        }
+        error.clear();
+        labels.clear();
+        // The first pass places the labels, the second one encodes with all of them known.
+        return pass(false) && pass(true);
+    }
+
+    // The instruction at a word address, or nullptr outside the program and for the second word of lds/sts.
+    const Instruction *fetch(uint32_t word) const {
+        uint32_t first = origin / 2;
+        if (word < first || word - first >= index.size() || index[word - first] < 0) {
+            return nullptr;
+        }
+        return &code[index[word - first]];
+    }
+
+    uint32_t end() const {
+        return origin + 2 * (uint32_t)index.size();
+    }
+
+private:
+    std::vector<std::string>        lines;
+    std::map<std::string, int64_t>  symbols;
+    std::vector<int>                index; // in code for each word from origin, -1 for second words
+
+    struct LocalLabel {
+        std::string name;
+        size_t      position; // amount of instructions before it
+        uint32_t    address;
+    };
+    std::vector<LocalLabel> localLabels;
+
+    // ------------------------ pass ------------------------ //
+
+    bool final = false;
+    int  lineNumber = 0;
+
+    bool fail(const std::string &message) {
+        if (error.empty()) {
+            error = "line " + std::to_string(lineNumber) + ": " + message;
+        }
+        return false;
+    }
+
+    static std::string trim(const std::string &text) {
+        size_t a = text.find_first_not_of(" \t\r");
+        size_t b = text.find_last_not_of(" \t\r");
+        return a == std::string::npos ? "" : text.substr(a, b - a + 1);
+    }
+
+    static bool isSymbolChar(char c, bool first) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == '.' || (!first && c >= '0' && c <= '9');
+    }
+
+    bool pass(bool final) {
+        this->final = final;
+        code.clear();
+        index.clear();
+        if (!final) {
+            localLabels.clear();
+        }
+        std::vector<bool> conditions; // of the .if blocks the line is in
+        for (size_t i = 0; i < lines.size(); i++) {
+            lineNumber = (int)i + 1;
+            std::string line = lines[i].substr(0, lines[i].find(';'));
+            line = trim(line);
+            bool active = true;
+            for (bool condition : conditions) {
+                active = active && condition;
+            }
+            if (line.compare(0, 4, ".if ") == 0) {
+                int64_t value = 0;
+                if (active && !evaluate(line.substr(4), value, true)) {
+                    return false;
+                }
+                conditions.push_back(value != 0);
+                continue;
+            }
+            if (line == ".else" || line == ".endif") {
+                if (conditions.empty()) {
+                    return fail(line + " without .if");
+                }
+                if (line == ".else") {
+                    conditions.back() = !conditions.back();
+                } else {
+                    conditions.pop_back();
+                }
+                continue;
+            }
+            if (!active) {
+                continue;
+            }
+            // labels
+            for (;;) {
+                size_t length = 0;
+                while (length < line.size() && isSymbolChar(line[length], false)) {
+                    length++;
+                }
+                if (!length || length >= line.size() || line[length] != ':') {
+                    break;
+                }
+                std::string name = line.substr(0, length);
+                uint32_t address = origin + 2 * (uint32_t)index.size();
+                if (name.find_first_not_of("0123456789") == std::string::npos) {
+                    if (!final) {
+                        localLabels.push_back({ name, code.size(), address });
+                    }
+                } else if (!final) {
+                    if (labels.count(name) || symbols.count(name)) {
+                        return fail("symbol " + name + " is already defined");
+                    }
+                    labels[name] = address;
+                } else if (labels[name] != address) {
+                    return fail("label " + name + " moved between the passes");
+                }
+                line = trim(line.substr(length + 1));
+            }
+            if (line.empty()) {
+                continue;
+            }
+            if (line[0] == '.') {
+                if (line.compare(0, 5, ".equ ") != 0) {
+                    return fail("unsupported directive: " + line);
+                }
+                size_t comma = line.find(',');
+                if (comma == std::string::npos) {
+                    return fail("expected .equ NAME, VALUE");
+                }
+                std::string name = trim(line.substr(5, comma - 5));
+                int64_t value;
+                if (!evaluate(line.substr(comma + 1), value, true)) {
+                    return false;
+                }
+                symbols[name] = value;
+                continue;
+            }
+            if (!instruction(line)) {
+                return false;
+            }
+        }
+        if (!conditions.empty()) {
+            return fail(".if without .endif");
+        }
+        return true;
+    }
+
+    // --------------------- expressions -------------------- //
+
+    const char *cursor = nullptr;
+    bool        known = true; // false once a label which is not placed yet is used
+
+    void skipSpaces() {
+        while (*cursor == ' ' || *cursor == '\t') {
+            cursor++;
+        }
+    }
+
+    // Operators of the GNU assembler: * / % << >> bind tighter than | & ^, which bind tighter than + -.
+    bool evaluate(const std::string &text, int64_t &value, bool mustBeKnown) {
+        cursor = text.c_str();
+        known = true;
+        if (!sum(value)) {
+            return false;
+        }
+        skipSpaces();
+        if (*cursor) {
+            return fail("unexpected '" + std::string(cursor) + "' in expression " + trim(text));
+        }
+        if (!known && (final || mustBeKnown)) {
+            return fail("unknown symbol in " + trim(text));
+        }
+        return true;
+    }
+
+    bool sum(int64_t &value) {
+        if (!bitwise(value)) {
+            return false;
+        }
+        for (;;) {
+            skipSpaces();
+            char op = *cursor;
+            if (op != '+' && op != '-') {
+                return true;
+            }
+            cursor++;
+            int64_t right;
+            if (!bitwise(right)) {
+                return false;
+            }
+            value = op == '+' ? value + right : value - right;
+        }
+    }
+
+    bool bitwise(int64_t &value) {
+        if (!product(value)) {
+            return false;
+        }
+        for (;;) {
+            skipSpaces();
+            char op = *cursor;
+            if (op != '|' && op != '&' && op != '^') {
+                return true;
+            }
+            cursor++;
+            int64_t right;
+            if (!product(right)) {
+                return false;
+            }
+            value = op == '|' ? value | right : op == '&' ? value & right : value ^ right;
+        }
+    }
+
+    bool product(int64_t &value) {
+        if (!unary(value)) {
+            return false;
+        }
+        for (;;) {
+            skipSpaces();
+            std::string op;
+            if (!strncmp(cursor, "<<", 2) || !strncmp(cursor, ">>", 2)) {
+                op = std::string(cursor, 2);
+            } else if (*cursor == '*' || *cursor == '/' || *cursor == '%') {
+                op = std::string(cursor, 1);
+            } else {
+                return true;
+            }
+            cursor += op.size();
+            int64_t right;
+            if (!unary(right)) {
+                return false;
+            }
+            if ((op == "/" || op == "%") && !right) {
+                return fail("division by zero");
+            }
+            value = op == "<<" ? value << right : op == ">>" ? value >> right : op == "*" ? value * right :
+                    op == "/" ? value / right : value % right;
+        }
+    }
+
+    bool unary(int64_t &value) {
+        skipSpaces();
+        if (*cursor == '-' || *cursor == '~' || *cursor == '!') {
+            char op = *cursor++;
+            if (!unary(value)) {
+                return false;
+            }
+            value = op == '-' ? -value : op == '~' ? ~value : !value;
+            return true;
+        }
+        if (*cursor == '(') {
+            cursor++;
+            if (!sum(value)) {
+                return false;
+            }
+            skipSpaces();
+            if (*cursor != ')') {
+                return fail("missing )");
+            }
+            cursor++;
+            return true;
+        }
+        if (*cursor >= '0' && *cursor <= '9') {
+            char *end;
+            value = strtoll(cursor, &end, 0);
+            cursor = end;
+            return true;
+        }
+        if (!isSymbolChar(*cursor, true)) {
+            return fail("expected a value at '" + std::string(cursor) + "'");
+        }
+        const char *start = cursor;
+        while (isSymbolChar(*cursor, false)) {
+            cursor++;
+        }
+        std::string name(start, cursor);
+        skipSpaces();
+        if (*cursor == '(') {
+            // lo8, hi8, pm_lo8 and pm_hi8
+            cursor++;
+            int64_t argument;
+            if (!sum(argument)) {
+                return false;
+            }
+            skipSpaces();
+            if (*cursor != ')') {
+                return fail("missing ) after " + name);
+            }
+            cursor++;
+            if (name == "lo8") {
+                value = argument & 0xFF;
+            } else if (name == "hi8") {
+                value = argument >> 8 & 0xFF;
+            } else if (name == "pm_lo8") {
+                value = argument >> 1 & 0xFF;
+            } else if (name == "pm_hi8") {
+                value = argument >> 9 & 0xFF;
+            } else {
+                return fail("unknown function " + name);
+            }
+            return true;
+        }
+        auto symbol = symbols.find(name);
+        if (symbol != symbols.end()) {
+            value = symbol->second;
+            return true;
+        }
+        auto label = labels.find(name);
+        if (label != labels.end()) {
+            value = label->second;
+            return true;
+        }
+        value = 0;
+        known = false;
+        if (final) {
+            return fail("unknown symbol " + name);
+        }
+        return true;
+    }
+
+    // --------------------- operands ---------------------- //
+
+    static std::vector<std::string> split(const std::string &operands) {
+        std::vector<std::string> parts;
+        int depth = 0;
+        std::string part;
+        for (char c : operands) {
+            if (c == ',' && !depth) {
+                parts.push_back(trim(part));
+                part.clear();
+                continue;
+            }
+            depth += c == '(' ? 1 : c == ')' ? -1 : 0;
+            part += c;
+        }
+        if (!trim(part).empty() || !parts.empty()) {
+            parts.push_back(trim(part));
+        }
+        return parts;
+    }
+
+    bool registerOperand(const std::string &text, uint8_t &number) {
+        if (text == "__zero_reg__") {
+            number = 1;
+            return true;
+        }
+        if (text == "__tmp_reg__") {
+            number = 0;
+            return true;
+        }
+        if (text.size() >= 2 && text.size() <= 3 && (text[0] == 'r' || text[0] == 'R') &&
+            text.find_first_not_of("0123456789", 1) == std::string::npos) {
+            number = (uint8_t)atoi(text.c_str() + 1);
+            if (number < 32) {
+                return true;
+            }
+        }
+        // GNU as takes a plain number for a register too
+        if (!text.empty() && text.size() <= 2 && text.find_first_not_of("0123456789") == std::string::npos &&
+            atoi(text.c_str()) < 32) {
+            number = (uint8_t)atoi(text.c_str());
+            return true;
+        }
+        return fail("expected a register, got '" + text + "'");
+    }
+
+    bool valueOperand(const std::string &text, int64_t minimum, int64_t maximum, int32_t &value) {
+        int64_t result;
+        if (!evaluate(text, result, false)) {
+            return false;
+        }
+        if (final && (result < minimum || result > maximum)) {
+            return fail("operand out of range: " + text + " = " + std::to_string(result));
+        }
+        value = (int32_t)result;
+        return true;
+    }
+
+    // X, X+, -X, Y, Y+, -Y, Z, Z+ and -Z
+    bool pointerOperand(const std::string &text, uint8_t &pointer, PointerMode &mode) {
+        std::string name = text;
+        mode = PLAIN;
+        if (name.size() == 2 && name[1] == '+') {
+            mode = POST_INCREMENT;
+            name = name.substr(0, 1);
+        } else if (name.size() == 2 && name[0] == '-') {
+            mode = PRE_DECREMENT;
+            name = name.substr(1);
+        }
+        if (name == "X" || name == "Y" || name == "Z") {
+            pointer = name == "X" ? 26 : name == "Y" ? 28 : 30;
+            return true;
+        }
+        return fail("expected X, Y or Z, got '" + text + "'");
+    }
+
+    // Y + q and Z + q
+    bool displacementOperand(const std::string &text, uint8_t &pointer, int32_t &displacement) {
+        if (text.size() < 2 || (text[0] != 'Y' && text[0] != 'Z') || trim(text.substr(1))[0] != '+') {
+            return fail("expected Y + q or Z + q, got '" + text + "'");
+        }
+        pointer = text[0] == 'Y' ? 28 : 30;
+        return valueOperand(trim(text.substr(1)).substr(1), 0, 63, displacement);
+    }
+
+    // The word address of a jump target, checked against the range of the instruction.
+    bool targetOperand(const std::string &text, uint32_t address, int32_t range, int32_t &target) {
+        int64_t value;
+        bool local = text.size() >= 2 && (text.back() == 'f' || text.back() == 'b') &&
+                     text.find_first_not_of("0123456789") == text.size() - 1;
+        if (local) {
+            std::string name = text.substr(0, text.size() - 1);
+            const LocalLabel *found = nullptr;
+            for (const LocalLabel &label : localLabels) {
+                if (label.name != name) {
+                    continue;
+                }
+                if (text.back() == 'b' && label.position <= code.size()) {
+                    found = &label;
+                } else if (text.back() == 'f' && label.position > code.size() && !found) {
+                    found = &label;
+                }
+            }
+            if (!found) {
+                if (final) {
+                    return fail("no local label for " + text);
+                }
+                value = address;
+            } else {
+                value = found->address;
+            }
+        } else if (!evaluate(text, value, false)) {
+            return false;
+        }
+        int64_t displacement = value - (address + 2);
+        if (final && (displacement & 1)) {
+            return fail("odd jump target " + text);
+        }
+        if (final && (displacement < -2 * range || displacement > 2 * (range - 1))) {
+            return fail("jump to " + text + " out of range: " + std::to_string(displacement / 2) + " words");
+        }
+        target = (int32_t)(value / 2);
+        return true;
+    }
+
+    // ---------------------- encoding ---------------------- //
+
+    bool instruction(const std::string &line) {
+        size_t space = line.find_first_of(" \t");
+        std::string mnemonic = line.substr(0, space);
+        for (char &c : mnemonic) {
+            c = (char)tolower(c);
+        }
+        std::vector<std::string> operands = split(space == std::string::npos ? "" : line.substr(space));
+        Instruction in;
+        in.address = (origin >> 1) + (uint32_t)index.size();
+        in.line = lineNumber;
+        in.text = line;
+        in.words = mnemonic == "lds" || mnemonic == "sts" ? 2 : 1;
+
+        auto count = [&](size_t expected) {
+            return operands.size() == expected || fail(mnemonic + " takes " + std::to_string(expected) + " operands");
+        };
+        auto high = [&](uint8_t reg) {
+            return reg >= 16 || fail(mnemonic + " needs one of r16 to r31");
+        };
+        // two registers
+        static const std::map<std::string, Op> twoRegisters = {
+            { "adc", OP_ADC }, { "add", OP_ADD }, { "and", OP_AND }, { "cp", OP_CP }, { "cpc", OP_CPC },
+            { "eor", OP_EOR }, { "mov", OP_MOV }, { "or", OP_OR }, { "sbc", OP_SBC }, { "sub", OP_SUB },
+        };
+        // a high register and an 8-bit immediate
+        static const std::map<std::string, Op> immediates = {
+            { "andi", OP_ANDI }, { "cpi", OP_CPI }, { "ldi", OP_LDI }, { "ori", OP_ORI }, { "sbci", OP_SBCI },
+            { "subi", OP_SUBI }, { "sbr", OP_ORI }, { "cbr", OP_ANDI },
+        };
+        // one register
+        static const std::map<std::string, Op> oneRegister = {
+            { "com", OP_COM }, { "dec", OP_DEC }, { "inc", OP_INC }, { "lsr", OP_LSR }, { "pop", OP_POP },
+            { "push", OP_PUSH },
+        };
+        // no operands
+        static const std::map<std::string, Op> none = {
+            { "icall", OP_ICALL }, { "ijmp", OP_IJMP }, { "nop", OP_NOP }, { "ret", OP_RET }, { "reti", OP_RETI },
+        };
+        // branches on a bit of SREG: set (OP_BRBS) or clear (OP_BRBC)
+        static const std::map<std::string, std::pair<Op, uint8_t>> branches = {
+            { "brcs", { OP_BRBS, FLAG_C } }, { "brlo", { OP_BRBS, FLAG_C } }, { "brcc", { OP_BRBC, FLAG_C } },
+            { "brsh", { OP_BRBC, FLAG_C } }, { "breq", { OP_BRBS, FLAG_Z } }, { "brne", { OP_BRBC, FLAG_Z } },
+            { "brmi", { OP_BRBS, FLAG_N } }, { "brpl", { OP_BRBC, FLAG_N } }, { "brlt", { OP_BRBS, FLAG_S } },
+            { "brge", { OP_BRBC, FLAG_S } }, { "brts", { OP_BRBS, FLAG_T } }, { "brtc", { OP_BRBC, FLAG_T } },
+        };
+
+        if (twoRegisters.count(mnemonic)) {
+            in.op = twoRegisters.at(mnemonic);
+            if (!count(2) || !registerOperand(operands[0], in.d) || !registerOperand(operands[1], in.r)) {
+                return false;
+            }
+        } else if (mnemonic == "clr" || mnemonic == "tst" || mnemonic == "lsl") {
+            // aliases of eor, and and add with the same register twice
+            in.op = mnemonic == "clr" ? OP_EOR : mnemonic == "tst" ? OP_AND : OP_ADD;
+            if (!count(1) || !registerOperand(operands[0], in.d)) {
+                return false;
+            }
+            in.r = in.d;
+        } else if (immediates.count(mnemonic)) {
+            in.op = immediates.at(mnemonic);
+            if (!count(2) || !registerOperand(operands[0], in.d) || !high(in.d) ||
+                !valueOperand(operands[1], -255, 255, in.k)) {
+                return false;
+            }
+            if (mnemonic == "cbr") {
+                in.k = ~in.k;
+            }
+            in.k &= 0xFF;
+        } else if (mnemonic == "ser") {
+            in.op = OP_LDI;
+            if (!count(1) || !registerOperand(operands[0], in.d) || !high(in.d)) {
+                return false;
+            }
+            in.k = 0xFF;
+        } else if (oneRegister.count(mnemonic)) {
+            in.op = oneRegister.at(mnemonic);
+            if (!count(1) || !registerOperand(operands[0], in.d)) {
+                return false;
+            }
+        } else if (none.count(mnemonic)) {
+            in.op = none.at(mnemonic);
+            if (!count(0)) {
+                return false;
+            }
+        } else if (mnemonic == "adiw" || mnemonic == "sbiw") {
+            in.op = mnemonic == "adiw" ? OP_ADIW : OP_SBIW;
+            if (!count(2) || !registerOperand(operands[0], in.d) || !valueOperand(operands[1], 0, 63, in.k)) {
+                return false;
+            }
+            if (in.d < 24 || in.d & 1) {
+                return fail(mnemonic + " needs r24, r26, r28 or r30");
+            }
+        } else if (mnemonic == "lds" || mnemonic == "sts") {
+            in.op = mnemonic == "lds" ? OP_LDS : OP_STS;
+            if (!count(2) || !registerOperand(operands[mnemonic == "lds" ? 0 : 1], in.d) ||
+                !valueOperand(operands[mnemonic == "lds" ? 1 : 0], 0, 0xFFFF, in.k)) {
+                return false;
+            }
+        } else if (mnemonic == "in" || mnemonic == "out") {
+            in.op = mnemonic == "in" ? OP_IN : OP_OUT;
+            if (!count(2) || !registerOperand(operands[mnemonic == "in" ? 0 : 1], in.d) ||
+                !valueOperand(operands[mnemonic == "in" ? 1 : 0], 0, 63, in.k)) {
+                return false;
+            }
+        } else if (mnemonic == "ld" || mnemonic == "st") {
+            in.op = mnemonic == "ld" ? OP_LD : OP_ST;
+            if (!count(2) || !registerOperand(operands[mnemonic == "ld" ? 0 : 1], in.d) ||
+                !pointerOperand(operands[mnemonic == "ld" ? 1 : 0], in.r, in.mode)) {
+                return false;
+            }
+            if (in.mode != PLAIN && in.d >= in.r && in.d <= in.r + 1) {
+                return fail(mnemonic + " with the pointer register as the data register is undefined");
+            }
+        } else if (mnemonic == "ldd" || mnemonic == "std") {
+            in.op = mnemonic == "ldd" ? OP_LDD : OP_STD;
+            if (!count(2) || !registerOperand(operands[mnemonic == "ldd" ? 0 : 1], in.d) ||
+                !displacementOperand(operands[mnemonic == "ldd" ? 1 : 0], in.r, in.k)) {
+                return false;
+            }
+        } else if (mnemonic == "lpm") {
+            in.op = OP_LPM;
+            in.r = 30;
+            if (operands.empty()) {
+                in.d = 0;
+            } else if (!count(2) || !registerOperand(operands[0], in.d) || !pointerOperand(operands[1], in.r, in.mode)) {
+                return false;
+            } else if (in.r != 30 || in.mode == PRE_DECREMENT) {
+                return fail("lpm only takes Z and Z+");
+            }
+        } else if (mnemonic == "sbrc" || mnemonic == "sbrs") {
+            in.op = mnemonic == "sbrc" ? OP_SBRC : OP_SBRS;
+            int32_t bit;
+            if (!count(2) || !registerOperand(operands[0], in.d) || !valueOperand(operands[1], 0, 7, bit)) {
+                return false;
+            }
+            in.r = (uint8_t)bit;
+        } else if (branches.count(mnemonic)) {
+            in.op = branches.at(mnemonic).first;
+            in.d = branches.at(mnemonic).second;
+            if (!count(1) || !targetOperand(operands[0], in.address * 2, 64, in.k)) {
+                return false;
+            }
+        } else if (mnemonic == "rjmp" || mnemonic == "rcall") {
+            in.op = mnemonic == "rjmp" ? OP_RJMP : OP_RCALL;
+            if (!count(1) || !targetOperand(operands[0], in.address * 2, 2048, in.k)) {
+                return false;
+            }
+        } else {
+            return fail("instruction not known to the checker: " + mnemonic);
+        }
+        index.push_back((int)code.size());
+        if (in.words == 2) {
+            index.push_back(-1);
+        }
+        code.push_back(in);
+        return true;
+    }
+};
+
+/** \brief
+ * Runs a Program. The data space is given by the subclass, except the registers, SP and SREG.
+ */
+class Cpu {
+public:
+    enum Result : uint8_t { RUNNING, RETURNED, FAULT };
+
+    uint8_t            r[32] = {};
+    uint8_t            sreg = 0;
+    uint16_t           sp = 0;
+    uint32_t           pc = 0;     // word address
+    uint64_t           cycles = 0;
+    std::string        fault;      // why the run stopped, set by step or the subclass
+    const Instruction *last = nullptr; // run by the last step
+
+    explicit Cpu(const Program &program) : program(program) {}
+    virtual ~Cpu() = default;
+
+    // Loads and stores of the data space above the registers and besides SP and SREG
+    virtual uint8_t load(uint16_t address) = 0;
+    virtual void store(uint16_t address, uint8_t value) = 0;
+    // lpm
+    virtual uint8_t loadProgram(uint16_t address) = 0;
+    // A call to a word address outside the program, made after the return address is pushed. It returns to it
+    // afterwards, and counts no cycles besides the call.
+    virtual void external(uint32_t word) = 0;
+
+    // Runs the instruction at pc. Returns RETURNED after a reti.
+    Result step() {
+        const Instruction *in = program.fetch(pc);
+        last = in;
+        if (!in) {
+            fault = "runs outside the program at word " + hex(pc);
+            return FAULT;
+        }
+        uint32_t next = pc + in->words;
+        uint8_t &d = r[in->d];
+        uint8_t  s = r[in->r];
+        uint8_t  result;
+        unsigned cost = 1;
+        switch (in->op) {
+        case OP_ADD:
+        case OP_ADC: {
+            uint8_t carry = in->op == OP_ADC ? sreg & 1 : 0;
+            result = d + s + carry;
+            addFlags(d, s, result);
+            d = result;
+            break;
+        }
+        case OP_SUB:
+        case OP_CP:
+            result = d - s;
+            subtractFlags(d, s, result, false);
+            if (in->op == OP_SUB) {
+                d = result;
+            }
+            break;
+        case OP_SBC:
+        case OP_CPC:
+            result = d - s - (sreg & 1);
+            subtractFlags(d, s, result, true);
+            if (in->op == OP_SBC) {
+                d = result;
+            }
+            break;
+        case OP_SUBI:
+        case OP_CPI:
+            result = d - (uint8_t)in->k;
+            subtractFlags(d, (uint8_t)in->k, result, false);
+            if (in->op == OP_SUBI) {
+                d = result;
+            }
+            break;
+        case OP_SBCI:
+            result = d - (uint8_t)in->k - (sreg & 1);
+            subtractFlags(d, (uint8_t)in->k, result, true);
+            d = result;
+            break;
+        case OP_AND:
+            d &= s;
+            logicFlags(d);
+            break;
+        case OP_ANDI:
+            d &= (uint8_t)in->k;
+            logicFlags(d);
+            break;
+        case OP_OR:
+            d |= s;
+            logicFlags(d);
+            break;
+        case OP_ORI:
+            d |= (uint8_t)in->k;
+            logicFlags(d);
+            break;
+        case OP_EOR:
+            d ^= s;
+            logicFlags(d);
+            break;
+        case OP_COM:
+            d = ~d;
+            logicFlags(d);
+            setFlag(FLAG_C, true);
+            break;
+        case OP_INC:
+            d++;
+            setFlag(FLAG_V, d == 0x80);
+            signFlags(d);
+            break;
+        case OP_DEC:
+            d--;
+            setFlag(FLAG_V, d == 0x7F);
+            signFlags(d);
+            break;
+        case OP_LSR:
+            setFlag(FLAG_C, d & 1);
+            d >>= 1;
+            setFlag(FLAG_N, false);
+            setFlag(FLAG_V, sreg & 1);
+            setFlag(FLAG_Z, !d);
+            setFlag(FLAG_S, sreg >> FLAG_V & 1);
+            break;
+        case OP_ADIW:
+        case OP_SBIW: {
+            uint16_t before = r[in->d] | r[in->d + 1] << 8;
+            uint16_t after = in->op == OP_ADIW ? before + in->k : before - in->k;
+            bool high = before & 0x8000, top = after & 0x8000;
+            setFlag(FLAG_V, in->op == OP_ADIW ? !high && top : high && !top);
+            setFlag(FLAG_C, in->op == OP_ADIW ? !top && high : top && !high);
+            setFlag(FLAG_N, top);
+            setFlag(FLAG_Z, !after);
+            setFlag(FLAG_S, top != (bool)(sreg >> FLAG_V & 1));
+            r[in->d] = (uint8_t)after;
+            r[in->d + 1] = after >> 8;
+            cost = 2;
+            break;
+        }
+        case OP_MOV:
+            d = s;
+            break;
+        case OP_LDI:
+            d = (uint8_t)in->k;
+            break;
+        case OP_LDS:
+            d = read((uint16_t)in->k);
+            cost = 2;
+            break;
+        case OP_STS:
+            write((uint16_t)in->k, d);
+            cost = 2;
+            break;
+        case OP_IN:
+            d = read((uint16_t)(in->k + 0x20));
+            break;
+        case OP_OUT:
+            write((uint16_t)(in->k + 0x20), d);
+            break;
+        case OP_LD:
+        case OP_ST: {
+            uint16_t pointer = this->pointer(in->r);
+            if (in->mode == PRE_DECREMENT) {
+                pointer--;
+            }
+            if (in->op == OP_LD) {
+                d = read(pointer);
+            } else {
+                write(pointer, d);
+            }
+            if (in->mode == POST_INCREMENT) {
+                pointer++;
+            }
+            if (in->mode != PLAIN) {
+                setPointer(in->r, pointer); // ld r30, Z keeps what it loaded
+            }
+            cost = 2;
+            break;
+        }
+        case OP_LDD:
+            d = read((uint16_t)(this->pointer(in->r) + in->k));
+            cost = 2;
+            break;
+        case OP_STD:
+            write((uint16_t)(this->pointer(in->r) + in->k), d);
+            cost = 2;
+            break;
+        case OP_LPM: {
+            uint16_t pointer = this->pointer(30);
+            d = loadProgram(pointer);
+            if (in->mode == POST_INCREMENT) {
+                setPointer(30, pointer + 1);
+            }
+            cost = 3;
+            break;
+        }
+        case OP_PUSH:
+            push(d);
+            cost = 2;
+            break;
+        case OP_POP:
+            d = pop();
+            cost = 2;
+            break;
+        case OP_SBRC:
+        case OP_SBRS:
+            if ((bool)(d >> in->r & 1) == (in->op == OP_SBRS)) {
+                const Instruction *skipped = program.fetch(next);
+                unsigned words = skipped ? skipped->words : 1;
+                next += words;
+                cost += words;
+            }
+            break;
+        case OP_BRBS:
+        case OP_BRBC:
+            if ((bool)(sreg >> in->d & 1) == (in->op == OP_BRBS)) {
+                next = (uint32_t)in->k;
+                cost = 2;
+            }
+            break;
+        case OP_RJMP:
+            next = (uint32_t)in->k;
+            cost = 2;
+            break;
+        case OP_IJMP:
+            next = pointer(30);
+            cost = 2;
+            break;
+        case OP_RCALL:
+        case OP_ICALL:
+            pushReturn(next);
+            next = in->op == OP_RCALL ? (uint32_t)in->k : pointer(30);
+            cost = 3;
+            if (!program.fetch(next)) {
+                cycles += cost;
+                pc = next;
+                external(next);
+                next = popReturn();
+                cost = 0;
+            }
+            break;
+        case OP_RET:
+        case OP_RETI:
+            next = popReturn();
+            cost = 4;
+            if (in->op == OP_RETI) {
+                setFlag(FLAG_I, true);
+            }
+            break;
+        case OP_NOP:
+            break;
+        }
+        cycles += cost;
+        pc = next;
+        if (!fault.empty()) {
+            return FAULT;
+        }
+        return in->op == OP_RETI ? RETURNED : RUNNING;
+    }
+
+    uint16_t pointer(uint8_t low) const {
+        return r[low] | r[low + 1] << 8;
+    }
+
+    void setPointer(uint8_t low, uint16_t value) {
+        r[low] = (uint8_t)value;
+        r[low + 1] = value >> 8;
+    }
+
+    void push(uint8_t value) {
+        write(sp--, value);
+    }
+
+    uint8_t pop() {
+        return read(++sp);
+    }
+
+    // Return addresses are stored with the high byte at the lower address, like the hardware does.
+    void pushReturn(uint32_t word) {
+        push((uint8_t)word);
+        push((uint8_t)(word >> 8));
+    }
+
+    uint32_t popReturn() {
+        uint32_t high = pop();
+        return high << 8 | pop();
+    }
+
+    static std::string hex(uint32_t value) {
+        char text[16];
+        snprintf(text, sizeof(text), "0x%04X", value);
+        return text;
+    }
+
+protected:
+    const Program &program;
+
+private:
+    uint8_t read(uint16_t address) {
+        if (address < 0x20) {
+            return r[address];
+        }
+        switch (address) {
+        case 0x5D:
+            return (uint8_t)sp;
+        case 0x5E:
+            return sp >> 8;
+        case 0x5F:
+            return sreg;
+        }
+        return load(address);
+    }
+
+    void write(uint16_t address, uint8_t value) {
+        if (address < 0x20) {
+            r[address] = value;
+            return;
+        }
+        switch (address) {
+        case 0x5D:
+            sp = (sp & 0xFF00) | value;
+            return;
+        case 0x5E:
+            sp = (uint16_t)(value << 8 | (sp & 0xFF));
+            return;
+        case 0x5F:
+            sreg = value;
+            return;
+        }
+        store(address, value);
+    }
+
+    void setFlag(uint8_t flag, bool value) {
+        sreg = (uint8_t)((sreg & ~(1 << flag)) | value << flag);
+    }
+
+    // N, Z and S from the result, with V already set
+    void signFlags(uint8_t result) {
+        setFlag(FLAG_N, result & 0x80);
+        setFlag(FLAG_Z, !result);
+        setFlag(FLAG_S, (bool)(result & 0x80) != (bool)(sreg >> FLAG_V & 1));
+    }
+
+    void logicFlags(uint8_t result) {
+        setFlag(FLAG_V, false);
+        signFlags(result);
+    }
+
+    void addFlags(uint8_t a, uint8_t b, uint8_t result) {
+        uint8_t carries = (a & b) | (b & ~result) | (~result & a);
+        setFlag(FLAG_H, carries & 0x08);
+        setFlag(FLAG_C, carries & 0x80);
+        setFlag(FLAG_V, ((a & b & ~result) | (~a & ~b & result)) & 0x80);
+        signFlags(result);
+    }
+
+    // sbc, sbci and cpc keep Z clear unless the result is 0 and Z was set, so they can chain
+    void subtractFlags(uint8_t a, uint8_t b, uint8_t result, bool chained) {
+        uint8_t borrows = (~a & b) | (b & result) | (result & ~a);
+        bool zero = sreg >> FLAG_Z & 1;
+        setFlag(FLAG_H, borrows & 0x08);
+        setFlag(FLAG_C, borrows & 0x80);
+        setFlag(FLAG_V, ((a & ~b & ~result) | (~a & b & result)) & 0x80);
+        signFlags(result);
+        if (chained) {
+            setFlag(FLAG_Z, !result && zero);
+        }
+    }
+};
+
+}
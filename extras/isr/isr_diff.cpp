@@ -0,0 +1,1477 @@
+/*
+MIT License
+
+Copyright (c) 2024 sub1inear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+// Runs the asm TWI interrupt of ArduboyI2C.h on the host, with the assembler and interpreter of Avr.h, against the C
+// version the host build uses (I2C_REFERENCE_ISR), for the configuration it is built with. See run.sh.
+//   isr_diff ArduboyI2C.h [interrupts per seed] [seeds]
+// It plays the TWI hardware and the sketch like a random walk: it picks a status the hardware could give in the state
+// the last interrupt left the bus in, and a random TWDR, and runs both interrupts from the same state. Between calls
+// it queues random transactions and polls, like a sketch would. After every call, the library must be in the same
+// state, TWDR and TWCR must have been written the same values in the same order, and the callbacks must have been
+// called with the same arguments. The asm one must also restore every register, SREG and SP, and only read and write
+// the variables it is given.
+// The asm is taken from the header as avr-gcc would assemble it: the pieces of the configuration are joined, and its
+// operands are bound by their C expressions to variables placed like on the ATmega32u4 (packed, 2-byte pointers), so
+// an operand bound to the wrong variable is found too. The cycles each status took are printed at the end.
+// Before the walk, the registers the prologue and call_saved save are checked against the ones C functions may change,
+// and every status is run through the dispatch with every prescaler, to check it lands on its label. With 0
+// interrupts per seed, only that is done. In the walk, each callback is called with r1 cleared, as C code needs, and
+// leaves random values in the registers and flags it may change.
+// Exits with 1 at the first difference, after printing it with the calls which led to it.
+#define I2C_IMPLEMENTATION
+#define I2C_QUEUE_SIZE 2 // so a transaction can follow the one being sent
+#ifndef I2C_DIFF_PAYLOAD
+#define I2C_DIFF_PAYLOAD 4 // bytes in each test buffer
+#endif
+#ifndef I2C_DIFF_END
+#define I2C_DIFF_END 4 // a transfer is cut short about once in this many bytes
+#endif
+#ifndef I2C_RX_BUFFER_SIZE
+#define I2C_RX_BUFFER_SIZE 8 // small, so full buffers are reached often
+#endif
+#ifndef I2C_TX_BUFFER_SIZE
+#define I2C_TX_BUFFER_SIZE I2C_DIFF_PAYLOAD
+#endif
+#include "ArduboyI2C.h"
+#include "Avr.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <regex>
+#include <type_traits>
+
+static_assert(I2C_TX_BUFFER_SIZE >= I2C_DIFF_PAYLOAD, "I2C::transmit copies up to I2C_DIFF_PAYLOAD bytes.");
+
+using namespace i2c_detail;
+
+// ------------------------ walk ------------------------ //
+
+// What the hardware is doing, from the statuses given so far and what the interrupt wrote to TWCR in reply.
+enum Mode : uint8_t {
+    IDLE,           // not addressed and no START requested
+    START_PENDING,  // TWSTA set, waiting for the bus
+    REPEATED_START, // TWSTA set by a controller (master) transfer, which keeps the bus
+    ADDRESS_WRITE,  // SLA+W loaded
+    ADDRESS_READ,   // SLA+R loaded
+    MT_DATA,
+    MR_DATA,
+    SR_DATA,
+    SR_GCALL_DATA,
+    ST_DATA,
+};
+
+Mode             mode = IDLE;
+uint16_t         randomValue = 1;
+
+uint8_t          payload[I2C_DIFF_PAYLOAD];
+uint8_t          flashPayload[I2C_DIFF_PAYLOAD]; // only read as PROGMEM
+I2C::segment_t   segments[I2C_QUEUE_SIZE][2]; // for the transaction in the same slot of the queue
+uint8_t          readBuffers[I2C_QUEUE_SIZE][I2C_DIFF_PAYLOAD];
+
+// What the callbacks were called with during the last call
+uint8_t          events[1024];
+uint16_t         eventCount;
+
+uint8_t randomByte() {
+    // xorshift16
+    randomValue ^= randomValue << 7;
+    randomValue ^= randomValue >> 9;
+    randomValue ^= randomValue << 8;
+    return randomValue;
+}
+
+uint16_t randomBelow(uint16_t limit) {
+    uint16_t value = randomByte();
+    return (value | randomByte() << 8) % limit;
+}
+
+// Whether a transfer is cut short at this byte
+bool cut() {
+    return !randomBelow(I2C_DIFF_END);
+}
+
+void event(uint8_t value) {
+    if (eventCount < sizeof(events)) {
+        events[eventCount] = value;
+    }
+    eventCount++;
+}
+
+void eventReceived() {
+    I2C::size_type size = I2C::getReceivedSize();
+    event(size);
+    event(size >> 8);
+    const uint8_t *data = I2C::getBuffer();
+    for (I2C::size_type i = 0; i < size && i < I2C_RX_BUFFER_SIZE; i++) {
+        event(data[i]);
+    }
+}
+
+// Gives a random part of a payload, in RAM, copied or in flash.
+void reply() {
+    uint16_t offset = randomBelow(I2C_DIFF_PAYLOAD);
+    I2C::size_type size = randomBelow(I2C_DIFF_PAYLOAD - offset) + 1;
+    switch (randomByte() % 3) {
+    case 0:
+        I2C::transmitNoCopy(payload + offset, size);
+        break;
+    case 1:
+        I2C::transmit(payload + offset, size);
+        break;
+    default:
+        I2C::transmit_P(flashPayload + offset, size);
+        break;
+    }
+}
+
+void onRequest() {
+    event('Q');
+    reply();
+}
+
+void onRequestMore() {
+    event('M');
+    if (randomByte() & 1) {
+        reply();
+    }
+}
+
+void onReceive() {
+    event('R');
+#if I2C_RECEIVE_QUEUE_SIZE
+    event(I2C::isGeneralCall());
+#endif
+    eventReceived();
+}
+
+#if !I2C_RECEIVE_QUEUE_SIZE
+void onReceiveChunk() {
+    event('K');
+    eventReceived();
+}
+#endif
+
+void onComplete(uint8_t ticket, uint8_t error) {
+    event('C');
+    event(ticket);
+    event(error);
+}
+
+// Queues a random transaction like the write and read functions of I2C do, and starts it like start() does once
+// the bus is free.
+void enqueueRandom() {
+    uint8_t slot = queueTail - queue;
+    uint8_t slaRW = (0x10 | (randomByte() & 3)) << 1 | TW_WRITE;
+    uint16_t offset = randomBelow(I2C_DIFF_PAYLOAD);
+    I2C::size_type size = randomBelow(I2C_DIFF_PAYLOAD + 1 - offset);
+    const void *buffer = payload + offset;
+    uint8_t flags = randomByte() & 1 ? _BV(RESTART) : 0;
+    switch (randomByte() % 5) {
+    case 0:
+        break;
+    case 1:
+        buffer = flashPayload + offset;
+        flags |= _BV(FLASH);
+        break;
+    case 2:
+        segments[slot][0] = { payload, (I2C::size_type)randomBelow(I2C_DIFF_PAYLOAD / 2 + 1) };
+        segments[slot][1] = { payload + I2C_DIFF_PAYLOAD / 2, (I2C::size_type)randomBelow(I2C_DIFF_PAYLOAD / 2 + 1) };
+        buffer = segments[slot];
+        size = (randomByte() & 1) + 1;
+        flags |= _BV(SEGMENTED);
+        break;
+#if I2C_QUEUE_BUFFER_SIZE
+    case 3:
+        // copied into the transaction
+        size = randomBelow((I2C_QUEUE_BUFFER_SIZE < I2C_DIFF_PAYLOAD - offset ? I2C_QUEUE_BUFFER_SIZE : I2C_DIFF_PAYLOAD - offset) + 1);
+        memcpy(queueTail->data, payload + offset, size);
+        buffer = queueTail->data;
+        break;
+#endif
+    default:
+        slaRW |= TW_READ;
+        buffer = readBuffers[slot];
+        size = randomBelow(I2C_DIFF_PAYLOAD); // reads store size - 1
+        break;
+    }
+    queueTail->slaRW = slaRW;
+    queueTail->size = size;
+    queueTail->buffer = (uint8_t *)buffer;
+    queueTail->flags = flags;
+    if (++queueTail == queue + I2C_QUEUE_SIZE) {
+        queueTail = queue;
+    }
+    queueCount++;
+    queueIssued++;
+    if (!active) {
+        active = true;
+        TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWSTA);
+        mode = START_PENDING;
+    }
+}
+
+// What the sketch does between two interrupts.
+void loop() {
+    if (!(randomByte() & 3) && queueCount < I2C_QUEUE_SIZE) {
+        enqueueRandom();
+    }
+#if I2C_RECEIVE_QUEUE_SIZE
+    if (!(randomByte() & 3)) {
+        I2C::poll();
+    }
+#else
+    if (!(randomByte() & 15) && mode == IDLE) {
+        I2C::onReceiveChunk(randomByte() & 1 ? onReceiveChunk : nullptr);
+    }
+#endif
+}
+
+uint8_t pick(const uint8_t *statuses, uint8_t count) {
+    return statuses[randomByte() % count];
+}
+
+#define PICK(...) ({ static const uint8_t statuses[] = { __VA_ARGS__ }; pick(statuses, sizeof(statuses)); })
+
+// A status the hardware could give next. Bus errors can happen at any time.
+uint8_t nextStatus() {
+    bool ack = TWCR & _BV(TWEA);
+    if (!randomBelow(16 * I2C_DIFF_END)) {
+        return TW_BUS_ERROR;
+    }
+    switch (mode) {
+    case IDLE:
+        return PICK(TW_SR_SLA_ACK, TW_SR_GCALL_ACK, TW_ST_SLA_ACK);
+    case START_PENDING: // addressed before the START could be sent
+        return PICK(TW_START, TW_START, TW_START, TW_SR_SLA_ACK, TW_SR_GCALL_ACK, TW_ST_SLA_ACK);
+    case REPEATED_START:
+        return TW_REP_START;
+    case ADDRESS_WRITE:
+        return PICK(TW_MT_SLA_ACK, TW_MT_SLA_ACK, TW_MT_SLA_NACK, TW_MT_ARB_LOST,
+                    TW_SR_ARB_LOST_SLA_ACK, TW_SR_ARB_LOST_GCALL_ACK, TW_ST_ARB_LOST_SLA_ACK);
+    case ADDRESS_READ:
+        return PICK(TW_MR_SLA_ACK, TW_MR_SLA_ACK, TW_MR_SLA_NACK, TW_MR_ARB_LOST,
+                    TW_SR_ARB_LOST_SLA_ACK, TW_SR_ARB_LOST_GCALL_ACK, TW_ST_ARB_LOST_SLA_ACK);
+    case MT_DATA:
+        return cut() ? PICK(TW_MT_DATA_NACK, TW_MT_ARB_LOST) : TW_MT_DATA_ACK;
+    case MR_DATA: // arbitration can only be lost in the ACK bit
+        return ack ? (cut() ? TW_MR_ARB_LOST : TW_MR_DATA_ACK) : TW_MR_DATA_NACK;
+    case SR_DATA:
+        return ack ? (cut() ? TW_SR_STOP : TW_SR_DATA_ACK) : PICK(TW_SR_DATA_NACK, TW_SR_STOP);
+    case SR_GCALL_DATA:
+        return ack ? (cut() ? TW_SR_STOP : TW_SR_GCALL_DATA_ACK) : PICK(TW_SR_GCALL_DATA_NACK, TW_SR_STOP);
+    default: // ST_DATA
+        return ack ? (cut() ? TW_ST_DATA_NACK : TW_ST_DATA_ACK) : PICK(TW_ST_LAST_DATA, TW_ST_DATA_NACK);
+    }
+}
+
+// Follows the hardware after an interrupt for the status.
+void update(uint8_t status) {
+    uint8_t twcr = TWCR;
+    switch (status) {
+    case TW_START:
+    case TW_REP_START:
+        mode = TWDR & TW_READ ? ADDRESS_READ : ADDRESS_WRITE; // the interrupt loaded SLA+R/W
+        break;
+    case TW_MT_SLA_ACK:
+    case TW_MT_DATA_ACK:
+        mode = MT_DATA;
+        break;
+    case TW_MR_SLA_ACK:
+    case TW_MR_DATA_ACK:
+        mode = MR_DATA;
+        break;
+    case TW_SR_SLA_ACK:
+    case TW_SR_ARB_LOST_SLA_ACK:
+        mode = SR_DATA;
+        break;
+    case TW_SR_GCALL_ACK:
+    case TW_SR_ARB_LOST_GCALL_ACK:
+        mode = SR_GCALL_DATA;
+        break;
+    case TW_SR_DATA_ACK:
+    case TW_SR_GCALL_DATA_ACK:
+        break;
+    case TW_ST_SLA_ACK:
+    case TW_ST_ARB_LOST_SLA_ACK:
+    case TW_ST_DATA_ACK:
+        mode = ST_DATA;
+        break;
+    default: // the transfer is over
+        mode = IDLE;
+        break;
+    }
+    if (twcr & _BV(TWSTO)) {
+        mode = twcr & _BV(TWSTA) ? START_PENDING : IDLE;
+    } else if (twcr & _BV(TWSTA)) {
+        // Only a controller transfer which did not lose arbitration still has the bus
+        mode = status >= TW_START && status <= TW_MR_DATA_NACK && status != TW_MT_ARB_LOST ? REPEATED_START : START_PENDING;
+    }
+}
+
+// ---------------------- registers --------------------- //
+
+// The TWI registers while the walk runs: TWSR and TWDR as it set them, and the writes of the interrupts in order.
+struct Registers : i2c_host::RegisterHook {
+    struct Write {
+        uint8_t address;
+        uint8_t value;
+    };
+
+    uint8_t            twsr = 0;
+    uint8_t            twdr = 0;
+    uint8_t            twcr = 0;
+    std::vector<Write> writes;
+
+    uint8_t read(uint8_t address) override {
+        switch (address) {
+        case i2c_host::Node::TWSR_ADDRESS:
+            return twsr;
+        case i2c_host::Node::TWDR_ADDRESS:
+            return twdr;
+        case i2c_host::Node::TWCR_ADDRESS:
+            return twcr;
+        }
+        return 0;
+    }
+
+    void write(uint8_t address, uint8_t value) override {
+        writes.push_back({ address, value });
+        switch (address) {
+        case i2c_host::Node::TWSR_ADDRESS:
+            twsr = (twsr & ~3) | (value & 3); // only the prescaler bits are writable
+            break;
+        case i2c_host::Node::TWDR_ADDRESS:
+            twdr = value;
+            break;
+        case i2c_host::Node::TWCR_ADDRESS:
+            twcr = value;
+            break;
+        }
+    }
+};
+
+Registers registers;
+
+const char *registerName(uint8_t address) {
+    static const char *names[] = { "TWBR", "TWSR", "TWAR", "TWDR", "TWCR" };
+    return names[address - i2c_host::Node::TWBR_ADDRESS];
+}
+
+// ------------------------ state ----------------------- //
+
+// Everything the interrupts, the callbacks and the walk change, copied between the runs of the two interrupts.
+#if I2C_RECEIVE_QUEUE_SIZE
+#define RECEIVE_STATE(X) X(frames) X(frameHead) X(frameTail) X(framesReceived) X(framesPolled)
+#else
+#define RECEIVE_STATE(X) X(rxBuffer) X(onReceiveChunkFunction)
+#endif
+#ifdef I2C_ADAPTIVE_LINK
+#ifdef I2C_MAX_PLAYERS
+#define LINK_PLAYERS_STATE(X) X(linkAgreed)
+#else
+#define LINK_PLAYERS_STATE(X)
+#endif
+#define LINK_STATE(X) X(linkReceiveFunction) X(linkCompleteFunction) X(linkRate) X(linkGeneration) X(linkRatePending) \
+    X(linkStarted) X(linkTransactions) X(linkErrors) X(linkCleanWindows) X(linkMessage) X(linkBroadcastPending) \
+    X(linkBroadcasting) X(linkBroadcastTicket) X(chainOpen) LINK_PLAYERS_STATE(X)
+#else
+#define LINK_STATE(X)
+#endif
+#define STATE(X) X(queue) X(queueHead) X(queueTail) X(queueCount) X(queueIssued) X(txBuffer) X(dataBuffer) \
+    X(bufferIdx) X(bufferSize) X(bufferFlags) X(segment) X(segmentCount) X(active) X(error) X(arbitrationRetries) \
+    X(onRequestFunction) X(onRequestMoreFunction) X(onReceiveFunction) X(onCompleteFunction) RECEIVE_STATE(X) \
+    LINK_STATE(X) X(mode) X(randomValue) X(payload) X(flashPayload) X(segments) X(readBuffers) X(events) X(eventCount)
+
+#define DECLARE(name) std::remove_cv<decltype(::name)>::type name;
+#define CAPTURE(name) memcpy((void *)&state.name, (const void *)&::name, sizeof(state.name));
+#define APPLY(name) memcpy((void *)&::name, (const void *)&state.name, sizeof(state.name));
+
+struct State {
+    STATE(DECLARE)
+    uint8_t twsr;
+    uint8_t twdr;
+    uint8_t twcr;
+};
+
+void capture(State &state) {
+    STATE(CAPTURE)
+    state.twsr = registers.twsr;
+    state.twdr = registers.twdr;
+    state.twcr = registers.twcr;
+}
+
+void apply(const State &state) {
+    STATE(APPLY)
+    registers.twsr = state.twsr;
+    registers.twdr = state.twdr;
+    registers.twcr = state.twcr;
+}
+
+// ------------------------ report ---------------------- //
+
+// The calls of the current seed, for the report of a difference
+struct Call {
+    uint8_t twsr;
+    uint8_t twdr;
+    Mode    mode;
+};
+
+uint32_t          seed;
+uint32_t          callNumber;
+std::vector<Call> history;
+
+void printBytes(const char *label, const void *data, size_t size) {
+    printf("    %-6s", label);
+    for (size_t i = 0; i < size && i < 48; i++) {
+        printf(" %02X", ((const uint8_t *)data)[i]);
+    }
+    printf(size > 48 ? " ...\n" : "\n");
+}
+
+void printWrites(const char *label, const std::vector<Registers::Write> &writes) {
+    printf("    %-6s", label);
+    for (const Registers::Write &write : writes) {
+        printf(" %s=%02X", registerName(write.address), write.value);
+    }
+    printf("\n");
+}
+
+[[noreturn]] void fail(const char *format, ...) {
+    printf(seed ? "FAIL seed %u, call %u: " : "FAIL: ", seed, callNumber);
+    va_list arguments;
+    va_start(arguments, format);
+    vprintf(format, arguments);
+    va_end(arguments);
+    printf("\n");
+    if (!history.empty()) {
+        printf("  last calls (TWSR, TWDR, mode before):\n");
+        size_t first = history.size() > 16 ? history.size() - 16 : 0;
+        for (size_t i = first; i < history.size(); i++) {
+            printf("    %02X %02X %u\n", history[i].twsr, history[i].twdr, history[i].mode);
+        }
+    }
+    exit(1);
+}
+
+#define COMPARE(name) \
+    if (memcmp((const void *)&c.name, (const void *)&assembly.name, sizeof(c.name))) { \
+        printf("  %s differs\n", #name); \
+        printBytes("C", &c.name, sizeof(c.name)); \
+        printBytes("asm", &assembly.name, sizeof(assembly.name)); \
+        same = false; \
+    }
+
+void compare(const State &c, const State &assembly, const std::vector<Registers::Write> &cWrites,
+             const std::vector<Registers::Write> &assemblyWrites) {
+    bool same = true;
+    STATE(COMPARE)
+    bool sameWrites = cWrites.size() == assemblyWrites.size();
+    for (size_t i = 0; sameWrites && i < cWrites.size(); i++) {
+        sameWrites = cWrites[i].address == assemblyWrites[i].address && cWrites[i].value == assemblyWrites[i].value;
+    }
+    if (!sameWrites) {
+        printf("  the TWI register writes differ\n");
+        printWrites("C", cWrites);
+        printWrites("asm", assemblyWrites);
+        same = false;
+    }
+    if (!same) {
+        fail("the asm interrupt differs from the C one");
+    }
+}
+
+// ----------------------- layout ----------------------- //
+
+// The ATmega32u4 layout of the types the interrupt reads by offset: packed, with 2-byte pointers.
+constexpr uint16_t sizeBytes = sizeof(I2C::size_type);
+constexpr uint16_t transactionSize = 4 + sizeBytes + I2C_QUEUE_BUFFER_SIZE; // slaRW, size, buffer, flags, data
+constexpr uint16_t flagsOffset = 3 + sizeBytes;
+constexpr uint16_t segmentSize = 2 + sizeBytes;                             // buffer, size
+#if I2C_RECEIVE_QUEUE_SIZE
+constexpr uint16_t frameSize = sizeBytes + 1 + I2C_RX_BUFFER_SIZE;          // size, generalCall, data
+#endif
+
+constexpr uint16_t dataStart = 0x0100;  // after the registers and the I/O space
+constexpr uint16_t stackBottom = 0xF000;
+constexpr uint16_t stackTop = 0xFEFF;
+constexpr uint16_t flashData = 0x6000;  // byte address of flashPayload
+constexpr uint32_t callbacks = 0x3F00;  // word address of the first callback, past the program
+
+std::map<std::string, uint16_t> addresses;   // of the variables in the data space
+bool                            placed[0x10000]; // bytes of the variables and the test buffers
+uint16_t                        nextAddress = dataStart;
+
+// Places a variable with room after it, so no two of them touch and a pointer one past the end of one is not taken
+// for a pointer into the next.
+uint16_t place(const std::string &name, size_t size) {
+    uint16_t address = nextAddress;
+    addresses[name] = address;
+    for (size_t i = 0; i < size; i++) {
+        placed[address + i] = true;
+    }
+    nextAddress += size + 16;
+    if (nextAddress >= flashData) {
+        fail("the variables do not fit below 0x%04X", flashData);
+    }
+    return address;
+}
+
+uint16_t at(const std::string &name) {
+    return addresses.at(name);
+}
+
+// A piece of host memory and where it is on the AVR. The units of arrays of structures differ in size.
+struct Region {
+    const void *host;
+    size_t      hostUnit;
+    uint16_t    avr;
+    uint16_t    avrUnit;
+    size_t      count;
+};
+
+std::vector<Region> regions; // arrays of bytes first, as some are in the arrays of structures
+
+void addRegion(const std::string &name, const void *host, size_t hostUnit, uint16_t avrUnit, size_t count) {
+    regions.push_back({ host, hostUnit, place(name, avrUnit * count), avrUnit, count });
+}
+
+void layout() {
+    place("error", 1);
+    place("active", 1);
+    place("bufferIdx", sizeBytes);
+    place("bufferSize", sizeBytes);
+    place("dataBuffer", 2);
+    place("queueHead", 2);
+    place("queueCount", 1);
+    place("queueIssued", 1);
+    place("segment", 2);
+    place("segmentCount", 1);
+    place("bufferFlags", 1);
+    place("arbitrationRetries", 1);
+    place("onRequestFunction", 2);
+    place("onRequestMoreFunction", 2);
+    place("onReceiveFunction", 2);
+    place("onCompleteFunction", 2);
+#if I2C_RECEIVE_QUEUE_SIZE
+    place("frameTail", 2);
+    place("framesReceived", 1);
+    place("framesPolled", 1);
+#else
+    place("onReceiveChunkFunction", 2);
+    addRegion("rxBuffer", rxBuffer, 1, 1, sizeof(rxBuffer));
+#endif
+    addRegion("txBuffer", txBuffer, 1, 1, sizeof(txBuffer));
+    addRegion("payload", payload, 1, 1, sizeof(payload));
+    addRegion("readBuffers", readBuffers, 1, 1, sizeof(readBuffers));
+    regions.push_back({ flashPayload, 1, flashData, 1, sizeof(flashPayload) });
+    // the data of the transactions are inside the queue, so the queue is placed around them
+    addRegion("queue", queue, sizeof(transaction_t), transactionSize, I2C_QUEUE_SIZE);
+#if I2C_QUEUE_BUFFER_SIZE
+    for (uint8_t i = 0; i < I2C_QUEUE_SIZE; i++) {
+        regions.insert(regions.begin(), { queue[i].data, 1, (uint16_t)(at("queue") + i * transactionSize + flagsOffset + 1),
+                                          1, I2C_QUEUE_BUFFER_SIZE });
+    }
+#endif
+#if I2C_RECEIVE_QUEUE_SIZE
+    addRegion("frames", frames, sizeof(frame_t), frameSize, I2C_RECEIVE_QUEUE_SIZE + 1);
+#endif
+    addRegion("segments", segments, sizeof(I2C::segment_t), segmentSize, sizeof(segments) / sizeof(I2C::segment_t));
+}
+
+// The variable or region an address is in, for messages
+std::string describe(uint16_t address) {
+    char text[64];
+    if (address < dataStart || address >= nextAddress) {
+        snprintf(text, sizeof(text), "0x%04X", address);
+        return text;
+    }
+    std::string best;
+    uint16_t bestAddress = 0;
+    for (const auto &variable : addresses) {
+        if (variable.second <= address && variable.second >= bestAddress) {
+            best = variable.first;
+            bestAddress = variable.second;
+        }
+    }
+    snprintf(text, sizeof(text), "0x%04X (%s + %u)", address, best.c_str(), address - bestAddress);
+    return text;
+}
+
+// ----------------------- bridge ----------------------- //
+
+// The callbacks, called at callbacks + their index
+struct Callback {
+    void (*function)();
+    bool withArguments; // onComplete
+};
+
+std::vector<Callback> callbackTable;
+
+class Machine;
+extern Machine machine;
+uint8_t *ram();
+uint8_t *rom();
+
+uint16_t toAvr(const volatile void *pointer) {
+    if (!pointer) {
+        return 0;
+    }
+    uintptr_t address = (uintptr_t)pointer;
+    const Region *end = nullptr;
+    for (const Region &region : regions) {
+        uintptr_t offset = address - (uintptr_t)region.host;
+        uintptr_t size = region.hostUnit * region.count;
+        if (offset < size && offset % region.hostUnit == 0) {
+            return region.avr + offset / region.hostUnit * region.avrUnit;
+        }
+        if (offset == size && !end) {
+            end = &region;
+        }
+    }
+    if (!end) {
+        fail("the pointer %p is in none of the regions", (const void *)pointer);
+    }
+    return end->avr + end->count * end->avrUnit;
+}
+
+void *toHost(uint16_t address, const char *name) {
+    if (!address) {
+        return nullptr;
+    }
+    const Region *end = nullptr;
+    for (const Region &region : regions) {
+        uint32_t offset = address - region.avr;
+        uint32_t size = region.count * region.avrUnit;
+        if (address >= region.avr && offset < size && offset % region.avrUnit == 0) {
+            return (uint8_t *)region.host + offset / region.avrUnit * region.hostUnit;
+        }
+        if (address >= region.avr && offset == size && !end) {
+            end = &region;
+        }
+    }
+    if (!end) {
+        fail("%s points to %s, which is in none of the regions", name, describe(address).c_str());
+    }
+    return (uint8_t *)end->host + end->count * end->hostUnit;
+}
+
+template <typename F>
+uint16_t callbackToAvr(F function) {
+    if (!function) {
+        return 0;
+    }
+    Callback callback = { reinterpret_cast<void (*)()>(function), !std::is_same<F, void (*)()>::value };
+    for (size_t i = 0; i < callbackTable.size(); i++) {
+        if (callbackTable[i].function == callback.function) {
+            return callbacks + i;
+        }
+    }
+    callbackTable.push_back(callback);
+    return callbacks + callbackTable.size() - 1;
+}
+
+template <typename F>
+F callbackToHost(uint16_t word) {
+    if (!word) {
+        return nullptr;
+    }
+    if (word < callbacks || word - callbacks >= callbackTable.size()) {
+        fail("a callback pointer changed to 0x%04X", word);
+    }
+    return reinterpret_cast<F>(callbackTable[word - callbacks].function);
+}
+
+void put(uint16_t address, uint32_t value, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        ram()[address + i] = value >> 8 * i;
+    }
+}
+
+uint32_t get(uint16_t address, size_t size) {
+    uint32_t value = 0;
+    for (size_t i = 0; i < size; i++) {
+        value |= (uint32_t)ram()[address + i] << 8 * i;
+    }
+    return value;
+}
+
+#define PUT(name, size) put(at(#name), name, size)
+#define GET(name, size) name = get(at(#name), size)
+#define PUT_POINTER(name) put(at(#name), toAvr(name), 2)
+#define GET_POINTER(name) name = (std::remove_cv<decltype(name)>::type)toHost(get(at(#name), 2), #name)
+#define PUT_CALLBACK(name) put(at(#name), callbackToAvr(name), 2)
+#define GET_CALLBACK(name) name = callbackToHost<decltype(name)>(get(at(#name), 2))
+
+// Copies the state of the library and the test buffers into the data space and flash of the machine.
+void serialize() {
+    PUT(error, 1);
+    ram()[at("active")] = *(const volatile uint8_t *)&active; // the byte, as a bool other than 0 or 1 is not true or false to C++
+    PUT(bufferIdx, sizeBytes);
+    PUT(bufferSize, sizeBytes);
+    PUT_POINTER(dataBuffer);
+    PUT_POINTER(queueHead);
+    PUT(queueCount, 1);
+    PUT(queueIssued, 1);
+    PUT_POINTER(segment);
+    PUT(segmentCount, 1);
+    PUT(bufferFlags, 1);
+    PUT(arbitrationRetries, 1);
+    PUT_CALLBACK(onRequestFunction);
+    PUT_CALLBACK(onRequestMoreFunction);
+    PUT_CALLBACK(onReceiveFunction);
+    PUT_CALLBACK(onCompleteFunction);
+    for (uint8_t i = 0; i < I2C_QUEUE_SIZE; i++) {
+        uint16_t address = at("queue") + i * transactionSize;
+        put(address, queue[i].slaRW, 1);
+        put(address + 1, queue[i].size, sizeBytes);
+        put(address + 1 + sizeBytes, toAvr(queue[i].buffer), 2);
+        put(address + flagsOffset, queue[i].flags, 1);
+#if I2C_QUEUE_BUFFER_SIZE
+        memcpy(ram() + address + flagsOffset + 1, queue[i].data, I2C_QUEUE_BUFFER_SIZE);
+#endif
+    }
+    memcpy(ram() + at("txBuffer"), txBuffer, sizeof(txBuffer));
+#if I2C_RECEIVE_QUEUE_SIZE
+    PUT_POINTER(frameTail);
+    PUT(framesReceived, 1);
+    PUT(framesPolled, 1);
+    for (uint8_t i = 0; i < I2C_RECEIVE_QUEUE_SIZE + 1; i++) {
+        uint16_t address = at("frames") + i * frameSize;
+        put(address, frames[i].size, sizeBytes);
+        put(address + sizeBytes, frames[i].generalCall, 1);
+        memcpy(ram() + address + sizeBytes + 1, frames[i].data, I2C_RX_BUFFER_SIZE);
+    }
+#else
+    PUT_CALLBACK(onReceiveChunkFunction);
+    memcpy(ram() + at("rxBuffer"), rxBuffer, sizeof(rxBuffer));
+#endif
+    memcpy(ram() + at("payload"), payload, sizeof(payload));
+    memcpy(ram() + at("readBuffers"), readBuffers, sizeof(readBuffers));
+    for (size_t i = 0; i < sizeof(segments) / sizeof(I2C::segment_t); i++) {
+        const I2C::segment_t &segment = reinterpret_cast<I2C::segment_t *>(segments)[i];
+        uint16_t address = at("segments") + i * segmentSize;
+        put(address, toAvr(segment.buffer), 2);
+        put(address + 2, segment.size, sizeBytes);
+    }
+    memcpy(rom() + flashData, flashPayload, sizeof(flashPayload));
+}
+
+// Copies the data space of the machine back into the state of the library and the test buffers.
+void deserialize() {
+    GET(error, 1);
+    memcpy((void *)&active, ram() + at("active"), 1);
+    GET(bufferIdx, sizeBytes);
+    GET(bufferSize, sizeBytes);
+    GET_POINTER(dataBuffer);
+    GET_POINTER(queueHead);
+    GET(queueCount, 1);
+    GET(queueIssued, 1);
+    GET_POINTER(segment);
+    GET(segmentCount, 1);
+    GET(bufferFlags, 1);
+    GET(arbitrationRetries, 1);
+    GET_CALLBACK(onRequestFunction);
+    GET_CALLBACK(onRequestMoreFunction);
+    GET_CALLBACK(onReceiveFunction);
+    GET_CALLBACK(onCompleteFunction);
+    for (uint8_t i = 0; i < I2C_QUEUE_SIZE; i++) {
+        uint16_t address = at("queue") + i * transactionSize;
+        queue[i].slaRW = get(address, 1);
+        queue[i].size = get(address + 1, sizeBytes);
+        queue[i].buffer = (uint8_t *)toHost(get(address + 1 + sizeBytes, 2), "a transaction");
+        queue[i].flags = get(address + flagsOffset, 1);
+#if I2C_QUEUE_BUFFER_SIZE
+        memcpy(queue[i].data, ram() + address + flagsOffset + 1, I2C_QUEUE_BUFFER_SIZE);
+#endif
+    }
+    memcpy(txBuffer, ram() + at("txBuffer"), sizeof(txBuffer));
+#if I2C_RECEIVE_QUEUE_SIZE
+    GET_POINTER(frameTail);
+    GET(framesReceived, 1);
+    GET(framesPolled, 1);
+    for (uint8_t i = 0; i < I2C_RECEIVE_QUEUE_SIZE + 1; i++) {
+        uint16_t address = at("frames") + i * frameSize;
+        frames[i].size = get(address, sizeBytes);
+        frames[i].generalCall = get(address + sizeBytes, 1);
+        memcpy(frames[i].data, ram() + address + sizeBytes + 1, I2C_RX_BUFFER_SIZE);
+    }
+#else
+    GET_CALLBACK(onReceiveChunkFunction);
+    memcpy(rxBuffer, ram() + at("rxBuffer"), sizeof(rxBuffer));
+#endif
+    memcpy(payload, ram() + at("payload"), sizeof(payload));
+    memcpy(readBuffers, ram() + at("readBuffers"), sizeof(readBuffers));
+    for (size_t i = 0; i < sizeof(segments) / sizeof(I2C::segment_t); i++) {
+        I2C::segment_t &segment = reinterpret_cast<I2C::segment_t *>(segments)[i];
+        uint16_t address = at("segments") + i * segmentSize;
+        segment.buffer = toHost(get(address, 2), "a segment");
+        segment.size = get(address + 2, sizeBytes);
+    }
+}
+
+// ----------------------- machine ---------------------- //
+
+// For the registers the asm interrupt starts with and the ones a callback leaves
+uint32_t scrambleValue = 0x12345678;
+
+uint8_t scrambleByte() {
+    // xorshift32, apart from the walk so both interrupts see the same one
+    scrambleValue ^= scrambleValue << 13;
+    scrambleValue ^= scrambleValue >> 17;
+    scrambleValue ^= scrambleValue << 5;
+    return scrambleValue;
+}
+
+
+// Runs the asm interrupt on the data space of the layout, with the TWI registers of the walk.
+class Machine : public i2c_avr::Cpu {
+public:
+    uint8_t  ram[0x10000] = {};
+    uint8_t  rom[0x8000] = {};
+    uint64_t twsrRead = 0; // cycle the last read of TWSR started at
+
+    explicit Machine(const i2c_avr::Program &program) : Cpu(program) {}
+
+    uint8_t load(uint16_t address) override {
+        if (address >= i2c_host::Node::TWBR_ADDRESS && address <= i2c_host::Node::TWCR_ADDRESS) {
+            if (address == i2c_host::Node::TWSR_ADDRESS) {
+                twsrRead = cycles;
+            }
+            return registers.read(address);
+        }
+        if (!placed[address] && !(address >= stackBottom && address <= stackTop)) {
+            fault = "reads " + describe(address) + ", which is none of its variables";
+        }
+        return ram[address];
+    }
+
+    void store(uint16_t address, uint8_t value) override {
+        if (address >= i2c_host::Node::TWBR_ADDRESS && address <= i2c_host::Node::TWCR_ADDRESS) {
+            registers.write(address, value);
+            return;
+        }
+        if (!placed[address] && !(address >= stackBottom && address <= stackTop)) {
+            fault = "writes " + describe(address) + ", which is none of its variables";
+            return;
+        }
+        ram[address] = value;
+    }
+
+    uint8_t loadProgram(uint16_t address) override {
+        if (address < flashData || address >= flashData + sizeof(flashPayload)) {
+            fault = "reads flash at " + hex(address) + ", outside flashPayload";
+            return 0;
+        }
+        return rom[address];
+    }
+
+    // Calls the callback with the state of the machine, and copies the state back.
+    void external(uint32_t word) override {
+        if (word < callbacks || word - callbacks >= callbackTable.size()) {
+            fault = "calls " + hex(word) + ", which is not a callback";
+            return;
+        }
+        const Callback &callback = callbackTable[word - callbacks];
+        if (r[1]) {
+            fault = "calls a callback with r1 = " + hex(r[1]) + ", where C code needs 0";
+            return;
+        }
+        deserialize();
+        if (callback.withArguments) {
+            // onComplete(ticket, error) takes its arguments in r24 and r22
+            reinterpret_cast<void (*)(uint8_t, uint8_t)>(callback.function)(r[24], r[22]);
+        } else {
+            callback.function();
+        }
+        serialize();
+        // A C function may change every call-clobbered register and every flag of SREG but I
+        r[0] = scrambleByte();
+        for (uint8_t i = 18; i < 28; i++) {
+            r[i] = scrambleByte();
+        }
+        r[30] = scrambleByte();
+        r[31] = scrambleByte();
+        sreg = (sreg & _BV(i2c_avr::FLAG_I)) | (scrambleByte() & ~_BV(i2c_avr::FLAG_I));
+    }
+};
+
+i2c_avr::Program program;
+Machine          machine(program);
+
+uint8_t *ram() {
+    return machine.ram;
+}
+
+uint8_t *rom() {
+    return machine.rom;
+}
+
+// ------------------------ source ---------------------- //
+
+struct Operand {
+    std::string name;
+    char        constraint; // 'm' or 'i'
+    std::string expression;
+};
+
+std::string       assembly;
+std::vector<Operand> operands;
+
+// Takes the asm statement of ISR(TWI_vect, ISR_NAKED) from the header: the R"( )" pieces, joined in the configuration
+// this was built with, and the operands after them.
+void extract(const std::string &header) {
+    static const std::map<std::string, int> macros = {
+        { "I2C_RECEIVE_QUEUE_SIZE", I2C_RECEIVE_QUEUE_SIZE },
+    };
+    size_t start = header.find("ISR(TWI_vect, ISR_NAKED) {");
+    size_t end = header.find("\n}\n", start);
+    if (start == std::string::npos || end == std::string::npos) {
+        fail("ISR(TWI_vect, ISR_NAKED) is not in the header");
+    }
+    std::string body;
+    std::vector<bool> conditions;
+    size_t position = start;
+    while (position < end) {
+        size_t lineEnd = header.find('\n', position);
+        std::string line = header.substr(position, lineEnd - position);
+        position = lineEnd + 1;
+        if (!line.empty() && line[0] == '#') {
+            std::smatch match;
+            if (std::regex_match(line, match, std::regex("#if (!?)(\\w+)\\s*"))) {
+                if (!macros.count(match[2])) {
+                    fail("the asm depends on %s, which isdiff does not know", match[2].str().c_str());
+                }
+                conditions.push_back((macros.at(match[2]) != 0) != (match[1] == "!"));
+            } else if (line.compare(0, 5, "#else") == 0 && !conditions.empty()) {
+                conditions.back() = !conditions.back();
+            } else if (line.compare(0, 6, "#endif") == 0 && !conditions.empty()) {
+                conditions.pop_back();
+            } else {
+                fail("unexpected preprocessor line in the ISR: %s", line.c_str());
+            }
+            continue;
+        }
+        bool active = true;
+        for (bool condition : conditions) {
+            active = active && condition;
+        }
+        if (active) {
+            body += line + "\n";
+        }
+    }
+    size_t operandsStart = 0;
+    for (size_t piece = body.find("R\"("); piece != std::string::npos; piece = body.find("R\"(", piece)) {
+        size_t pieceEnd = body.find(")\"", piece);
+        assembly += body.substr(piece + 3, pieceEnd - piece - 3);
+        piece = operandsStart = pieceEnd + 2;
+    }
+    std::regex operandPattern("\\s*\\[(\\w+)\\]\\s*\"=?([mi])\"\\s*\\((.*)\\),?\\s*");
+    size_t lineStart = operandsStart;
+    while (lineStart < body.size()) {
+        size_t lineEnd = body.find('\n', lineStart);
+        std::string line = body.substr(lineStart, lineEnd - lineStart);
+        lineStart = lineEnd + 1;
+        std::smatch match;
+        if (std::regex_match(line, match, operandPattern)) {
+            operands.push_back({ match[1], match[2].str()[0], match[3] });
+        }
+    }
+}
+
+// Binds the operands to the layout by their C expressions, and substitutes them like avr-gcc does: a "m" operand by
+// the symbol of its variable, and a "i" operand by its value.
+std::string bind(std::map<std::string, int64_t> &symbols) {
+    std::map<std::string, int64_t> immediates = {
+        { "sizeof(i2c_detail::transaction_t)", transactionSize },
+        { "sizeof(i2c_detail::queue)", transactionSize * I2C_QUEUE_SIZE },
+        { "offsetof(i2c_detail::transaction_t, flags)", flagsOffset },
+        { "sizeof(I2C::size_type) > 1", sizeBytes > 1 },
+        { "I2C_RX_BUFFER_SIZE", I2C_RX_BUFFER_SIZE },
+        { "I2C_ARBITRATION_RETRIES", I2C_ARBITRATION_RETRIES },
+#if I2C_RECEIVE_QUEUE_SIZE
+        { "sizeof(i2c_detail::frame_t)", frameSize },
+        { "offsetof(i2c_detail::frame_t, generalCall)", sizeBytes },
+        { "I2C_RECEIVE_QUEUE_SIZE", I2C_RECEIVE_QUEUE_SIZE },
+#endif
+    };
+    std::map<std::string, std::string> substitutes;
+    for (const Operand &operand : operands) {
+        if (operand.constraint == 'm') {
+            std::smatch match;
+            if (!std::regex_match(operand.expression, match, std::regex("i2c_detail::(\\w+)")) || !addresses.count(match[1])) {
+                fail("operand %s binds %s, which has no place in the layout", operand.name.c_str(), operand.expression.c_str());
+            }
+            substitutes[operand.name] = "i2c_" + match[1].str();
+            symbols["i2c_" + match[1].str()] = at(match[1]);
+        } else {
+            if (!immediates.count(operand.expression)) {
+                fail("operand %s is %s, which has no value in the layout", operand.name.c_str(), operand.expression.c_str());
+            }
+            substitutes[operand.name] = std::to_string(immediates.at(operand.expression));
+        }
+    }
+    std::string text;
+    for (size_t i = 0; i < assembly.size(); i++) {
+        if (assembly[i] != '%') {
+            text += assembly[i];
+            continue;
+        }
+        size_t close = assembly.find(']', i);
+        if (assembly.compare(i, 2, "%[") != 0 || close == std::string::npos) {
+            fail("a %% in the asm is not an operand");
+        }
+        std::string name = assembly.substr(i + 2, close - i - 2);
+        if (!substitutes.count(name)) {
+            fail("the asm uses %%[%s], which is not an operand", name.c_str());
+        }
+        text += substitutes.at(name);
+        i = close;
+    }
+    return text;
+}
+
+// ------------------------- run ------------------------ //
+
+// What a run of the asm interrupt took
+struct Run {
+    uint64_t cycles = 0;         // from the first instruction to the end of the reti
+    uint64_t callSavedMinimum = ~(uint64_t)0; // from an rcall of call_saved to the end of its ret
+    uint64_t callSavedMaximum = 0;
+};
+
+uint32_t label(const char *name) {
+    if (!program.labels.count(name)) {
+        fail("the asm has no label %s", name);
+    }
+    return program.labels.at(name) / 2;
+}
+
+// The registers the interrupt was entered with
+struct Entry {
+    uint8_t  r[32];
+    uint8_t  sreg;
+    uint32_t returnWord;
+};
+
+// Takes the interrupt on the current state from random registers, as the hardware does.
+void enter(Entry &entry) {
+    serialize();
+    for (uint8_t i = 0; i < 32; i++) {
+        machine.r[i] = entry.r[i] = scrambleByte();
+    }
+    entry.sreg = machine.sreg = scrambleByte() & ~_BV(i2c_avr::FLAG_I); // cleared when the interrupt is taken
+    entry.returnWord = 0x1000 + (scrambleByte() << 4);
+    machine.sp = stackTop;
+    machine.pushReturn(entry.returnWord);
+    machine.pc = program.origin / 2;
+    machine.cycles = 0;
+    machine.twsrRead = ~(uint64_t)0;
+    machine.fault.clear();
+}
+
+i2c_avr::Cpu::Result step() {
+    i2c_avr::Cpu::Result result = machine.step();
+    if (result == i2c_avr::Cpu::FAULT) {
+        const i2c_avr::Instruction *in = machine.last;
+        fail("the asm interrupt %s (at line %d: %s)", machine.fault.c_str(), in ? in->line : 0,
+             in ? in->text.c_str() : "");
+    }
+    return result;
+}
+
+// Checks the asm interrupt returned where it was entered from, with the registers and SREG it was entered with.
+void checkReturn(const Entry &entry) {
+    if (machine.pc != entry.returnWord || machine.sp != stackTop) {
+        fail("the asm interrupt returns to 0x%04X with SP 0x%04X, not to 0x%04X with SP 0x%04X", machine.pc, machine.sp,
+             entry.returnWord, stackTop);
+    }
+    for (uint8_t i = 0; i < 32; i++) {
+        if (machine.r[i] != entry.r[i]) {
+            fail("the asm interrupt changes r%u from %02X to %02X", i, entry.r[i], machine.r[i]);
+        }
+    }
+    if (machine.sreg != (entry.sreg | _BV(i2c_avr::FLAG_I))) {
+        fail("the asm interrupt changes SREG from %02X to %02X", entry.sreg, machine.sreg);
+    }
+}
+
+// Runs the asm interrupt on the current state from random registers, and copies the state back.
+void runAssembly(Run &run) {
+    uint32_t callSaved = program.labels.count("call_saved") ? label("call_saved") : 0;
+    uint64_t callStart = 0;
+    Entry entry;
+    enter(entry);
+    for (uint32_t steps = 0; ; steps++) {
+        if (steps == 100000) {
+            fail("the asm interrupt does not return");
+        }
+        uint64_t before = machine.cycles;
+        if (step() == i2c_avr::Cpu::RETURNED) {
+            break;
+        }
+        if (machine.last->op == i2c_avr::OP_RCALL && machine.pc == callSaved) {
+            callStart = before;
+        } else if (machine.last->op == i2c_avr::OP_RET && callStart) {
+            uint64_t cycles = machine.cycles - callStart;
+            run.callSavedMinimum = cycles < run.callSavedMinimum ? cycles : run.callSavedMinimum;
+            run.callSavedMaximum = cycles > run.callSavedMaximum ? cycles : run.callSavedMaximum;
+            callStart = 0;
+        }
+    }
+    run.cycles = machine.cycles;
+    checkReturn(entry);
+    deserialize();
+}
+
+// The registers an instruction changes, as a mask
+uint32_t written(const i2c_avr::Instruction &in) {
+    uint32_t mask;
+    switch (in.op) {
+    case i2c_avr::OP_BRBC:
+    case i2c_avr::OP_BRBS:
+    case i2c_avr::OP_CP:
+    case i2c_avr::OP_CPC:
+    case i2c_avr::OP_CPI:
+    case i2c_avr::OP_ICALL:
+    case i2c_avr::OP_IJMP:
+    case i2c_avr::OP_NOP:
+    case i2c_avr::OP_OUT:
+    case i2c_avr::OP_PUSH:
+    case i2c_avr::OP_RCALL:
+    case i2c_avr::OP_RET:
+    case i2c_avr::OP_RETI:
+    case i2c_avr::OP_RJMP:
+    case i2c_avr::OP_SBRC:
+    case i2c_avr::OP_SBRS:
+    case i2c_avr::OP_ST:
+    case i2c_avr::OP_STD:
+    case i2c_avr::OP_STS:
+        mask = 0;
+        break;
+    case i2c_avr::OP_ADIW:
+    case i2c_avr::OP_SBIW:
+        mask = 3u << in.d;
+        break;
+    default:
+        mask = 1u << in.d;
+        break;
+    }
+    if ((in.op == i2c_avr::OP_LD || in.op == i2c_avr::OP_ST || in.op == i2c_avr::OP_LPM) && in.mode != i2c_avr::PLAIN) {
+        mask |= 3u << in.r;
+    }
+    return mask;
+}
+
+std::string registerList(uint32_t mask) {
+    std::string list;
+    for (uint8_t i = 0; i < 32; i++) {
+        if (mask & 1u << i) {
+            list += (list.empty() ? "r" : " r") + std::to_string(i);
+        }
+    }
+    return list.empty() ? "none" : list;
+}
+
+// Checks which registers the prologue and call_saved save, from the code: together they must save exactly the
+// registers a C function may change (r0, r18 to r27, r30 and r31), and r1 which the prologue clears for the C
+// functions, each once. Any other register the interrupt changes must be pushed around the change. Then runs the
+// prologue and the epilogue alone from random registers, and prints the cycles they take.
+void checkFrame() {
+    constexpr uint32_t clobbered = 1u << 0 | 0x0FFCu << 16 | 3u << 30;
+    uint32_t start = program.origin / 2;
+    uint32_t callSaved = program.labels.count("call_saved") ? label("call_saved") : program.end() / 2;
+    uint32_t prologue = 0;     // pushed before the read of TWSR
+    uint32_t callSaves = 0;    // pushed by call_saved before its icall
+    uint32_t bodyPushes = 0;   // pushed anywhere else
+    uint32_t bodyWrites = 0;   // changed outside call_saved, other than by a pop
+    bool     readTwsr = false;
+    bool     calling = false;
+    for (uint32_t word = start; word < program.end() / 2; word++) {
+        const i2c_avr::Instruction *in = program.fetch(word);
+        if (!in) {
+            continue;
+        }
+        readTwsr = readTwsr || (in->op == i2c_avr::OP_LDS && in->k == i2c_host::Node::TWSR_ADDRESS);
+        calling = calling || (word >= callSaved && in->op == i2c_avr::OP_ICALL);
+        if (in->op == i2c_avr::OP_PUSH) {
+            uint32_t &pushes = word >= callSaved ? (calling ? bodyPushes : callSaves) : readTwsr ? bodyPushes : prologue;
+            pushes |= 1u << in->d;
+        }
+        if (word < callSaved && in->op != i2c_avr::OP_POP) {
+            bodyWrites |= written(*in);
+        }
+    }
+    if ((prologue | callSaves) != (clobbered | 1u << 1) || (prologue & callSaves)) {
+        fail("the prologue saves %s and call_saved %s, where together they must save each of %s once",
+             registerList(prologue).c_str(), registerList(callSaves).c_str(), registerList(clobbered | 1u << 1).c_str());
+    }
+    if (bodyWrites & ~(prologue | bodyPushes)) {
+        fail("the asm interrupt changes %s, which neither the prologue saves nor it pushes",
+             registerList(bodyWrites & ~(prologue | bodyPushes)).c_str());
+    }
+    printf("registers: the prologue saves %s, call_saved %s, the rest of the interrupt pushes %s\n",
+           registerList(prologue).c_str(), registerList(callSaves).c_str(), registerList(bodyPushes).c_str());
+
+    Entry entry;
+    enter(entry);
+    while (machine.twsrRead == ~(uint64_t)0) {
+        if (step() != i2c_avr::Cpu::RUNNING) {
+            fail("the asm interrupt returns before it reads TWSR");
+        }
+    }
+    uint64_t prologueCycles = machine.twsrRead;
+    machine.pc = label("pop_reti");
+    uint64_t epilogueStart = machine.cycles;
+    for (uint32_t steps = 0; step() != i2c_avr::Cpu::RETURNED; steps++) {
+        if (steps == 1000) {
+            fail("the epilogue does not return");
+        }
+    }
+    checkReturn(entry);
+    printf("frame: the prologue takes %llu cycles up to the read of TWSR, the epilogue %llu from pop_reti to the end "
+           "of the reti\n", (unsigned long long)prologueCycles, (unsigned long long)(machine.cycles - epilogueStart));
+}
+
+// ------------------------ main ------------------------ //
+
+struct StatusCycles {
+    uint32_t count = 0;
+    uint64_t minimum = ~(uint64_t)0;
+    uint64_t maximum = 0;
+};
+
+StatusCycles statusCycles[32];
+StatusCycles callSavedCycles;
+
+struct StatusName {
+    uint8_t     status;
+    const char *name;
+};
+
+#define NAME(name) { name, #name }
+const StatusName statusNames[] = {
+    NAME(TW_BUS_ERROR), NAME(TW_START), NAME(TW_REP_START), NAME(TW_MT_SLA_ACK), NAME(TW_MT_SLA_NACK),
+    NAME(TW_MT_DATA_ACK), NAME(TW_MT_DATA_NACK), NAME(TW_MT_ARB_LOST), NAME(TW_MR_ARB_LOST), NAME(TW_MR_SLA_ACK),
+    NAME(TW_MR_SLA_NACK), NAME(TW_MR_DATA_ACK), NAME(TW_MR_DATA_NACK), NAME(TW_SR_SLA_ACK), NAME(TW_SR_ARB_LOST_SLA_ACK),
+    NAME(TW_SR_GCALL_ACK), NAME(TW_SR_ARB_LOST_GCALL_ACK), NAME(TW_SR_DATA_ACK), NAME(TW_SR_DATA_NACK),
+    NAME(TW_SR_GCALL_DATA_ACK), NAME(TW_SR_GCALL_DATA_NACK), NAME(TW_SR_STOP), NAME(TW_ST_SLA_ACK),
+    NAME(TW_ST_ARB_LOST_SLA_ACK), NAME(TW_ST_DATA_ACK), NAME(TW_ST_DATA_NACK), NAME(TW_ST_LAST_DATA),
+    NAME(TW_NO_INFO),
+};
+#undef NAME
+
+const char *statusName(uint8_t status) {
+    for (const StatusName &name : statusNames) {
+        if (name.status == status) {
+            return name.name;
+        }
+    }
+    return "(unused)";
+}
+
+// Runs the prologue and the dispatch for every status with every prescaler, and checks that each lands on the labels
+// named after its status, or on default if there are none. Prints where each lands and the cycles from the start of
+// the read of TWSR to the first instruction there.
+void checkDispatch() {
+    std::map<uint32_t, std::string> handlers; // the TW_ labels and default, by address
+    for (const auto &label : program.labels) {
+        if (label.first.compare(0, 3, "TW_") != 0 && label.first != "default") {
+            continue;
+        }
+        bool known = label.first == "default";
+        for (const StatusName &name : statusNames) {
+            known = known || label.first == name.name;
+        }
+        if (!known) {
+            fail("the asm has a label %s, which is not a TWI status", label.first.c_str());
+        }
+        std::string &names = handlers[label.second];
+        names += names.empty() ? label.first : "/" + label.first;
+    }
+    uint64_t minimum = ~(uint64_t)0;
+    uint64_t maximum = 0;
+    printf("dispatch: status, label, cycles from the read of TWSR to the label\n");
+    for (uint16_t status = 0; status < 0x100; status += 8) {
+        std::string expected = "default";
+        for (const StatusName &name : statusNames) {
+            if (name.status == status && program.labels.count(name.name)) {
+                uint32_t address = program.labels.at(name.name);
+                if (expected != "default" && program.labels.at(expected) != address) {
+                    fail("%s and %s are both 0x%02X but label different code", expected.c_str(), name.name, status);
+                }
+                expected = name.name;
+            }
+        }
+        uint64_t first = 0;
+        for (uint8_t prescaler = 0; prescaler < 4; prescaler++) {
+            registers.twsr = status | prescaler;
+            Entry entry;
+            enter(entry);
+            for (uint32_t steps = 0; machine.twsrRead == ~(uint64_t)0 || !handlers.count(machine.pc * 2); steps++) {
+                if (steps == 1000 || step() == i2c_avr::Cpu::RETURNED) {
+                    fail("TWSR 0x%02X reaches none of the TW_ labels or default", registers.twsr);
+                }
+            }
+            if (machine.pc * 2 != program.labels.at(expected)) {
+                fail("TWSR 0x%02X lands on %s, not on %s", registers.twsr, handlers.at(machine.pc * 2).c_str(),
+                     expected.c_str());
+            }
+            uint64_t cycles = machine.cycles - machine.twsrRead;
+            if (prescaler && cycles != first) {
+                fail("TWSR 0x%02X takes %llu cycles to dispatch, 0x%02X took %llu", registers.twsr,
+                     (unsigned long long)cycles, status, (unsigned long long)first);
+            }
+            first = cycles;
+        }
+        minimum = first < minimum ? first : minimum;
+        maximum = first > maximum ? first : maximum;
+        printf("  0x%02X %-28s %-24s %3llu\n", status, statusName(status), expected.c_str(), (unsigned long long)first);
+    }
+    printf("dispatch: each status lands on its label with every prescaler, in %llu to %llu cycles\n",
+           (unsigned long long)minimum, (unsigned long long)maximum);
+}
+
+void walk(uint32_t calls, uint32_t seeds) {
+    State initial;
+    capture(initial);
+    for (seed = 1; seed <= seeds; seed++) {
+        apply(initial);
+        randomValue = seed * 0x9E37;
+        history.clear();
+        for (callNumber = 1; callNumber <= calls; callNumber++) {
+            loop();
+            Mode before = mode;
+            uint8_t status = nextStatus();
+            registers.twsr = status | (randomByte() & 3); // with random prescaler bits
+            registers.twdr = randomByte();
+            history.push_back({ registers.twsr, registers.twdr, before });
+            eventCount = 0;
+
+            State start;
+            capture(start);
+            registers.writes.clear();
+            TWI_vect();
+            State c;
+            capture(c);
+            std::vector<Registers::Write> cWrites = registers.writes;
+
+            apply(start);
+            registers.writes.clear();
+            Run run;
+            runAssembly(run);
+            State assembly;
+            capture(assembly);
+            compare(c, assembly, cWrites, registers.writes);
+
+            StatusCycles &cycles = statusCycles[status >> 3];
+            cycles.count++;
+            cycles.minimum = run.cycles < cycles.minimum ? run.cycles : cycles.minimum;
+            cycles.maximum = run.cycles > cycles.maximum ? run.cycles : cycles.maximum;
+            if (run.callSavedMaximum) {
+                callSavedCycles.count++;
+                callSavedCycles.minimum = run.callSavedMinimum < callSavedCycles.minimum ? run.callSavedMinimum : callSavedCycles.minimum;
+                callSavedCycles.maximum = run.callSavedMaximum > callSavedCycles.maximum ? run.callSavedMaximum : callSavedCycles.maximum;
+            }
+            update(status);
+        }
+    }
+    history.clear();
+}
+
+std::string readFile(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fail("cannot open %s", path);
+    }
+    std::string text;
+    char buffer[4096];
+    size_t size;
+    while ((size = fread(buffer, 1, sizeof(buffer), file))) {
+        text.append(buffer, size);
+    }
+    fclose(file);
+    return text;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf("usage: isr_diff ArduboyI2C.h [interrupts per seed] [seeds]\n");
+        return 2;
+    }
+    uint32_t calls = argc > 2 ? atoi(argv[2]) : 100000;
+    uint32_t seeds = argc > 3 ? atoi(argv[3]) : 10;
+
+    for (uint16_t i = 0; i < I2C_DIFF_PAYLOAD; i++) {
+        payload[i] = i * 7 + 1;
+        flashPayload[i] = i * 13 + 5;
+    }
+    hostNode.registerHook = &registers;
+    I2C::onRequest(onRequest);
+    I2C::onRequestMore(onRequestMore);
+    I2C::onReceive(onReceive);
+    I2C::onComplete(onComplete);
+#ifdef I2C_ADAPTIVE_LINK
+    linkStarted = true; // so onComplete counts errors and changes the rate
+#endif
+    registers.twcr = _BV(TWEN) | _BV(TWIE) | _BV(TWEA);
+    layout();
+
+    extract(readFile(argv[1]));
+    std::map<std::string, int64_t> symbols;
+    std::string source = bind(symbols);
+    // Placed so the jump table ends in the next 256 words, which the dispatch has to carry into
+    if (!program.assemble(source, 0, symbols)) {
+        fail("the asm does not assemble: %s", program.error.c_str());
+    }
+    if (program.labels.count("jump_table")) {
+        uint32_t origin = (0x4F0 - label("jump_table")) * 2;
+        if (!program.assemble(source, origin, symbols)) {
+            fail("the asm does not assemble: %s", program.error.c_str());
+        }
+    }
+    printf("assembled: %u words, %zu operands (30 is the most an asm statement can have)\n",
+           (program.end() - program.origin) / 2, operands.size());
+
+    checkFrame();
+    checkDispatch();
+    if (!calls) {
+        return 0;
+    }
+    walk(calls, seeds);
+    printf("walk: %u interrupts from each of %u seeds, the asm interrupt did the same as the C one in all of them\n",
+           calls, seeds);
+    if (callSavedCycles.count) {
+        printf("call_saved: %llu to %llu cycles from the rcall to the end of its ret, the callback not counted\n",
+               (unsigned long long)callSavedCycles.minimum, (unsigned long long)callSavedCycles.maximum);
+    }
+    printf("cycles from the first instruction to the end of the reti, callbacks not counted:\n");
+    printf("  status                              calls    min    max\n");
+    for (uint8_t i = 0; i < 32; i++) {
+        const StatusCycles &cycles = statusCycles[i];
+        if (!cycles.count) {
+            continue;
+        }
+        printf("  0x%02X %-28s %8u %6llu %6llu\n", i << 3, statusName(i << 3), cycles.count,
+               (unsigned long long)cycles.minimum, (unsigned long long)cycles.maximum);
+    }
+    return 0;
+}
@@ -0,0 +1,32 @@
+#!/bin/sh
+# Builds isr_diff.cpp for each configuration of the library below and runs it, which runs the asm interrupt on an
+# emulated ATmega32u4 against the C one. Writes what each run printed to results.txt, and exits with the status of the
+# first run that fails.
+#   ./run.sh                              100000 interrupts for each of 10 seeds
+#   CALLS=1000000 SEEDS=100 ./run.sh      longer
+set -e
+cd "$(dirname "$0")"
+build=build
+mkdir -p $build
+: > results.txt
+for configuration in \
+    "" \
+    "-DI2C_RECEIVE_QUEUE_SIZE=2" \
+    "-DI2C_LONG_TRANSFERS" \
+    "-DI2C_LONG_TRANSFERS -DI2C_RX_BUFFER_SIZE=300 -DI2C_DIFF_PAYLOAD=300 -DI2C_DIFF_END=512" \
+    "-DI2C_LONG_TRANSFERS -DI2C_RECEIVE_QUEUE_SIZE=2" \
+    "-DI2C_QUEUE_BUFFER_SIZE=0" \
+    "-DI2C_ARBITRATION_RETRIES=0" \
+    "-DI2C_ADAPTIVE_LINK -DI2C_MAX_PLAYERS=4"; do
+    g++ -std=gnu++11 -O2 -Wall -Wextra -Werror $CXXFLAGS -I../../src $configuration isr_diff.cpp -o $build/isr_diff
+    echo "== ${configuration:-default}" | tee -a results.txt
+    $build/isr_diff ../../src/ArduboyI2C.h ${CALLS:-100000} ${SEEDS:-10} | tee -a results.txt
+    echo >> results.txt
+done
+# For comparison, the interrupt from before the jump table and call_saved, which dispatched through a cpi/breq chain
+# and saved every call-clobbered register in its prologue (only checked and measured, as the rest has changed since)
+if git show 436474e~1:src/ArduboyI2C.h > $build/chain.h 2> /dev/null; then
+    g++ -std=gnu++11 -O2 -Wall -Wextra -Werror $CXXFLAGS -I../../src isr_diff.cpp -o $build/isr_diff
+    echo "== before the jump table and call_saved" | tee -a results.txt
+    $build/isr_diff $build/chain.h 0 | tee -a results.txt
+fi
@@ -0,0 +1,87 @@
+// examples/BasicExample for the simulator: the same exchange of player data, without Arduboy2.
+// Each player walks its square around on its own instead of following the D-Pad, one step a frame, so the others can
+// check that what they receive is where it has to be and fail the simulator if it is not.
+// define in one file before including
+#define I2C_IMPLEMENTATION
+// declare the number of players in the handshake (set on the command line, see Simulator.h)
+#ifndef I2C_MAX_PLAYERS
+#define I2C_MAX_PLAYERS 4
+#endif
+#include "ArduboyI2C.h"
+
+struct player_t {
+    // this is used to identify our message as belonging to us
+    uint8_t id;
+    // general data
+    uint8_t x;
+    uint8_t y;
+};
+// player data array
+player_t players[I2C_MAX_PLAYERS];
+
+// stores unique id from 0 to I2C_MAX_PLAYERS - 1
+uint8_t id;
+
+unsigned long lastFrame;
+
+// The frames a player has walked, from where it is: x and y both start at 0 and change by 1 each frame.
+uint8_t stepsX(uint8_t playerId, uint8_t x) {
+    return playerId & 1 ? x : -x;
+}
+uint8_t stepsY(uint8_t playerId, uint8_t y) {
+    return playerId & 2 ? y : -y;
+}
+
+void onReceive() {
+    uint8_t *buffer = I2C::getBuffer();
+    // simulator only: the data must be a whole packet of another player, a step or more after the last. Packets are
+    // missed where this player lost arbitration to the sender in the data of the general call, so any step forwards is fine.
+    i2c_host::Simulator &simulator = i2c_host::Simulator::instance();
+    if (I2C::getReceivedSize() != sizeof(player_t) || buffer[0] >= I2C_MAX_PLAYERS || buffer[0] == id) {
+        simulator.fail("received %u bytes from id %u", I2C::getReceivedSize(), buffer[0]);
+        return;
+    }
+    uint8_t steps = stepsX(buffer[0], buffer[1]);
+    uint8_t newSteps = steps - stepsX(buffer[0], players[buffer[0]].x);
+    if (steps != stepsY(buffer[0], buffer[2]) || (int8_t)newSteps <= 0) {
+        simulator.fail("id %u moved from %u, %u to %u, %u", buffer[0], players[buffer[0]].x, players[buffer[0]].y,
+                       buffer[1], buffer[2]);
+    }
+    // copy data to buffer[0] (id)
+    players[buffer[0]].x = buffer[1];
+    players[buffer[0]].y = buffer[2];
+}
+// main functions
+void setup() {
+    // initialize I2C(twi) hardware
+    I2C::init();
+    // get unique id and wait for other players to join
+    // Note: I2C::handshake enables general calls by default
+    id = I2C::handshake();
+
+    // if the handshake has been completed (I2C_MAX_PLAYERS has been reached), stop
+    if (id == I2C_HANDSHAKE_FAILED) {
+        for (;;) {
+            delay(1000);
+        }
+    }
+    // setup our rx event to be called when we receive a write
+    I2C::onReceive(onReceive);
+    // identify our player data packets
+    players[id].id = id;
+}
+
+void loop() {
+    // wait for next frame (60 FPS, like Arduboy2)
+    if (millis() - lastFrame < 1000 / 60) {
+        delay(1);
+        return;
+    }
+    lastFrame = millis();
+    // move our player around
+    players[id].x += id & 1 ? 1 : -1;
+    players[id].y += id & 2 ? 1 : -1;
+
+    // send out a general call to give every other device our data
+    I2C::write(0x00, &players[id], false);
+}
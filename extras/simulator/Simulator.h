@@ -0,0 +1,234 @@
+/*
+MIT License
+
+Copyright (c) 2024 sub1inear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/** @file
+ * \brief
+ * Runs several Arduboys, each with its own copy of the library and sketch, on one virtual SDA/SCL bus.
+ * \details
+ * Every player is a translation unit of its own (player.cpp) which includes the sketch, and with it the library,
+ * inside a namespace `player<n>`, so each gets its own I2C class, buffers and i2c_host::Node.
+ * The players run one at a time as coroutines, the one furthest behind in bus time first, and none runs more than
+ * i2c_host::Scheduler::quantum cycles ahead of the others, so the same build and settings always give the same run.
+ * The bus is the bit-level model of ArduboyI2CHost.h, so arbitration (wired-AND), clock stretching and clock
+ * synchronization happen like on the hardware, and its timing can be changed through i2c_host::defaultBus()
+ * (rise time and START detection) and each player's node (power-on time, clock error and interrupt cycles). \n
+ * Building 4 players of the BasicExample sketch from this directory:
+ * \code
+ * for i in 0 1 2 3; do
+ *     g++ -std=gnu++11 -O2 -I../../src -DI2C_SIMULATOR_PLAYER=$i -DI2C_SIMULATOR_SKETCH='"BasicExample.h"' \
+ *         -DI2C_MAX_PLAYERS=4 -c player.cpp -o player$i.o
+ * done
+ * g++ -std=gnu++11 -O2 -I../../src simulator.cpp player0.o player1.o player2.o player3.o -o simulator
+ * ./simulator --seconds 10 --seed 1
+ * \endcode
+ * A sketch is an Arduino sketch without the Arduboy2 library: it defines setup() and loop() and includes ArduboyI2C.h
+ * with `I2C_IMPLEMENTATION`. It can use millis(), micros(), delay() and delayMicroseconds(), which count the cycles
+ * of its own node. loop() has to let time pass, with them or through the library, or the other players never run.
+ * A sketch checks what it receives itself and reports anything wrong with i2c_host::Simulator::fail, which makes
+ * simulator.cpp exit with 1. \n
+ * Linux (and other POSIX systems with ucontext) only.
+ */
+#pragma once
+#include "ArduboyI2CHost.h"
+#include <ucontext.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+
+namespace i2c_host {
+
+/** \brief
+ * Runs the players registered by player.cpp on the default bus.
+ */
+class Simulator : public Scheduler {
+public:
+    struct Player {
+        uint8_t     index;
+        Node       *node;
+        void      (*setup)();
+        void      (*loop)();
+        cycles_t    time = 0; // the bus time the player has run up to
+        bool        started = false;
+        ucontext_t  context;
+        std::vector<char> stack;
+    };
+
+    // Adds a player at static initialization, see player.cpp.
+    struct Registration {
+        Registration(uint8_t index, Node &node, void (*setup)(), void (*loop)()) {
+            instance().add(index, node, setup, loop);
+        }
+    };
+
+    // The simulator of the default bus. Never destroyed, as the players may still be suspended at exit.
+    static Simulator &instance() {
+        static Simulator *simulator = new Simulator();
+        return *simulator;
+    }
+
+    size_t size() const {
+        return players.size();
+    }
+
+    // The players in the order of their index.
+    Player &player(size_t index) {
+        return *players[index];
+    }
+
+    // The node of the player which is running, for millis() and the like.
+    Node &node() {
+        return *current->node;
+    }
+
+    // Runs every player until the bus time. Players which have not started yet start at the time in Node::origin.
+    // Returns false if a player called stop() first.
+    bool run(cycles_t until) {
+        limit = until;
+        stopped = false;
+        for (Player *player : players) {
+            if (!player->started) {
+                player->started = true;
+                player->time = player->node->origin;
+                player->stack.resize(stackSize);
+                getcontext(&player->context);
+                player->context.uc_stack.ss_sp = player->stack.data();
+                player->context.uc_stack.ss_size = player->stack.size();
+                player->context.uc_link = nullptr;
+                makecontext(&player->context, entry, 0);
+            }
+        }
+        current = earliest();
+        if (current) {
+            swapcontext(&mainContext, &current->context);
+        }
+        if (stopped) {
+            return false;
+        }
+        defaultBus().run(until);
+        return true;
+    }
+
+    // Called by a player to return from run() where every player is. run() can be called again to carry on.
+    void stop() {
+        limit = 0;
+        stopped = true;
+        sync(current->time);
+    }
+
+    // Called by a player when what it received or got back is wrong. Prints the message with the index of the player
+    // and counts it, so the program running the players can fail.
+    void fail(const char *format, ...) {
+        va_list args;
+        va_start(args, format);
+        fprintf(stderr, "player %u: ", current->index);
+        vfprintf(stderr, format, args);
+        fputc('\n', stderr);
+        va_end(args);
+        failureCount++;
+    }
+
+    uint32_t failures() const {
+        return failureCount;
+    }
+
+    void sync(cycles_t time) override {
+        current->time = time;
+        for (;;) {
+            Player *next = earliest();
+            if (next == current) {
+                return;
+            }
+            // Another player is further behind, or every player has reached the limit
+            Player *from = current;
+            current = next;
+            swapcontext(&from->context, next ? &next->context : &mainContext);
+        }
+    }
+
+private:
+    static constexpr size_t stackSize = 256 * 1024;
+
+    std::vector<Player *> players;
+    Player               *current = nullptr;
+    cycles_t              limit = 0;
+    bool                  stopped = false;
+    uint32_t              failureCount = 0;
+    ucontext_t            mainContext;
+
+    Simulator() {
+        defaultBus().scheduler = this;
+    }
+
+    void add(uint8_t index, Node &node, void (*setup)(), void (*loop)()) {
+        Player *player = new Player();
+        player->index = index;
+        player->node = &node;
+        player->setup = setup;
+        player->loop = loop;
+        // Sorted so the order does not depend on the order of static initialization
+        players.insert(std::upper_bound(players.begin(), players.end(), player,
+                                        [](const Player *a, const Player *b) { return a->index < b->index; }),
+                       player);
+    }
+
+    // The player furthest behind, or nullptr once every player has reached the limit. Ties go to the lowest index.
+    Player *earliest() const {
+        Player *next = nullptr;
+        for (Player *player : players) {
+            if (player->time < limit && (!next || player->time < next->time)) {
+                next = player;
+            }
+        }
+        return next;
+    }
+
+    static void entry() {
+        Player &player = *instance().current;
+        defaultBus().run(player.time); // powered on
+        player.setup();
+        for (;;) {
+            player.loop();
+        }
+    }
+};
+
+}
+
+// ------------------------ Arduino ------------------------ //
+
+inline unsigned long micros() {
+    return i2c_host::Simulator::instance().node().cycles / (F_CPU / 1000000);
+}
+
+inline unsigned long millis() {
+    return i2c_host::Simulator::instance().node().cycles / (F_CPU / 1000);
+}
+
+inline void delayMicroseconds(unsigned int us) {
+    i2c_host::Simulator::instance().node().delay((i2c_host::cycles_t)us * (F_CPU / 1000000));
+}
+
+inline void delay(unsigned long ms) {
+    i2c_host::Simulator::instance().node().delay((i2c_host::cycles_t)ms * (F_CPU / 1000));
+}
@@ -0,0 +1,45 @@
+/*
+MIT License
+
+Copyright (c) 2024 sub1inear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+// One player of the simulator, see Simulator.h. Compiled once per player with
+// I2C_SIMULATOR_PLAYER set to its index (0, 1, 2...) and I2C_SIMULATOR_SKETCH to the sketch to include.
+#include "Simulator.h"
+
+#ifndef I2C_SIMULATOR_PLAYER
+#error "I2C_SIMULATOR_PLAYER must be defined to the index of the player."
+#endif
+#ifndef I2C_SIMULATOR_SKETCH
+#error "I2C_SIMULATOR_SKETCH must be defined to the sketch to include, such as \"BasicExample.h\"."
+#endif
+
+#define I2C_SIMULATOR_CAT2(a, b) a##b
+#define I2C_SIMULATOR_CAT(a, b) I2C_SIMULATOR_CAT2(a, b)
+#define I2C_SIMULATOR_NAMESPACE I2C_SIMULATOR_CAT(player, I2C_SIMULATOR_PLAYER)
+
+// The host header and the system headers are already included, so only the library and the sketch end up in the namespace
+namespace I2C_SIMULATOR_NAMESPACE {
+#include I2C_SIMULATOR_SKETCH
+}
+
+static i2c_host::Simulator::Registration registration(I2C_SIMULATOR_PLAYER, I2C_SIMULATOR_NAMESPACE::i2c_detail::hostNode,
+                                                      I2C_SIMULATOR_NAMESPACE::setup, I2C_SIMULATOR_NAMESPACE::loop);
@@ -0,0 +1,121 @@
+/*
+MIT License
+
+Copyright (c) 2024 sub1inear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+// Runs the players linked in (see Simulator.h) and prints the throughput and collisions on the bus.
+// Exits with 1 if a player reported that something it received was wrong (see Simulator::fail).
+//   --seconds N   simulated time (default 10)
+//   --seed N      seeds the power-on times and clock errors of the players (default 1)
+//   --spread MS   the players are powered on at random within this many milliseconds (default 100)
+//   --ppm N       clock errors are random within +-N parts per million (default 100)
+//   --rise N      rise time of the lines in cycles (default 0)
+//   --sync N      cycles a START takes to be seen by the other TWIs (default 3)
+//   --isr N       cycles of the TWI interrupt (default I2C_HOST_ISR_CYCLES)
+#include "Simulator.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace i2c_host;
+
+static uint32_t randomState;
+
+// xorshift32, so runs are the same on every host
+static uint32_t random32() {
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState;
+}
+
+int main(int argc, char **argv) {
+    unsigned long seconds = 10;
+    unsigned long seed = 1;
+    unsigned long spread = 100;
+    unsigned long ppm = 100;
+    unsigned long isrCycles = I2C_HOST_ISR_CYCLES;
+    Bus &bus = defaultBus();
+    Simulator &simulator = Simulator::instance();
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        unsigned long value = strtoul(argv[i + 1], nullptr, 0);
+        if (!strcmp(argv[i], "--seconds")) {
+            seconds = value;
+        } else if (!strcmp(argv[i], "--seed")) {
+            seed = value;
+        } else if (!strcmp(argv[i], "--spread")) {
+            spread = value;
+        } else if (!strcmp(argv[i], "--ppm")) {
+            ppm = value;
+        } else if (!strcmp(argv[i], "--rise")) {
+            bus.riseCycles = value;
+        } else if (!strcmp(argv[i], "--sync")) {
+            bus.startSyncCycles = value;
+        } else if (!strcmp(argv[i], "--isr")) {
+            isrCycles = value;
+        } else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (!simulator.size()) {
+        fprintf(stderr, "no players linked in\n");
+        return 1;
+    }
+
+    randomState = seed ? seed : 1;
+    for (size_t i = 0; i < simulator.size(); i++) {
+        Node &node = *simulator.player(i).node;
+        node.origin = spread ? random32() % (spread * (F_CPU / 1000)) : 0;
+        node.clockError = ppm ? (int32_t)(random32() % (2 * ppm + 1)) - (int32_t)ppm : 0;
+        node.isrCycles = isrCycles;
+    }
+
+    cycles_t end = (cycles_t)seconds * F_CPU;
+    simulator.run(end);
+
+    uint32_t starts = 0;
+    uint32_t losses = 0;
+    uint32_t bytes = 0;
+    printf("player  power-on ms  clock ppm  starts  arb lost  bus errors  bytes sent  bytes received  interrupts\n");
+    for (size_t i = 0; i < simulator.size(); i++) {
+        Simulator::Player &player = simulator.player(i);
+        const Node::Stats &stats = player.node->stats;
+        printf("%6u  %11.3f  %9ld  %6lu  %8lu  %10lu  %10lu  %14lu  %10lu\n", player.index,
+               (double)player.node->origin / (F_CPU / 1000), (long)player.node->clockError, (unsigned long)stats.starts,
+               (unsigned long)stats.arbitrationLosses, (unsigned long)stats.busErrors, (unsigned long)stats.bytesSent,
+               (unsigned long)stats.bytesReceived, (unsigned long)stats.interrupts);
+        starts += stats.starts;
+        losses += stats.arbitrationLosses;
+        bytes += stats.bytesSent;
+    }
+    printf("\n%zu players, %lu s, seed %lu\n", simulator.size(), seconds, seed);
+    printf("transfers %lu, bus busy %.1f%%\n", (unsigned long)bus.stats.transfers, 100.0 * bus.stats.busyCycles / end);
+    printf("collisions %lu of %lu starts (%.2f%%)\n", (unsigned long)losses, (unsigned long)starts,
+           starts ? 100.0 * losses / starts : 0.0);
+    printf("throughput %.1f bytes/s\n", (double)bytes / seconds);
+    if (simulator.failures()) {
+        printf("%lu failures\n", (unsigned long)simulator.failures());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,50 @@
+/*
+MIT License
+
+Copyright (c) 2024 sub1inear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+// Runs a test sketch on the players linked in (see run.sh), like the simulator but for tests: the sketch checks what it
+// received, reports anything wrong with i2c_host::Simulator::fail and stops the simulator once it is done.
+// Exits with 1 if it failed or never stopped.
+#include "Simulator.h"
+#include <stdio.h>
+
+using namespace i2c_host;
+
+// simulated seconds after which the test is given up
+constexpr unsigned long timeout = 60;
+
+int main() {
+    Simulator &simulator = Simulator::instance();
+    // Powered on a millisecond apart so the handshake gives the ids in order
+    for (size_t i = 0; i < simulator.size(); i++) {
+        simulator.player(i).node->origin = i * (F_CPU / 1000);
+    }
+    if (simulator.run((cycles_t)timeout * F_CPU)) {
+        fprintf(stderr, "the test did not finish in %lu s\n", timeout);
+        return 1;
+    }
+    if (simulator.failures()) {
+        printf("%lu failures\n", (unsigned long)simulator.failures());
+        return 1;
+    }
+    return 0;
+}
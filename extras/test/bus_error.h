@@ -0,0 +1,128 @@
+/*
+MIT License
+
+Copyright (c) 2024 sub1inear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+// Bus test (see bus.cpp): a bus error while a device is a target must not fail the transaction it has queued as a
+// controller, which has not started yet, but send it once the bus is free again.
+// The player with id 0 writes to the player with id 1, which queues a write back while it is receiving. Another device
+// on the bus then glitches SDA in the middle of a byte, which is a bus error for both.
+#define I2C_IMPLEMENTATION
+#include "ArduboyI2C.h"
+#include <string.h>
+
+// Pulls SDA low while SCL is high in the middle of a byte once armed (a misplaced START), and releases it again (a STOP)
+class Glitch : public i2c_host::Device {
+public:
+    bool    armed = false;
+    uint8_t rises = 0;
+
+    void onEvent() override {
+        sdaOut = true;
+        i2c_host::defaultBus().update();
+    }
+
+    void onLines(bool scl, bool sda, bool lastScl, bool) override {
+        if (!armed || !scl || lastScl) {
+            return;
+        }
+        // a few bits into a byte, on a 1 so it is an edge
+        if (++rises >= 4 && sda) {
+            armed = false;
+            sdaOut = false;
+            // Long enough for every TWI to take its bus error interrupt, which ends the error, before the bus is free
+            eventTime = i2c_host::defaultBus().now + 4 * I2C_HOST_ISR_CYCLES;
+            i2c_host::defaultBus().update();
+        }
+    }
+};
+
+Glitch glitch;
+
+uint8_t          id;
+uint8_t          data[16];
+uint8_t          reply[4] = { 0x12, 0x34, 0x56, 0x78 };
+uint8_t          replyTicket;
+volatile bool    replyDone;
+volatile uint8_t replyError;
+volatile bool    received;
+unsigned long    joined;
+
+void onReceive() {
+    i2c_host::Simulator &simulator = i2c_host::Simulator::instance();
+    if (id != 0) {
+        return;
+    }
+    if (I2C::getReceivedSize() != sizeof(reply) || memcmp(I2C::getBuffer(), reply, sizeof(reply))) {
+        simulator.fail("received %u bytes which are not the reply", I2C::getReceivedSize());
+    }
+    received = true;
+}
+
+void onComplete(uint8_t ticket, uint8_t error) {
+    if (id == 1 && ticket == replyTicket) {
+        replyError = error;
+        replyDone = true;
+    }
+}
+
+void setup() {
+    for (uint8_t i = 0; i < sizeof(data); i++) {
+        data[i] = 0xFF; // all ones, so the glitch always finds SDA high
+    }
+    I2C::init();
+    id = I2C::handshake();
+    I2C::onReceive(onReceive);
+    I2C::onComplete(onComplete);
+    joined = millis();
+    if (id == 0) {
+        delay(5); // after the read of the handshake, which the player with id 1 still answers
+        I2C::write(I2C::getAddressFromId(1), data, sizeof(data), false);
+    }
+}
+
+void loop() {
+    i2c_host::Simulator &simulator = i2c_host::Simulator::instance();
+    if (id == 0) {
+        if (received) {
+            simulator.stop();
+        }
+        delayMicroseconds(10);
+        return;
+    }
+    // Queued while receiving, so it waits for the bus
+    if (!replyTicket && i2c_detail::active && millis() - joined >= 2) {
+        replyTicket = I2C::write(I2C::getAddressFromId(0), reply, sizeof(reply), false);
+        i2c_host::defaultBus().attach(glitch);
+        glitch.armed = true;
+    }
+    if (replyDone) {
+        replyDone = false;
+        if (!i2c_detail::hostNode.stats.busErrors) {
+            simulator.fail("the glitch did not cause a bus error");
+        }
+        if (replyError != TW_SUCCESS) {
+            simulator.fail("the queued write failed with %02x", replyError);
+            simulator.stop();
+        }
+    }
+    delayMicroseconds(10);
+}
@@ -0,0 +1,123 @@
+/*
+MIT License
+
+Copyright (c) 2024 sub1inear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+// Bus test (see bus.cpp) of transfers larger than the buffers: the player with id 0 writes a message of several buffers
+// to the player with id 1, which puts it together from onReceiveChunk and onReceive and checks it, then reads it back
+// from the target, which streams it in chunks from onRequest and onRequestMore, and checks it.
+#define I2C_IMPLEMENTATION
+#define I2C_BUFFER_SIZE 8
+#include "ArduboyI2C.h"
+#include <string.h>
+
+// not a multiple of the buffer size, so the last part of the write is passed to onReceive
+constexpr uint8_t messageSize = 5 * I2C_BUFFER_SIZE + 3;
+
+uint8_t  id;
+uint8_t  message[messageSize];
+uint8_t  assembled[messageSize + I2C_BUFFER_SIZE];
+uint8_t  assembledSize;
+uint8_t  streamOffset;
+uint8_t  writesChecked;
+uint8_t  readsAnswered;
+
+void append(const uint8_t *data, uint8_t size) {
+    if (assembledSize + size <= sizeof(assembled)) {
+        memcpy(assembled + assembledSize, data, size);
+    }
+    assembledSize += size;
+}
+
+void onReceiveChunk() {
+    append(I2C::getBuffer(), I2C_BUFFER_SIZE);
+}
+
+void onReceive() {
+    append(I2C::getBuffer(), I2C::getReceivedSize());
+    if (assembledSize != messageSize || memcmp(assembled, message, messageSize)) {
+        i2c_host::Simulator::instance().fail("received %u bytes of a %u-byte message, or wrong ones", assembledSize, messageSize);
+    }
+    assembledSize = 0;
+    writesChecked++;
+}
+
+void onRequest() {
+    // Each read follows a write
+    if (writesChecked != ++readsAnswered) {
+        i2c_host::Simulator::instance().fail("read %u came after %u whole writes", readsAnswered, writesChecked);
+    }
+    streamOffset = 0;
+    I2C::transmit(message, I2C_BUFFER_SIZE);
+}
+
+// Every other chunk without copying, as both can follow each other
+void onRequestMore() {
+    streamOffset += I2C_BUFFER_SIZE;
+    if (streamOffset >= messageSize) {
+        return;
+    }
+    uint8_t size = messageSize - streamOffset < I2C_BUFFER_SIZE ? messageSize - streamOffset : I2C_BUFFER_SIZE;
+    if (streamOffset / I2C_BUFFER_SIZE % 2) {
+        I2C::transmitNoCopy(message + streamOffset, size);
+    } else {
+        I2C::transmit(message + streamOffset, size);
+    }
+}
+
+void setup() {
+    for (uint8_t i = 0; i < messageSize; i++) {
+        message[i] = 0xA5 ^ (i * 37 + 1);
+    }
+    I2C::init();
+    id = I2C::handshake();
+    I2C::onReceive(onReceive);
+    I2C::onReceiveChunk(onReceiveChunk);
+    I2C::onRequest(onRequest);
+    I2C::onRequestMore(onRequestMore);
+    if (id != 0) {
+        return;
+    }
+    i2c_host::Simulator &simulator = i2c_host::Simulator::instance();
+    uint8_t target = I2C::getAddressFromId(1);
+
+    // Twice, so the target starts the second one from an empty buffer
+    for (uint8_t i = 0; i < 2; i++) {
+        uint8_t ticket = I2C::writeNoCopy(target, message, messageSize);
+        while (!I2C::isComplete(ticket)) {
+            delay(1);
+        }
+        if (I2C::getTWError() != TW_SUCCESS) {
+            simulator.fail("the write of %u bytes failed with %02x", messageSize, I2C::getTWError());
+        }
+
+        uint8_t got[messageSize] = {};
+        I2C::read(target, got, messageSize);
+        if (I2C::getTWError() != TW_SUCCESS || memcmp(got, message, messageSize)) {
+            simulator.fail("the read of %u bytes failed with %02x or got wrong bytes", messageSize, I2C::getTWError());
+        }
+    }
+    simulator.stop();
+}
+
+void loop() {
+    delay(1);
+}
@@ -0,0 +1,80 @@
+/*
+MIT License
+
+Copyright (c) 2024 sub1inear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+// Checks I2C::setFrequency on the host build: every frequency is rounded down to one the TWI can make, never up,
+// to the fastest such one, and frequencies below the slowest of the TWI do not overflow the bus free window.
+// Prints each failure and exits with 1 if there were any. See run.sh.
+#define I2C_IMPLEMENTATION
+#include "ArduboyI2C.h"
+#include <stdio.h>
+
+static unsigned failures;
+
+// The SCL frequency of TWBR and the prescaler bits of TWSR.
+static double frequencyOf(uint8_t bitRate, uint8_t prescaler) {
+    return (double)F_CPU / (16 + 2 * (uint32_t)bitRate * (1 << 2 * prescaler));
+}
+
+static void check(uint32_t hz) {
+    I2C::setFrequency(hz);
+    uint8_t bitRate = TWBR;
+    uint8_t prescaler = TWSR & 0x03;
+    double actual = frequencyOf(bitRate, prescaler);
+    // Frequencies outside of what the TWI can make are set to the fastest or slowest it has
+    bool fastest = !bitRate && !prescaler;
+    bool slowest = bitRate == 255 && prescaler == 3;
+    if (actual > hz && !fastest && !slowest) {
+        printf("%lu Hz: TWBR %u, prescaler %u gives %.1f Hz, which is faster\n",
+               (unsigned long)hz, bitRate, prescaler, actual);
+        failures++;
+    }
+    if (bitRate && !slowest && frequencyOf(bitRate - 1, prescaler) <= hz) {
+        printf("%lu Hz: TWBR %u, prescaler %u gives %.1f Hz, but TWBR %u is not faster either\n",
+               (unsigned long)hz, bitRate, prescaler, actual, bitRate - 1);
+        failures++;
+    }
+    // Never shorter than the window of the slowest frequency, which it would be if it had overflowed
+    uint16_t slowestSamples = i2c_detail::busFreeSamplesFor(i2c_detail::busFreeTimeFor(i2c_detail::slowestFrequency));
+    if (hz < i2c_detail::slowestFrequency && i2c_detail::busFreeSamples != slowestSamples) {
+        printf("%lu Hz: %u bus free samples instead of the %u of the slowest frequency\n",
+               (unsigned long)hz, i2c_detail::busFreeSamples, slowestSamples);
+        failures++;
+    }
+}
+
+int main() {
+    // F_CPU / 100630 is 158.998..., which truncated to 158 cycles per period would give 101266 Hz
+    const uint32_t frequencies[] = { 100630, 100000, 400000, 1000000, 123457, 999999, 33333, 500, 490, 489, 100, 27, 1 };
+    for (uint32_t hz : frequencies) {
+        check(hz);
+    }
+    for (uint32_t hz = 1; hz <= F_CPU / 8; hz += hz / 1024 + 1) {
+        check(hz);
+    }
+    if (failures) {
+        printf("%u failures\n", failures);
+        return 1;
+    }
+    printf("all frequencies passed\n");
+    return 0;
+}
@@ -0,0 +1,76 @@
+/*
+MIT License
+
+Copyright (c) 2024 sub1inear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+// Bus test (see bus.cpp): with I2C_ADAPTIVE_LINK, a change of the rate while I2C::batch is queueing its transfers must
+// not queue the general call with the new rate between them, where the repeated start would go to it instead.
+// The player with id 0 queues a write, then a batch of 3 writes to the player with id 1. The write completing marks
+// the rate as changed while the batch waits for room in the queue, so its tickets only follow the write if the general
+// call waited for the end of the batch.
+#define I2C_IMPLEMENTATION
+#define I2C_ADAPTIVE_LINK
+#define I2C_QUEUE_SIZE 2
+#include "ArduboyI2C.h"
+
+uint8_t          id;
+uint8_t          writeTicket;
+
+void onComplete(uint8_t ticket, uint8_t) {
+    if (ticket == writeTicket) {
+        i2c_detail::linkBroadcastPending = true; // as if the rate had just changed
+    }
+}
+
+void setup() {
+    I2C::init();
+    id = I2C::handshake();
+    if (id != 0) {
+        return;
+    }
+
+    i2c_host::Simulator &simulator = i2c_host::Simulator::instance();
+    uint8_t target = I2C::getAddressFromId(1);
+    static const uint8_t data[4] = { 1, 2, 3, 4 };
+    I2C::onComplete(onComplete);
+    writeTicket = I2C::write(target, &data[0], 1, false);
+    I2C::transfer_t transfers[3];
+    for (uint8_t i = 0; i < 3; i++) {
+        transfers[i].address = target;
+        transfers[i].direction = TW_WRITE;
+        transfers[i].buffer = (void *)&data[i + 1];
+        transfers[i].size = 1;
+    }
+    uint8_t ticket = I2C::batch(transfers, 3, true);
+    if (ticket != (uint8_t)(writeTicket + 3)) {
+        simulator.fail("the batch ended with ticket %u instead of %u", ticket, (uint8_t)(writeTicket + 3));
+    }
+    // The general call follows the batch
+    while (i2c_detail::linkBroadcasting || i2c_detail::linkBroadcastPending) {
+        delay(1);
+    }
+    I2C::onComplete(nullptr);
+    simulator.stop();
+}
+
+void loop() {
+    delay(1);
+}
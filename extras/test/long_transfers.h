@@ -0,0 +1,104 @@
+/*
+MIT License
+
+Copyright (c) 2024 sub1inear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+// Bus test (see bus.cpp) of I2C_LONG_TRANSFERS: the player with id 0 writes and reads 300 bytes, more than an 8-bit size
+// can count, to and from the player with id 1, through the copying and the borrowing calls, and both check every byte.
+#define I2C_IMPLEMENTATION
+#define I2C_LONG_TRANSFERS
+#define I2C_BUFFER_SIZE 300
+#include "ArduboyI2C.h"
+#include <string.h>
+
+constexpr uint16_t messageSize = 300;
+
+struct Message {
+    uint8_t data[messageSize];
+};
+
+uint8_t id;
+Message message;
+uint8_t writesChecked;
+uint8_t readsAnswered;
+
+void onReceive() {
+    I2C::size_type size = I2C::getReceivedSize();
+    if (size != messageSize || memcmp(I2C::getBuffer(), message.data, messageSize)) {
+        i2c_host::Simulator::instance().fail("received %u bytes of a %u-byte message, or wrong ones", size, messageSize);
+    }
+    writesChecked++;
+}
+
+// Each read follows two writes, and is answered by copying and then without
+void onRequest() {
+    if (writesChecked != 2 * ++readsAnswered) {
+        i2c_host::Simulator::instance().fail("read %u came after %u whole writes", readsAnswered, writesChecked);
+    }
+    if (readsAnswered % 2) {
+        I2C::transmit(&message);
+    } else {
+        I2C::transmitNoCopy(&message);
+    }
+}
+
+void check(const char *what, const Message &got) {
+    if (I2C::getTWError() != TW_SUCCESS || memcmp(got.data, message.data, messageSize)) {
+        i2c_host::Simulator::instance().fail("%s of %u bytes failed with %02x or got wrong bytes", what, messageSize, I2C::getTWError());
+    }
+}
+
+void setup() {
+    for (uint16_t i = 0; i < messageSize; i++) {
+        message.data[i] = 0xA5 ^ (i * 37 + 1) ^ (i >> 8);
+    }
+    I2C::init();
+    id = I2C::handshake();
+    I2C::onReceive(onReceive);
+    I2C::onRequest(onRequest);
+    if (id != 0) {
+        return;
+    }
+    uint8_t target = I2C::getAddressFromId(1);
+
+    for (uint8_t i = 0; i < 2; i++) {
+        I2C::write(target, &message, true);
+        check("write", message);
+        uint8_t ticket = I2C::writeNoCopy(target, &message);
+        while (!I2C::isComplete(ticket)) {
+            delay(1);
+        }
+        check("write without copying", message);
+
+        Message got = {};
+        if (i) {
+            I2C::read(target, &got);
+        } else {
+            I2C::read(target, got.data, messageSize);
+        }
+        check("read", got);
+    }
+    i2c_host::Simulator::instance().stop();
+}
+
+void loop() {
+    delay(1);
+}
@@ -0,0 +1,177 @@
+/*
+MIT License
+
+Copyright (c) 2024 sub1inear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+// Bus test (see bus.cpp): the player with id 0 queues writes, segmented writes, flash writes and chains with a repeated
+// start to the player with id 1, and checks the tickets and the order in which they complete. The target checks the data
+// of every write, which starts with a tag followed by tag + 1, tag + 2..., and logs the tag and size of each.
+// Reads of the target return its log, so the controller checks that every write arrived once, whole and in order.
+#define I2C_IMPLEMENTATION
+#include "ArduboyI2C.h"
+#include <string.h>
+
+constexpr uint8_t maxEntries = I2C_BUFFER_SIZE / 2;
+
+uint8_t          id;
+uint8_t          targetLog[maxEntries * 2]; // tag and size of each write received, in order
+volatile uint8_t logEntries;
+
+uint8_t          completedTickets[8];
+uint8_t          completedErrors[8];
+volatile uint8_t completions;
+
+const uint8_t flashData[6] PROGMEM = { 5, 6, 7, 8, 9, 10 };
+
+void onReceive() {
+    uint8_t *buffer = I2C::getBuffer();
+    uint8_t size = I2C::getReceivedSize();
+    for (uint8_t i = 0; i < size; i++) {
+        if (buffer[i] != (uint8_t)(buffer[0] + i)) {
+            i2c_host::Simulator::instance().fail("byte %u of the write with tag %u is %u", i, buffer[0], buffer[i]);
+            break;
+        }
+    }
+    if (logEntries < maxEntries) {
+        targetLog[logEntries * 2] = buffer[0];
+        targetLog[logEntries * 2 + 1] = size;
+        logEntries++;
+    }
+}
+
+void onRequest() {
+    I2C::transmit(targetLog, logEntries * 2);
+}
+
+void onComplete(uint8_t ticket, uint8_t error) {
+    if (completions < sizeof(completedTickets)) {
+        completedTickets[completions] = ticket;
+        completedErrors[completions++] = error;
+    }
+}
+
+// Fills the buffer with the data of a write with the tag
+void fill(uint8_t *buffer, uint8_t tag, uint8_t size) {
+    for (uint8_t i = 0; i < size; i++) {
+        buffer[i] = tag + i;
+    }
+}
+
+// Checks that the target has logged exactly the writes given as tag and size pairs
+void checkLog(const char *what, const uint8_t *got, const uint8_t *expected, uint8_t entries) {
+    for (uint8_t i = 0; i < entries; i++) {
+        if (got[i * 2] != expected[i * 2] || got[i * 2 + 1] != expected[i * 2 + 1]) {
+            i2c_host::Simulator::instance().fail("%s: write %u is tag %u of %u bytes instead of tag %u of %u bytes",
+                                                 what, i, got[i * 2], got[i * 2 + 1], expected[i * 2], expected[i * 2 + 1]);
+        }
+    }
+}
+
+// Checks that the transactions from the ticket on completed in order and succeeded
+void checkCompletions(const char *what, uint8_t first, uint8_t count) {
+    i2c_host::Simulator &simulator = i2c_host::Simulator::instance();
+    if (completions != count) {
+        simulator.fail("%s: %u transactions completed instead of %u", what, completions, count);
+        return;
+    }
+    for (uint8_t i = 0; i < count; i++) {
+        if (completedTickets[i] != (uint8_t)(first + i) || completedErrors[i] != TW_SUCCESS) {
+            simulator.fail("%s: completion %u is ticket %u with %02x instead of ticket %u", what, i, completedTickets[i],
+                           completedErrors[i], (uint8_t)(first + i));
+        }
+    }
+}
+
+void setup() {
+    I2C::init();
+    id = I2C::handshake();
+    I2C::onReceive(onReceive);
+    I2C::onRequest(onRequest);
+    if (id != 0) {
+        return;
+    }
+    i2c_host::Simulator &simulator = i2c_host::Simulator::instance();
+    uint8_t target = I2C::getAddressFromId(1);
+    I2C::onComplete(onComplete);
+
+    // Tickets follow each other and complete in order, also between copied and borrowed writes
+    uint8_t first[3], second[4], third[5];
+    fill(first, 1, sizeof(first));
+    fill(second, 2, sizeof(second));
+    fill(third, 3, sizeof(third));
+    uint8_t tickets[3];
+    tickets[0] = I2C::write(target, first, sizeof(first), false);
+    tickets[1] = I2C::write(target, second, sizeof(second), false);
+    tickets[2] = I2C::writeNoCopy(target, third, sizeof(third));
+    if (tickets[1] != (uint8_t)(tickets[0] + 1) || tickets[2] != (uint8_t)(tickets[1] + 1)) {
+        simulator.fail("tickets %u, %u and %u do not follow each other", tickets[0], tickets[1], tickets[2]);
+    }
+    while (!I2C::isComplete(tickets[2])) {
+        delay(1);
+    }
+    if (!I2C::isComplete(tickets[0]) || !I2C::isComplete(tickets[1])) {
+        simulator.fail("ticket %u completed before the ones queued before it", tickets[2]);
+    }
+    checkCompletions("queued writes", tickets[0], 3);
+
+    // A segmented write arrives as a single write, and a flash write as it is stored
+    uint8_t head[2], middle[4], tail[1];
+    fill(head, 4, sizeof(head));
+    fill(middle, 6, sizeof(middle));
+    fill(tail, 10, sizeof(tail));
+    const I2C::segment_t segments[] = { { head, sizeof(head) }, { middle, sizeof(middle) }, { tail, sizeof(tail) } };
+    completions = 0;
+    uint8_t ticket = I2C::writeSegments(target, segments, 3);
+    checkCompletions("segmented write", ticket, 1);
+    completions = 0;
+    ticket = I2C::write_P(target, flashData, sizeof(flashData), true);
+    checkCompletions("flash write", ticket, 1);
+
+    // The read of writeRead follows its write with a repeated start, so the log it returns already has the write
+    uint8_t command[2];
+    fill(command, 11, sizeof(command));
+    uint8_t got[maxEntries * 2] = {};
+    completions = 0;
+    ticket = I2C::writeRead(target, command, sizeof(command), got, 12);
+    checkCompletions("writeRead", ticket - 1, 2);
+    const uint8_t expected[] = { 1, 3, 2, 4, 3, 5, 4, 7, 5, 6, 11, 2, 20, 3, 30, 2 };
+    checkLog("writeRead", got, expected, 6);
+
+    // A batch runs its transfers in order and its ticket is that of the last one
+    uint8_t one[3], two[2];
+    fill(one, 20, sizeof(one));
+    fill(two, 30, sizeof(two));
+    memset(got, 0, sizeof(got));
+    const I2C::transfer_t transfers[] = {
+        { target, TW_WRITE, one, sizeof(one) },
+        { target, TW_WRITE, two, sizeof(two) },
+        { target, TW_READ, got, 16 },
+    };
+    completions = 0;
+    ticket = I2C::batch(transfers, 3);
+    checkCompletions("batch", ticket - 2, 3);
+    checkLog("batch", got, expected, 8);
+    simulator.stop();
+}
+
+void loop() {
+    delay(1);
+}
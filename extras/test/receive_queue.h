@@ -0,0 +1,146 @@
+/*
+MIT License
+
+Copyright (c) 2024 sub1inear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+// Bus test (see bus.cpp) of the receive queue: the player with id 1 only polls when the player with id 0 asks it to
+// with a read, so writes wait in the queue meanwhile. The target checks what each poll hands to onReceive: the writes
+// in order with their size and whether they were general calls, none of those which came while the queue was full,
+// and only the bytes of a write which fit in the buffer. Each write starts with a tag followed by tag + 1, tag + 2...
+#define I2C_IMPLEMENTATION
+#define I2C_BUFFER_SIZE 8
+#define I2C_RECEIVE_QUEUE_SIZE 2
+#include "ArduboyI2C.h"
+
+struct received_t {
+    uint8_t tag;
+    uint8_t size;
+    bool    generalCall;
+};
+
+// What each poll which handles writes must hand to onReceive. The write with tag 3 comes while the queue is full,
+// and the one with tag 5 is 10 bytes long.
+const received_t expected[2][2] = {
+    { { 1, 3, true }, { 2, 5, false } },
+    { { 4, 8, false }, { 5, 8, false } },
+};
+
+uint8_t          id;
+received_t       received[4];
+uint8_t          receivedCount;
+volatile uint8_t pollRequests;
+uint8_t          polls;
+volatile uint8_t checks; // polls which handled writes and were checked
+
+void onReceive() {
+    uint8_t *buffer = I2C::getBuffer();
+    uint8_t size = I2C::getReceivedSize();
+    for (uint8_t i = 0; i < size; i++) {
+        if (buffer[i] != (uint8_t)(buffer[0] + i)) {
+            i2c_host::Simulator::instance().fail("byte %u of the write with tag %u is %u", i, buffer[0], buffer[i]);
+            break;
+        }
+    }
+    if (receivedCount < 4) {
+        received[receivedCount++] = { buffer[0], size, I2C::isGeneralCall() };
+    }
+}
+
+// Answers with the amount of checks done so far, and asks the main loop to poll
+void onRequest() {
+    I2C::transmit((const uint8_t *)&checks, 1);
+    pollRequests++;
+}
+
+// Sends a write with the tag and waits for it. Returns its error.
+uint8_t write(uint8_t address, uint8_t tag, uint8_t size) {
+    uint8_t buffer[10];
+    for (uint8_t i = 0; i < size; i++) {
+        buffer[i] = tag + i;
+    }
+    uint8_t ticket = I2C::writeNoCopy(address, buffer, size);
+    while (!I2C::isComplete(ticket)) {
+        delay(1);
+    }
+    return I2C::getTWError();
+}
+
+// Asks the target to poll until it has checked the writes of the phase
+void waitForCheck(uint8_t target, uint8_t phase) {
+    uint8_t done;
+    do {
+        I2C::read(target, &done, 1);
+        delay(1);
+    } while (done < phase);
+}
+
+void setup() {
+    I2C::init();
+    id = I2C::handshake();
+    I2C::onReceive(onReceive);
+    I2C::onRequest(onRequest);
+    if (id != 0) {
+        return;
+    }
+    i2c_host::Simulator &simulator = i2c_host::Simulator::instance();
+    uint8_t target = I2C::getAddressFromId(1);
+
+    // Dropped writes are still acknowledged
+    const uint8_t phase1[3][3] = { { 0x00, 1, 3 }, { target, 2, 5 }, { target, 3, 4 } };
+    for (auto &w : phase1) {
+        if (write(w[0], w[1], w[2]) != TW_SUCCESS) {
+            simulator.fail("the write with tag %u failed with %02x", w[1], I2C::getTWError());
+        }
+    }
+    waitForCheck(target, 1);
+
+    // A write which fills the buffer succeeds, the byte after it is not acknowledged
+    if (write(target, 4, 8) != TW_SUCCESS) {
+        simulator.fail("the write of a full buffer failed with %02x", I2C::getTWError());
+    }
+    if (write(target, 5, 10) != TW_MT_DATA_NACK) {
+        simulator.fail("the write larger than the buffer ended with %02x instead of a NACK", I2C::getTWError());
+    }
+    waitForCheck(target, 2);
+    simulator.stop();
+}
+
+void loop() {
+    if (id != 0 && pollRequests != polls) {
+        polls = pollRequests;
+        receivedCount = 0;
+        if (I2C::poll() && checks < 2) {
+            const received_t *want = expected[checks];
+            if (receivedCount != 2) {
+                i2c_host::Simulator::instance().fail("poll %u handled %u writes instead of 2", checks + 1, receivedCount);
+            }
+            for (uint8_t i = 0; i < receivedCount && i < 2; i++) {
+                if (received[i].tag != want[i].tag || received[i].size != want[i].size || received[i].generalCall != want[i].generalCall) {
+                    i2c_host::Simulator::instance().fail("poll %u: write %u is tag %u of %u bytes (general call %u) instead of tag %u of %u bytes (%u)",
+                                                         checks + 1, i, received[i].tag, received[i].size, received[i].generalCall,
+                                                         want[i].tag, want[i].size, want[i].generalCall);
+                }
+            }
+            checks++;
+        }
+    }
+    delay(1);
+}
@@ -0,0 +1,28 @@
+#!/bin/sh
+# Builds and runs the tests of the host build. Exits with the status of the first test that fails.
+# CXXFLAGS can be set to add flags, such as -DF_CPU=8000000UL.
+set -e
+cd "$(dirname "$0")"
+build=build
+mkdir -p $build
+for test in frequency; do
+    g++ -std=gnu++11 -O2 -Wall -Wextra $CXXFLAGS -I../../src $test.cpp -o $build/$test
+    $build/$test
+done
+# Bus tests: sketches run by bus.cpp on the simulator, as name:players
+for test in transfer:2 queue:2 receive_queue:2 chunks:2 long_transfers:2 link_batch:2 bus_error:2; do
+    name=${test%:*}
+    players=${test#*:}
+    objects=
+    i=0
+    while [ $i -lt "$players" ]; do
+        g++ -std=gnu++11 -O2 -Wall -Wextra $CXXFLAGS -I../../src -I../simulator -I. -DI2C_SIMULATOR_PLAYER=$i \
+            -DI2C_SIMULATOR_SKETCH="\"$name.h\"" -DI2C_MAX_PLAYERS="$players" \
+            -c ../simulator/player.cpp -o $build/$name$i.o
+        objects="$objects $build/$name$i.o"
+        i=$((i + 1))
+    done
+    g++ -std=gnu++11 -O2 -Wall -Wextra $CXXFLAGS -I../../src -I../simulator bus.cpp $objects -o $build/$name
+    $build/$name
+    echo "$name passed"
+done
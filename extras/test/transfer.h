@@ -0,0 +1,116 @@
+/*
+MIT License
+
+Copyright (c) 2024 sub1inear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+// Bus test (see bus.cpp): the player with id 0 reads known bytes from the player with id 1, which answers with
+// I2C::transmit, and checks every byte, for sizes from 1 byte up to the whole buffer, through each overload of I2C::read.
+#define I2C_IMPLEMENTATION
+#include "ArduboyI2C.h"
+#include <string.h>
+
+constexpr uint8_t sizes[] = { 1, 2, 3, 4, 7, 16, I2C_BUFFER_SIZE };
+
+struct Object {
+    uint8_t  a;
+    uint16_t b;
+    uint8_t  c[3];
+};
+
+uint8_t          id;
+uint8_t          reply[I2C_BUFFER_SIZE];
+volatile uint8_t requestSize;
+
+// The size of the next read, so the target answers with exactly as many bytes
+void onReceive() {
+    requestSize = I2C::getBuffer()[0];
+}
+
+void onRequest() {
+    I2C::transmit(reply, requestSize);
+}
+
+// Tells the target the size of the next read
+void request(uint8_t target, uint8_t size) {
+    I2C::write(target, &size, 1, true);
+}
+
+void check(const char *what, const void *buffer, uint8_t size) {
+    i2c_host::Simulator &simulator = i2c_host::Simulator::instance();
+    const uint8_t *got = (const uint8_t *)buffer;
+    if (I2C::getTWError() != TW_SUCCESS) {
+        simulator.fail("%s of %u bytes failed with %02x", what, size, I2C::getTWError());
+    }
+    for (uint8_t i = 0; i < size; i++) {
+        if (got[i] != reply[i]) {
+            simulator.fail("%s of %u bytes: byte %u is %02x instead of %02x", what, size, i, got[i], reply[i]);
+            return;
+        }
+    }
+}
+
+void setup() {
+    // not a multiple of 2, so a bit shifted the wrong way or a byte off by one shows
+    for (uint8_t i = 0; i < sizeof(reply); i++) {
+        reply[i] = 0xA5 ^ (i * 37 + 1);
+    }
+    I2C::init();
+    id = I2C::handshake();
+    I2C::onReceive(onReceive);
+    I2C::onRequest(onRequest);
+    if (id != 0) {
+        return;
+    }
+
+    uint8_t target = I2C::getAddressFromId(1);
+    for (uint8_t size : sizes) {
+        uint8_t got[I2C_BUFFER_SIZE] = {};
+        request(target, size);
+        I2C::read(target, got, size, true);
+        check("read", got, size);
+        // Without wait, a uint8_t buffer must still read size bytes and not a single uint8_t
+        memset(got, 0, sizeof(got));
+        request(target, size);
+        I2C::read(target, got, size);
+        check("read without wait", got, size);
+    }
+    uint8_t got[4] = {};
+    request(target, 4);
+    I2C::read(target, got, 4);
+    check("read of a literal size", got, 4);
+
+    Object object = {};
+    request(target, sizeof(object));
+    I2C::read(target, &object);
+    check("read of an object", &object, sizeof(object));
+    memset(&object, 0, sizeof(object));
+    request(target, sizeof(object));
+    uint8_t ticket = I2C::read(target, &object, false);
+    while (!I2C::isComplete(ticket)) {
+        delay(1);
+    }
+    check("read of an object without waiting", &object, sizeof(object));
+    i2c_host::Simulator::instance().stop();
+}
+
+void loop() {
+    delay(1);
+}
@@ -26,16 +26,59 @@ SOFTWARE.
  * An I2C library for Arduboy multiplayer games.
  */
 #pragma once
+
+#ifdef __DOXYGEN__
+/** \brief
+ * Builds the library for the host (such as Linux) instead of AVR, so it can be tested and benchmarked on a PC.
+ * \details
+ * Defined automatically when the compiler does not target AVR. The TWI registers and PIND are backed by the
+ * cycle-approximate model of the ATmega32u4 TWI in ArduboyI2CHost.h, and the C version of the TWI interrupt is used
+ * instead of the asm one, so the I2C API is the same. Time only passes in the waits of the library, so the program
+ * runs as fast as the host can simulate the bus. For example:
+ * \code
+ * g++ -std=gnu++11 -I ArduboyI2C/src game.cpp
+ * \endcode
+ * \see ArduboyI2CHost.h
+ */
+#define I2C_HOST
+#endif
+
+#if !defined(__AVR__) && !defined(I2C_HOST)
+#define I2C_HOST
+#endif
+
+#ifdef __DOXYGEN__
+/** \brief
+ * Uses the C version of the TWI interrupt instead of the asm one on AVR.
+ * \details
+ * The C version is slower and larger. It is meant for testing the asm version against it,
+ * as extras/isr does. Always used by the host build (`I2C_HOST`).
+ */
+#define I2C_REFERENCE_ISR
+#endif
+
+#if defined(I2C_HOST) && !defined(I2C_REFERENCE_ISR)
+#define I2C_REFERENCE_ISR
+#endif
+
+#ifdef I2C_HOST
+#include "ArduboyI2CHost.h"
+#else
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 #include <avr/power.h>
 #include <util/twi.h>
+#include <util/atomic.h>
+#include <util/delay_basic.h>
+#endif
+#include <stddef.h>
 #include <stdint.h>
 
 #ifndef I2C_FREQUENCY
 /** \brief
  * The initial I2C frequency.
  * \details
- * Defaults to 100000 Hz. \n
+ * Defaults to 100000 Hz. Set by I2C::init and can be changed later with I2C::setFrequency. \n
  * Standard frequencies: \n
  * 100000 Hz - Standard Mode \n
  * 400000 Hz - Fast Mode
@@ -43,31 +86,232 @@ SOFTWARE.
 #define I2C_FREQUENCY 100000
 #endif
 
+#ifdef __DOXYGEN__
+/** \brief
+ * Enables transfers longer than 255 bytes.
+ * \details
+ * If defined, sizes and buffer indices are 16-bit (see I2C::size_type), so a single transaction can send or receive
+ * up to 65535 bytes and `I2C_BUFFER_SIZE`/`I2C_QUEUE_BUFFER_SIZE` can be larger than 255 bytes.
+ * Costs a few cycles per byte in the interrupt and a byte of RAM per queued transaction.
+ */
+#define I2C_LONG_TRANSFERS
+#endif
+
 #ifndef I2C_BUFFER_SIZE
 /** \brief
- * The size of the buffer used for writes/target (slave) operations.
+ * The default size of the buffers used for writes/target (slave) operations.
  * \details
  * Defaults to 32. If more than 32 bytes are needed for writes/target (slave) operations, increase. If more RAM is needed, decrease.
+ * At most 255 unless `I2C_LONG_TRANSFERS` is defined, as sizes are 8-bit (see I2C::size_type).
+ * `I2C_RX_BUFFER_SIZE`, `I2C_TX_BUFFER_SIZE` and `I2C_QUEUE_BUFFER_SIZE` default to this size.
  */
 #define I2C_BUFFER_SIZE 32
-#elif I2C_BUFFER_SIZE > 256
-#error "I2C_BUFFER_SIZE is too big."
+#elif I2C_BUFFER_SIZE > 255 && !defined(I2C_LONG_TRANSFERS)
+#error "I2C_BUFFER_SIZE is too big. Define I2C_LONG_TRANSFERS for buffers larger than 255 bytes."
+#endif
+
+#ifndef I2C_RX_BUFFER_SIZE
+/** \brief
+ * The size of the buffer in which data written to the device as a target (slave) is stored.
+ * \details
+ * Defaults to I2C_BUFFER_SIZE. This buffer is returned by I2C::getBuffer.
+ */
+#define I2C_RX_BUFFER_SIZE I2C_BUFFER_SIZE
+#elif I2C_RX_BUFFER_SIZE > 255 && !defined(I2C_LONG_TRANSFERS)
+// the size of a write that filled 256 bytes would wrap to 0
+#error "I2C_RX_BUFFER_SIZE is too big. Define I2C_LONG_TRANSFERS for buffers larger than 255 bytes."
+#endif
+
+#ifndef I2C_TX_BUFFER_SIZE
+/** \brief
+ * The size of the buffer into which I2C::transmit copies its data.
+ * \details
+ * Defaults to I2C_BUFFER_SIZE. It is separate from the receive buffer,
+ * so a write arriving while a response is pending does not overwrite the response.
+ */
+#define I2C_TX_BUFFER_SIZE I2C_BUFFER_SIZE
+#elif I2C_TX_BUFFER_SIZE > 255 && !defined(I2C_LONG_TRANSFERS)
+#error "I2C_TX_BUFFER_SIZE is too big. Define I2C_LONG_TRANSFERS for buffers larger than 255 bytes."
+#endif
+
+#ifndef I2C_QUEUE_SIZE
+/** \brief
+ * The amount of transactions (writes/reads) that can be pending at once.
+ * \details
+ * Defaults to 2. Each queued write holds its own address and a copy of its data (`I2C_QUEUE_BUFFER_SIZE` bytes),
+ * so a write only has to wait when the queue is full. When a transaction finishes, the next one is started from the interrupt.
+ * Two entries let a frame send its state and an event without waiting for the first write, and are needed by
+ * I2C::writeRead and for I2C::batch to keep the bus between its transfers.
+ * Each entry takes `I2C_QUEUE_BUFFER_SIZE` + 5 bytes of RAM (74 bytes for the default 2 entries).
+ * Increase if more asynchronous writes are sent each frame. Set to 1 to save an entry of RAM, at the cost of the above.
+ */
+#define I2C_QUEUE_SIZE 2
+#elif I2C_QUEUE_SIZE < 1 || I2C_QUEUE_SIZE > 127
+#error "I2C_QUEUE_SIZE must be between 1 and 127."
+#endif
+
+#ifndef I2C_QUEUE_BUFFER_SIZE
+/** \brief
+ * The size of the buffer in each queue entry used by I2C::write to copy its data.
+ * \details
+ * Defaults to I2C_BUFFER_SIZE. If 0, I2C::write is not available and every write must use I2C::writeNoCopy,
+ * which saves `I2C_QUEUE_SIZE * I2C_BUFFER_SIZE` bytes of RAM.
+ */
+#define I2C_QUEUE_BUFFER_SIZE I2C_BUFFER_SIZE
+#elif I2C_QUEUE_BUFFER_SIZE > 255 && !defined(I2C_LONG_TRANSFERS)
+#error "I2C_QUEUE_BUFFER_SIZE is too big. Define I2C_LONG_TRANSFERS for buffers larger than 255 bytes."
+#endif
+
+#ifndef I2C_RECEIVE_QUEUE_SIZE
+/** \brief
+ * The amount of received writes that can wait in the receive queue.
+ * \details
+ * Defaults to 0, which calls the onReceive callback from the interrupt as soon as a write has been received.
+ * If more than 0, the interrupt instead appends each write (its size, whether it was a general call and its data)
+ * to a queue, and I2C::poll calls the onReceive callback for each of them from the main loop.
+ * Each entry holds `I2C_RX_BUFFER_SIZE` bytes of data, and one extra entry is used for the write being received.
+ */
+#define I2C_RECEIVE_QUEUE_SIZE 0
+#elif I2C_RECEIVE_QUEUE_SIZE < 0 || I2C_RECEIVE_QUEUE_SIZE > 127
+#error "I2C_RECEIVE_QUEUE_SIZE must be between 0 and 127."
+#endif
+
+#ifdef I2C_BUS_BUSY_CHECKS
+#warning "I2C_BUS_BUSY_CHECKS has been replaced by I2C_BUS_FREE_TIME."
 #endif
 
-#ifndef I2C_BUS_BUSY_CHECKS
+#ifdef __DOXYGEN__
 /** \brief
- * The amount of times the bus is checked before continuing with a read/write operation.
+ * The time in nanoseconds both bus lines must stay high before a read/write operation starts.
  * \details
- * Defaults to 16. Fixes design flaw where TWI hardware does not check if the bus has become busy during a stop interrupt,
+ * Defaults to the bus free time (t_BUF) of the speed mode of the current frequency plus one SCL period,
+ * which is long enough for a transfer of another controller (master) to pull a line low.
+ * If left undefined, it follows the frequency set with I2C::setFrequency.
+ * Fixes design flaw where TWI hardware does not check if the bus has become busy during a stop interrupt,
  * so if multiple targets (slaves) receive the stop interrupt right before
  * they become the controller (master) and send a start, they all will think the bus is free and clobber each other.
+ * The lines are sampled for a time derived from `F_CPU`, so it scales with the clock and bus speed.
+ * They are sampled with interrupts enabled and checked once more with interrupts disabled right before the start.
+ * Until they have stayed high for that long once since I2C::init (or I2C::recover), they are sampled again whenever one goes low,
+ * as the TWI does not know about a transfer which was already going on when it was enabled.
  * Can be set to 0 when there is only one controller (master).
  * Increase if the game ever freezes.
  * More information: https://www.robotroom.com/Atmel-AVR-TWI-I2C-Multi-Master-Problem.html
  */
-#define I2C_BUS_BUSY_CHECKS 16
+#define I2C_BUS_FREE_TIME
+#endif
+
+#ifndef I2C_ARBITRATION_RETRIES
+/** \brief
+ * The amount of times a transaction is retried after another controller (master) has taken the bus.
+ * \details
+ * Defaults to 4. A transaction which loses arbitration is sent again by the hardware as soon as the bus is free.
+ * While the program waits for it (or for room in the queue), it is sent after a random time instead,
+ * seeded by the address set with I2C::setAddress, so the controllers which lost do not start together again.
+ * A transaction started while another controller (master) is using the bus is not counted: the hardware waits for the
+ * end of that transfer, however long it is, and arbitration only decides between controllers which then start together.
+ * Once every retry has failed, the transaction fails with TW_MT_ARB_LOST, which is returned by I2C::getTWError.
+ * Set to 0 to fail on the first collision.
+ */
+#define I2C_ARBITRATION_RETRIES 4
+#elif I2C_ARBITRATION_RETRIES < 0 || I2C_ARBITRATION_RETRIES > 255
+#error "I2C_ARBITRATION_RETRIES must be between 0 and 255."
+#endif
+
+#ifndef I2C_TIMEOUT
+/** \brief
+ * The time in milliseconds a blocking wait lasts without any progress on the bus before it gives up.
+ * \details
+ * Defaults to 25. Applies to waiting for a read/write to complete, for space in the queue and for a stop to be sent.
+ * The time restarts whenever a byte is transferred, a transaction completes or a bus line changes, so long transfers
+ * (including those of other controllers (masters) this device waits for) are not cut short: it only runs out once the bus is stuck.
+ * When it runs out, I2C::recover is called, which fails every queued transaction with TW_TIMEOUT.
+ * Set to 0 to wait forever.
+ */
+#define I2C_TIMEOUT 25
+#endif
+
+#ifndef I2C_HANDSHAKE_TIMEOUT
+/** \brief
+ * The time in milliseconds I2C::handshake waits for the other players to join.
+ * \details
+ * Defaults to 0, which waits forever. Otherwise I2C::handshake returns I2C_HANDSHAKE_TIMED_OUT once it runs out.
+ */
+#define I2C_HANDSHAKE_TIMEOUT 0
+#endif
+
+#ifdef __DOXYGEN__
+/** \brief
+ * Enables the adaptive link mode.
+ * \details
+ * If defined, the bus runs at the fastest rate in `I2C_ADAPTIVE_FREQUENCIES` the link allows.
+ * Data NACKs, bus errors, lost arbitrations and timeouts of completed transactions are counted over windows of
+ * `I2C_ADAPTIVE_WINDOW` transactions. A window with `I2C_ADAPTIVE_MAX_ERRORS` or more errors steps down to the next rate,
+ * and after `I2C_ADAPTIVE_PROBE_WINDOWS` windows without errors the next faster rate is tried again.
+ * A new rate is applied by the next read/write which finds the TWI idle, so it never changes during a transfer.
+ * Every change of the rate is sent to the other devices as a general call, so they all follow it
+ * (if two devices change it at once, the slower rate wins). A general call which fails is sent again with the next read/write.
+ * If `I2C_MAX_PLAYERS` is defined, I2C::handshake runs at `I2C_FREQUENCY`. The last player to join then reads every other
+ * player at each rate from the fastest down, and writes the fastest rate at which every read succeeded to each of them.
+ * Otherwise the fastest rate is used from the first read/write.
+ * Address NACKs are not counted, as they only mean no device has the address.
+ * \note
+ * A write of 3 bytes starting with 0xFE is a link message, which is taken by the library instead of being passed to
+ * the onReceive callback. Changes are only received with general calls enabled (see I2C::setAddress), and only
+ * when I2C::poll is called if `I2C_RECEIVE_QUEUE_SIZE` is more than 0.
+ * \see I2C::getLinkFrequency()
+ */
+#define I2C_ADAPTIVE_LINK
+#endif
+
+#ifdef I2C_ADAPTIVE_LINK
+
+#ifndef I2C_ADAPTIVE_FREQUENCIES
+/** \brief
+ * The rates of the adaptive link mode in Hz, from fastest to slowest.
+ * \details
+ * Defaults to `F_CPU / 16, F_CPU / 20, F_CPU / 24, F_CPU / 32, 400000, 100000` (1 MHz down to 100 kHz at 16 MHz).
+ * Every device must use the same list, as the rate is agreed on by its index.
+ * Only used if `I2C_ADAPTIVE_LINK` is defined.
+ */
+#define I2C_ADAPTIVE_FREQUENCIES F_CPU / 16, F_CPU / 20, F_CPU / 24, F_CPU / 32, 400000, 100000
+#endif
+
+#ifndef I2C_ADAPTIVE_WINDOW
+/** \brief
+ * The amount of completed transactions over which errors are counted in the adaptive link mode.
+ * \details
+ * Defaults to 32. Only used if `I2C_ADAPTIVE_LINK` is defined.
+ */
+#define I2C_ADAPTIVE_WINDOW 32
+#elif I2C_ADAPTIVE_WINDOW < 1 || I2C_ADAPTIVE_WINDOW > 255
+#error "I2C_ADAPTIVE_WINDOW must be between 1 and 255."
+#endif
+
+#ifndef I2C_ADAPTIVE_MAX_ERRORS
+/** \brief
+ * The amount of errors in a window which steps the adaptive link mode down to a slower rate.
+ * \details
+ * Defaults to 2. Only used if `I2C_ADAPTIVE_LINK` is defined.
+ */
+#define I2C_ADAPTIVE_MAX_ERRORS 2
+#elif I2C_ADAPTIVE_MAX_ERRORS < 1 || I2C_ADAPTIVE_MAX_ERRORS > I2C_ADAPTIVE_WINDOW
+#error "I2C_ADAPTIVE_MAX_ERRORS must be between 1 and I2C_ADAPTIVE_WINDOW."
+#endif
+
+#ifndef I2C_ADAPTIVE_PROBE_WINDOWS
+/** \brief
+ * The amount of windows without errors after which the adaptive link mode tries the next faster rate.
+ * \details
+ * Defaults to 64. If the faster rate has too many errors in its first window, it steps back down.
+ * Only used if `I2C_ADAPTIVE_LINK` is defined.
+ */
+#define I2C_ADAPTIVE_PROBE_WINDOWS 64
+#elif I2C_ADAPTIVE_PROBE_WINDOWS < 1 || I2C_ADAPTIVE_PROBE_WINDOWS > 255
+#error "I2C_ADAPTIVE_PROBE_WINDOWS must be between 1 and 255."
 #endif
 
+#endif // #ifdef I2C_ADAPTIVE_LINK
 
 #ifndef I2C_SCL_PIN
 /** \brief
@@ -131,6 +375,21 @@ SOFTWARE.
  */
 #define I2C_HANDSHAKE_FAILED 0xFE
 
+/** \brief
+ * Error code returned by I2C::handshake when the other players have not joined within `I2C_HANDSHAKE_TIMEOUT` milliseconds.
+ * \details
+ * Never returned while `I2C_HANDSHAKE_TIMEOUT` is 0, the default.
+ */
+#define I2C_HANDSHAKE_TIMED_OUT 0xFC
+
+/** \brief
+ * Error code returned by I2C::getTWError() and passed to the onComplete callback when a blocking wait has timed out.
+ * \details
+ * The bus has been recovered with I2C::recover.
+ * \see I2C_TIMEOUT
+ */
+#define TW_TIMEOUT 0xFD
+
 /** \brief
  * The maximum amount of addresses available to a device.
  * \details
@@ -147,11 +406,43 @@ SOFTWARE.
  */
 #define I2C_LIB_VER 20100
 
+namespace i2c_detail {
+    // Only has `type` if the wait argument is a bool, so read(address, buffer, size) with a size never picks the read of a T
+    template<typename W> struct if_bool {};
+    template<> struct if_bool<bool> { typedef uint8_t type; };
+}
+
 /** 
  * Provides all I2C functionality.
  */
 class I2C {
 public:
+    /** \brief
+     * The type of transfer sizes.
+     * \details
+     * uint16_t if `I2C_LONG_TRANSFERS` is defined, otherwise uint8_t.
+     */
+#if defined(I2C_LONG_TRANSFERS) || defined(__DOXYGEN__)
+    typedef uint16_t size_type;
+#else
+    typedef uint8_t  size_type;
+#endif
+
+    /** \brief
+     * A single transfer of a batch.
+     * \see batch()
+     */
+    struct transfer_t {
+        /** The 7-bit address of the transfer. To send a general call, use address 0. */
+        uint8_t address;
+        /** TW_WRITE to send `buffer` or TW_READ to receive into `buffer`. */
+        uint8_t direction;
+        /** A pointer to the data to send or the buffer in which to store the data. It is not copied. */
+        void     *buffer;
+        /** The amount of bytes to send or receive. This cannot be zero. */
+        size_type size;
+    };
+
     /** \brief
      * Initalizes I2C hardware.
      * \details
@@ -160,6 +451,43 @@ public:
      */
     static void init();
 
+    /** \brief
+     * Sets the I2C frequency.
+     * \param hz The frequency in Hz. This cannot be zero.
+     * \details
+     * Chooses the bit rate and prescaler at runtime, so the bus can be slowed down for long cables or sped up for short ones.
+     * The closest frequency which is not faster is used, between `F_CPU / 16` and about `F_CPU / 32656` (490 Hz at 16 MHz).
+     * Slower frequencies are set to the slowest one.
+     * I2C::init sets `I2C_FREQUENCY`. Every device on the bus should use the same frequency.
+     * \note
+     * Should not be called while a read or write is in progress.
+     * \see setFrequency<hz>()
+     */
+    static void setFrequency(uint32_t hz);
+
+    /** \brief
+     * Sets the I2C frequency.
+     * \tparam hz The frequency in Hz. This cannot be zero.
+     * \details
+     * Same as setFrequency(uint32_t), but the bit rate and prescaler are calculated at compile time.
+     * \see setFrequency()
+     */
+    template<uint32_t hz>
+    static void setFrequency();
+
+#if defined(I2C_ADAPTIVE_LINK) || defined(__DOXYGEN__)
+    /** \brief
+     * Gets the rate currently chosen by the adaptive link mode.
+     * \return The frequency in Hz, one of `I2C_ADAPTIVE_FREQUENCIES`.
+     * \details
+     * Only available if `I2C_ADAPTIVE_LINK` is defined. Before the link has started (see `I2C_ADAPTIVE_LINK`),
+     * this is the rate it will start at.
+     * \note
+     * A frequency set with I2C::setFrequency is replaced the next time the rate changes.
+     */
+    static uint32_t getLinkFrequency();
+#endif
+
     /** \brief
      * Set the address of the device and enable/disable general calls on the I2C bus.
      * \param address The 7-bit address which to respond to.
@@ -171,6 +499,7 @@ public:
      */
     static void setAddress(uint8_t address, bool generalCall = false);
 
+#if I2C_QUEUE_BUFFER_SIZE
     /** \brief
      * Attempts to become the bus controller (master) and sends data over I2C to the specified address.
      * \param address The 7-bit address which to send the data. To send a general call, use address 0.
@@ -178,16 +507,18 @@ public:
      * \param buffer A pointer to the data to send.
      * \param size The amount of data in bytes to send. This cannot be zero.
      * \param wait Whether or not to wait for the write to complete. If this is false, it will proceed with interrupts.
+     * \return A ticket to pass to I2C::isComplete.
      * \details
      * \note
      * Sending general calls will only function if the `generalCall` argument of `setAddress` is true on every other device.
      * \note
-     * Interally, this function uses a buffer to enable asynchronous writes. The buffer size is controlled by the macro `I2C_BUFFER_SIZE`
+     * Interally, this function copies the data into a queue to enable asynchronous writes. The buffer size of each queue entry is controlled by the macro `I2C_QUEUE_BUFFER_SIZE`
      * and defaults to 32. If the program needs to send more than 32 bytes at a time, `I2C_BUFFER_SIZE`
      * must be defined before including to be larger.
+     * The amount of queue entries is controlled by the macro `I2C_QUEUE_SIZE`. This function only waits for previous writes if the queue is full.
      * \see transmit() read()
      */
-    static void write(uint8_t address, const void *buffer, uint8_t size, bool wait);
+    static uint8_t write(uint8_t address, const void *buffer, size_type size, bool wait);
 
     /** \brief
      * Attempts to become the bus controller (master) and sends data over I2C to the specified address.
@@ -196,16 +527,124 @@ public:
      * Addresses 1-7 and 120-127 are reserved by the standard and should not be used.
      * \param buffer A pointer to the data to send.
      * \param wait Whether or not to wait for the write to complete. If this is false, it will proceed with interrupts.
+     * \return A ticket to pass to I2C::isComplete.
      * \note
      * Sending general calls will only function if the `generalCall` argument of `setAddress` is true on every other device.
      * \note
-     * Interally, this function uses a buffer to enable asynchronous writes. The buffer size is controlled by the macro `I2C_BUFFER_SIZE`
+     * Interally, this function copies the data into a queue to enable asynchronous writes. The buffer size of each queue entry is controlled by the macro `I2C_QUEUE_BUFFER_SIZE`
      * and defaults to 32. If the program needs to send more than 32 bytes at a time, `I2C_BUFFER_SIZE`
      * must be defined before including to be larger.
+     * The amount of queue entries is controlled by the macro `I2C_QUEUE_SIZE`. This function only waits for previous writes if the queue is full.
      * \see transmit() read()
      */
     template<typename T>
-    static void write(uint8_t address, const T *object, bool wait);
+    static uint8_t write(uint8_t address, const T *object, bool wait);
+#endif
+
+    /** \brief
+     * A piece of the data sent by writeSegments().
+     * \see writeSegments()
+     */
+    struct segment_t {
+        /** A pointer to the data of the segment. It is not copied. */
+        const void *buffer;
+        /** The amount of data in bytes of the segment. */
+        size_type   size;
+    };
+
+    /** \brief
+     * Attempts to become the bus controller (master) and sends data over I2C to the specified address without copying it.
+     * \param address The 7-bit address which to send the data. To send a general call, use address 0.
+     * Addresses 1-7 and 120-127 are reserved by the standard and should not be used.
+     * \param buffer A pointer to the data to send.
+     * \param size The amount of data in bytes to send. This cannot be zero.
+     * \return A ticket to pass to I2C::isComplete.
+     * \details
+     * The write is always asynchronous and the interrupt sends the data straight from `buffer`, so it is not limited by `I2C_QUEUE_BUFFER_SIZE`.
+     * The buffer is borrowed until the write completes: it must not be modified or go out of scope until `I2C::isComplete(ticket)` returns true.
+     * \note
+     * Sending general calls will only function if the `generalCall` argument of `setAddress` is true on every other device.
+     * \see isComplete() write()
+     */
+    static uint8_t writeNoCopy(uint8_t address, const void *buffer, size_type size);
+
+    /** \brief
+     * Attempts to become the bus controller (master) and sends data over I2C to the specified address without copying it.
+     * \tparam T The type of the data to write.
+     * \param address The 7-bit address which to send the data. To send a general call, use address 0.
+     * Addresses 1-7 and 120-127 are reserved by the standard and should not be used.
+     * \param object A pointer to the data to send.
+     * \return A ticket to pass to I2C::isComplete.
+     * \details
+     * The object is borrowed until the write completes: it must not be modified or go out of scope until `I2C::isComplete(ticket)` returns true.
+     * \see isComplete() write()
+     */
+    template<typename T>
+    static uint8_t writeNoCopy(uint8_t address, const T *object);
+
+    /** \brief
+     * Attempts to become the bus controller (master) and sends data stored in PROGMEM over I2C to the specified address.
+     * \param address The 7-bit address which to send the data. To send a general call, use address 0.
+     * Addresses 1-7 and 120-127 are reserved by the standard and should not be used.
+     * \param buffer A pointer to the data in PROGMEM to send.
+     * \param size The amount of data in bytes to send. This cannot be zero.
+     * \param wait Whether or not to wait for the write to complete. If this is false, it will proceed with interrupts.
+     * \return A ticket to pass to I2C::isComplete.
+     * \details
+     * The interrupt reads each byte from flash as it is sent, so level data, tile maps and sprites can be shared
+     * without copying them into RAM and the write is not limited by `I2C_QUEUE_BUFFER_SIZE`.
+     * \see write() transmit_P()
+     */
+    static uint8_t write_P(uint8_t address, const void *buffer, size_type size, bool wait);
+
+    /** \brief
+     * Attempts to become the bus controller (master) and sends data stored in PROGMEM over I2C to the specified address.
+     * \tparam T The type of the data to write.
+     * \param address The 7-bit address which to send the data. To send a general call, use address 0.
+     * Addresses 1-7 and 120-127 are reserved by the standard and should not be used.
+     * \param object A pointer to the data in PROGMEM to send.
+     * \param wait Whether or not to wait for the write to complete. If this is false, it will proceed with interrupts.
+     * \return A ticket to pass to I2C::isComplete.
+     * \see write() transmit_P()
+     */
+    template<typename T>
+    static uint8_t write_P(uint8_t address, const T *object, bool wait);
+
+    /** \brief
+     * Attempts to become the bus controller (master) and sends multiple pieces of data over I2C to the specified address as a single write.
+     * \param address The 7-bit address which to send the data. To send a general call, use address 0.
+     * Addresses 1-7 and 120-127 are reserved by the standard and should not be used.
+     * \param segments A pointer to the segments to send in order.
+     * \param count The amount of segments. This cannot be zero.
+     * \param wait Whether or not to wait for the write to complete. Defaults to true.
+     * \return A ticket to pass to I2C::isComplete.
+     * \details
+     * The interrupt sends each segment straight from its buffer, so a packet header and data which already lives in the game
+     * can be sent without assembling them into a temporary buffer first.
+     * Example:
+     * \code{.cpp}
+     * header_t header = { PACKET_PLAYER, sequence++, id };
+     * I2C::segment_t segments[] = {
+     *   { &header, sizeof(header) },
+     *   { &players[id], sizeof(player_t) },
+     * };
+     * I2C::writeSegments(0x00, segments, 2);
+     * \endcode
+     * \note
+     * Neither the segments nor their buffers are copied, so they must not be modified or go out of scope until the write completes.
+     * \see writeNoCopy() isComplete()
+     */
+    static uint8_t writeSegments(uint8_t address, const segment_t *segments, uint8_t count, bool wait = true);
+
+    /** \brief
+     * Checks if a queued transaction has completed.
+     * \param ticket The ticket returned when the transaction was queued.
+     * \return True if the transaction has finished (successfully or not) and its buffer can be reused.
+     * \details
+     * Transactions complete in the order they are queued. A ticket stays valid for the next 127 transactions.
+     * \see writeNoCopy() read() onComplete()
+     */
+    static bool isComplete(uint8_t ticket);
     
     /** \brief
      * Attempts to become the bus controller (master) and reads data over I2C from the specified address.
@@ -213,12 +652,25 @@ public:
      * Addresses 0-7 and 120-127 are reserved by the standard and should not be used.
      * \param buffer A pointer to the buffer in which to store the data.
      * \param size The maximum amount of bytes to receive. This cannot be zero.
+     * \param wait Whether or not to wait for the read to complete. Defaults to true.
+     * If this is false, it will proceed with interrupts and the data is stored in `buffer` once `I2C::isComplete(ticket)` returns true.
+     * \return A ticket to pass to I2C::isComplete.
      * \details
+     * Example of polling multiple devices while drawing:
+     * \code{.cpp}
+     * uint8_t tickets[3];
+     * for (uint8_t i = 0; i < 3; i++) {
+     *   tickets[i] = I2C::read(I2C::getAddressFromId(i + 1), &players[i + 1], false);
+     * }
+     * drawBackground();
+     * while (!I2C::isComplete(tickets[2])) {}
+     * \endcode
      * \note
      * Unlike the `write` function, this function is bufferless and is not limited to 32 bytes.
-     * \see write()
+     * It is still queued behind any pending writes. If `I2C_QUEUE_SIZE` is 1, it waits for them to finish.
+     * \see write() isComplete() onComplete()
      */
-    static void read(uint8_t address, void *buffer, uint8_t size);
+    static uint8_t read(uint8_t address, void *buffer, size_type size, bool wait = true);
 
     /** \brief
      * Attempts to become the bus controller (master) and reads data over I2C from the specified address.
@@ -226,14 +678,69 @@ public:
      * \param address The 7-bit address which to receive the data from.
      * Addresses 0-7 and 120-127 are reserved by the standard and should not be used.
      * \param buffer A pointer to the buffer in which to store the data.
+     * \param wait Whether or not to wait for the read to complete. Defaults to true.
+     * If this is false, it will proceed with interrupts and the data is stored in `object` once `I2C::isComplete(ticket)` returns true.
+     * \return A ticket to pass to I2C::isComplete.
      * \details
-     * Types with sizes larger than 255 should not be used with this function.
+     * Types must fit in I2C::size_type (255 bytes unless `I2C_LONG_TRANSFERS` is defined).
+     * `wait` must be a bool: `I2C::read(address, buffer, size)` reads `size` bytes with the other read, whatever the type of `buffer`.
      * \note
      * Unlike the `write` function, this function is bufferless and is not limited to 32 bytes.
-     * \see write()
+     * \see write() isComplete() onComplete()
      */
-    template<typename T>
-    static void read(uint8_t address, T *object);
+    template<typename T, typename W = bool>
+    static typename i2c_detail::if_bool<W>::type read(uint8_t address, T *object, W wait = true);
+
+    /** \brief
+     * Attempts to become the bus controller (master) and runs multiple transfers back to back without releasing the bus.
+     * \param transfers A pointer to the transfers to run in order.
+     * \param count The amount of transfers. This cannot be zero.
+     * \param wait Whether or not to wait for all transfers to complete. Defaults to true.
+     * \return A ticket (of the last transfer) to pass to I2C::isComplete.
+     * The ticket of the transfer at index `i` is the returned ticket minus `count - 1 - i`.
+     * \details
+     * Each transfer is queued and continues from the previous one with a repeated start, so only the first one has to win arbitration.
+     * Example of updating every other player:
+     * \code{.cpp}
+     * I2C::transfer_t transfers[I2C_MAX_PLAYERS - 1];
+     * for (uint8_t i = 0; i < I2C_MAX_PLAYERS - 1; i++) {
+     *   transfers[i] = { I2C::getAddressFromId(i < id ? i : i + 1), TW_WRITE, &players[id], sizeof(player_t) };
+     * }
+     * I2C::batch(transfers, I2C_MAX_PLAYERS - 1);
+     * \endcode
+     * \note
+     * The buffers of the transfers are not copied, so they must not be modified until their transfers complete.
+     * The errors of the transfers are reported separately to the onComplete callback.
+     * \note
+     * The bus is only kept while the next transfer is already queued, so `I2C_QUEUE_SIZE` must be at least 2 (the default).
+     * If it has been set to 1, each transfer is sent as a separate transaction.
+     * \see writeRead() onComplete()
+     */
+    static uint8_t batch(const transfer_t *transfers, uint8_t count, bool wait = true);
+
+#if I2C_QUEUE_SIZE > 1 || defined(__DOXYGEN__)
+    /** \brief
+     * Attempts to become the bus controller (master), sends data to the specified address and then reads the reply without releasing the bus.
+     * \param address The 7-bit address which to send the data to and receive the reply from.
+     * Addresses 0-7 and 120-127 are reserved by the standard and should not be used.
+     * \param txBuffer A pointer to the data to send, for example a register or command byte.
+     * \param txSize The amount of data in bytes to send. This cannot be zero.
+     * \param rxBuffer A pointer to the buffer in which to store the reply.
+     * \param rxSize The maximum amount of bytes to receive. This cannot be zero.
+     * \param wait Whether or not to wait for the transaction to complete. Defaults to true.
+     * \return A ticket (of the read) to pass to I2C::isComplete.
+     * \details
+     * The read is started with a repeated start instead of a stop followed by a start,
+     * which saves an address phase and the bus free time, and no other controller (master) can take the bus in between.
+     * \note
+     * `txBuffer` is not copied, so it must not be modified until the transaction completes.
+     * \note
+     * Only available if `I2C_QUEUE_SIZE` is at least 2 (the default), as the write and the read each take an entry in the queue.
+     * Their errors are reported separately to the onComplete callback. getTWError() returns the error of the read.
+     * \see write() read() batch()
+     */
+    static uint8_t writeRead(uint8_t address, const void *txBuffer, size_type txSize, void *rxBuffer, size_type rxSize, bool wait = true);
+#endif
 
     /** \brief
      * Transmits data back to the controller (master).
@@ -244,12 +751,12 @@ public:
      * It fills the transmitting buffer with data to then be send one byte at a time.
      * If it is called multiple times, only the last call will be sent.
      * \note
-     * Internally, this function uses a buffer. The buffer size is controlled by the macro `I2C_BUFFER_SIZE`
-     * and defaults to 32. If the program needs to send more than 32 bytes at a time, `I2C_BUFFER_SIZE`
+     * Internally, this function uses a buffer. The buffer size is controlled by the macro `I2C_TX_BUFFER_SIZE`
+     * and defaults to 32. If the program needs to send more than 32 bytes at a time, `I2C_TX_BUFFER_SIZE`
      * must be defined before including to be larger.
      * \see write() onRequest()
      */
-    static void transmit(const void *buffer, uint8_t size);
+    static void transmit(const void *buffer, size_type size);
     
     /** \brief
      * Transmits data back to the controller (master).
@@ -260,13 +767,67 @@ public:
      * It fills the transmitting buffer with data to then be send one byte at a time.
      * If it is called multiple times, only the last call will be sent.
      * \note
-     * Internally, this function uses a buffer. The buffer size is controlled by the macro `I2C_BUFFER_SIZE`
-     * and defaults to 32. If the program needs to send more than 32 bytes at a time, `I2C_BUFFER_SIZE`
+     * Internally, this function uses a buffer. The buffer size is controlled by the macro `I2C_TX_BUFFER_SIZE`
+     * and defaults to 32. If the program needs to send more than 32 bytes at a time, `I2C_TX_BUFFER_SIZE`
      * must be defined before including to be larger.
      * \see write() onRequest()
      */
     template <typename T>
     static void transmit(const T *object);
+
+    /** \brief
+     * Transmits data back to the controller (master) without copying it.
+     * \param buffer A pointer to the data to send.
+     * \param size The amount of the data in bytes to send.
+     * \details
+     * This function is intended to be called once inside the onRequest callback.
+     * The interrupt sends the data straight from `buffer`, so it is not limited by `I2C_TX_BUFFER_SIZE`.
+     * The buffer is borrowed until the controller (master) has finished reading and must not be modified until `I2C::isTransmitComplete()` returns true.
+     * It is intended for data which is kept in stable memory, like the state of the player.
+     * \see transmit() onRequest() isTransmitComplete()
+     */
+    static void transmitNoCopy(const void *buffer, size_type size);
+
+    /** \brief
+     * Transmits data back to the controller (master) without copying it.
+     * \tparam T The type of data to transmit.
+     * \param object A pointer to the data to send.
+     * \details
+     * The object is borrowed until the controller (master) has finished reading and must not be modified until `I2C::isTransmitComplete()` returns true.
+     * \see transmit() onRequest() isTransmitComplete()
+     */
+    template <typename T>
+    static void transmitNoCopy(const T *object);
+
+    /** \brief
+     * Transmits data stored in PROGMEM back to the controller (master).
+     * \param buffer A pointer to the data in PROGMEM to send.
+     * \param size The amount of the data in bytes to send.
+     * \details
+     * This function is intended to be called once inside the onRequest callback.
+     * The interrupt reads each byte from flash as it is sent, so it is not limited by `I2C_TX_BUFFER_SIZE`.
+     * \see transmit() write_P() onRequest()
+     */
+    static void transmit_P(const void *buffer, size_type size);
+
+    /** \brief
+     * Transmits data stored in PROGMEM back to the controller (master).
+     * \tparam T The type of data to transmit.
+     * \param object A pointer to the data in PROGMEM to send.
+     * \see transmit() write_P() onRequest()
+     */
+    template <typename T>
+    static void transmit_P(const T *object);
+
+    /** \brief
+     * Checks if the controller (master) has finished reading the data last given to transmit, transmitNoCopy or transmit_P.
+     * \return Whether the read has ended.
+     * \details
+     * The read ends when the controller (master) stops acknowledging, when the last byte has been sent, or on a bus error.
+     * Once this returns true, the buffer given to transmitNoCopy can be modified again.
+     * \see transmitNoCopy() isComplete()
+     */
+    static bool isTransmitComplete();
     
     /** \brief
      * Sets up the callback to be called when data is requested from the device's address (a read).
@@ -287,10 +848,43 @@ public:
      * To respond to the controller (master), use `transmit` instead of `write`.
      * \note
      * If no bytes are send in the callback, the result of the transmission is undefined.
-     * \see onReceive() transmit() read()
+     * \see onReceive() transmit() read() onRequestMore()
      */
     static void onRequest(void (*function)());
 
+    /** \brief
+     * Sets up the callback to be called when the data given to transmit has been sent but the controller (master) may read more.
+     * \param function The function to be called for the next chunk of data. Set to nullptr to disable.
+     * \details
+     * The callback is called from the interrupt as soon as the last byte of the current chunk has been loaded,
+     * so the response can be streamed in chunks of any size instead of being copied up front.
+     * Inside the callback, call transmit, transmitNoCopy or transmit_P once to give the next chunk, or nothing to end the response.
+     * Example Callback and Usage:
+     * \code{.cpp}
+     * uint16_t levelOffset;
+     * void levelRequest() {
+     *   levelOffset = 0;
+     *   I2C::transmit_P(level, 16);
+     * }
+     * void levelRequestMore() {
+     *   levelOffset += 16;
+     *   if (levelOffset < sizeof(level)) {
+     *     I2C::transmit_P(level + levelOffset, 16);
+     *   }
+     * }
+     * ...
+     * void setup() {
+     *   ...
+     *   I2C::onRequest(levelRequest);
+     *   I2C::onRequestMore(levelRequestMore);
+     * }
+     * \endcode
+     * \note
+     * The callback is called from the interrupt with interrupts disabled while the bus is held, so it should be short.
+     * \see onRequest() transmit()
+     */
+    static void onRequestMore(void (*function)());
+
     /** \brief
      * Sets up the callback to be called when data is sent to the device's address (a write)
      * \param function The function to be called when data is received.
@@ -307,25 +901,118 @@ public:
      *   I2C::onReceive(dataReceive);
      * }
      * \endcode
-     * \see onRequest() write()
+     * \note
+     * If `I2C_RECEIVE_QUEUE_SIZE` is more than 0, the callback is called from I2C::poll instead of the interrupt.
+     * \see onRequest() write() poll()
      */
     static void onReceive(void (*function)());
 
     /** \brief
-     * Gets the hardware error which happened in a previous read or write.
-     * \return A byte indicating the error. TW_SUCCESS means no error has occurred.
-     * The full list of error codes are available in the avr utils\twi.h.
-     */
-    static uint8_t getTWError();
-
-    /** \brief
-     * Gets a pointer to the I2C buffer holding received data.
+     * Sets up the callback to be called when a queued read or write has finished.
+     * \param function The function to be called with the ticket of the transaction and its error (TW_SUCCESS if it succeeded).
      * \details
-     * Intended to be used inside the onReceive callback.
+     * Example Callback and Usage:
+     * \code{.cpp}
+     * void readComplete(uint8_t ticket, uint8_t error) {
+     *   for (uint8_t i = 0; i < 3; i++) {
+     *     if (tickets[i] == ticket) {
+     *       connected[i] = error == TW_SUCCESS;
+     *     }
+     *   }
+     * }
+     * ...
+     * void setup() {
+     *   ...
+     *   I2C::onComplete(readComplete);
+     * }
+     * \endcode
+     * \note
+     * The callback is called from the interrupt with interrupts disabled, so it should be short. Set to nullptr to disable.
+     * \see read() write() isComplete()
+     */
+    static void onComplete(void (*function)(uint8_t ticket, uint8_t error));
+
+    /** \brief
+     * Gets the hardware error which happened in a previous read or write.
+     * \return A byte indicating the error. TW_SUCCESS means no error has occurred.
+     * The full list of error codes are available in the avr utils\twi.h.
+     * \details
+     * If multiple transactions are queued, the error of the most recently finished one is returned.
+     * TW_TIMEOUT means the bus stopped making progress and was recovered.
+     */
+    static uint8_t getTWError();
+
+    /** \brief
+     * Frees a hung bus and resets the TWI hardware.
+     * \details
+     * Clocks SCL up to 9 times until a target (slave) stuck in a transfer releases SDA, sends a stop and re-enables the TWI.
+     * Every queued transaction fails with TW_TIMEOUT. The address, general call setting and callbacks are kept.
+     * Called automatically when a blocking wait times out (see `I2C_TIMEOUT`), so a yanked link cable or a stuck line
+     * recovers in milliseconds instead of freezing the game.
+     */
+    static void recover();
+
+    /** \brief
+     * Gets a pointer to the I2C buffer holding received data.
+     * \details
+     * Intended to be used inside the onReceive callback.
+     * The size of the buffer is controlled by the macro `I2C_RX_BUFFER_SIZE`.
+     * If `I2C_RECEIVE_QUEUE_SIZE` is more than 0, this is the data of the write being handled by I2C::poll.
      * \see onReceive()
      */
     static uint8_t *getBuffer();
 
+    /** \brief
+     * Gets the amount of bytes in the buffer returned by getBuffer().
+     * \details
+     * Intended to be used inside the onReceive and onReceiveChunk callbacks.
+     * If `I2C_RECEIVE_QUEUE_SIZE` is more than 0, this is the size of the write being handled by I2C::poll.
+     * \see getBuffer() onReceive()
+     */
+    static size_type getReceivedSize();
+
+#if !I2C_RECEIVE_QUEUE_SIZE || defined(__DOXYGEN__)
+    /** \brief
+     * Sets up the callback to be called each time the receive buffer fills up during a write to the device's address.
+     * \param function The function to be called with each full buffer. Set to nullptr to disable.
+     * \details
+     * Lets writes larger than `I2C_RX_BUFFER_SIZE` be processed as they arrive, such as level downloads or save data,
+     * without a buffer the size of the whole write.
+     * Inside the callback, getBuffer() holds the next `I2C_RX_BUFFER_SIZE` bytes of the write.
+     * The rest of the write is passed to the onReceive callback when it ends, and getReceivedSize() may be 0 there.
+     * Without this callback, bytes which do not fit in the buffer are NACKed and the write ends early.
+     * Only available if `I2C_RECEIVE_QUEUE_SIZE` is 0.
+     * \note
+     * The callback is called from the interrupt with interrupts disabled. The next byte is received in the meantime,
+     * and the bus is held after it until the callback returns.
+     * \see onReceive() getBuffer()
+     */
+    static void onReceiveChunk(void (*function)());
+#endif
+
+#if I2C_RECEIVE_QUEUE_SIZE || defined(__DOXYGEN__)
+    /** \brief
+     * Calls the onReceive callback for each write received since the last call.
+     * \return The amount of writes handled.
+     * \details
+     * Only available if `I2C_RECEIVE_QUEUE_SIZE` is more than 0. Intended to be called once per frame from the main loop.
+     * Inside the callback, getBuffer(), getReceivedSize() and isGeneralCall() describe the write being handled.
+     * \note
+     * If `I2C_RECEIVE_QUEUE_SIZE` writes are already waiting, further writes are acknowledged but dropped until the queue is polled.
+     * Bytes which do not fit in `I2C_RX_BUFFER_SIZE` are NACKed and the write ends early.
+     * \see onReceive()
+     */
+    static uint8_t poll();
+
+    /** \brief
+     * Checks if the write being handled by I2C::poll was a general call.
+     * \details
+     * Only available if `I2C_RECEIVE_QUEUE_SIZE` is more than 0. Intended to be used inside the onReceive callback.
+     * \see poll() setAddress()
+     */
+    static bool isGeneralCall();
+#endif
+
     /** \brief
      * Checks if an emulator without I2C support is being used to run the code.
      * \return True if an emulator without I2C support has been detected and false if it has not
@@ -346,7 +1033,11 @@ public:
      * \return A unique id for this device.
      * \details
      * I2C_MAX_PLAYERS must be defined to 1 or more before including the header file to the number of players in the handshake.
-     * This function will wait until every single player has joined.
+     * This function will wait until every single player has joined. It returns I2C_HANDSHAKE_FAILED if the handshake
+     * has already been completed (I2C_MAX_PLAYERS have joined), or I2C_HANDSHAKE_TIMED_OUT if `I2C_HANDSHAKE_TIMEOUT`
+     * is not 0 and the others have not joined within that many milliseconds.
+     * If `I2C_ADAPTIVE_LINK` is defined, the last player to join also finds the fastest rate at which it can read every
+     * other player, and writes it to each of them. The others return once they have received it.
      * 
      */
     static uint8_t handshake();
@@ -354,22 +1045,216 @@ public:
 };
 
 #ifdef I2C_IMPLEMENTATION
+#ifdef I2C_HOST
+ISR(TWI_vect);
+#endif
+
 /** \brief
  * Not officially part of the library.
  */
 namespace i2c_detail {
 
-uint8_t           twiBuffer[I2C_BUFFER_SIZE];
-volatile uint8_t *rxBuffer;
-volatile uint8_t  bufferIdx;
-volatile uint8_t  bufferSize;
+#ifdef I2C_HOST
+i2c_host::Node hostNode(TWI_vect); // backs the TWI registers and PIND
+#endif
+
+// Bits of transaction_t::flags
+enum : uint8_t {
+    RESTART   = 0, // continue with the next transaction using a repeated start (mirrored in the ISR)
+    SEGMENTED = 1, // buffer points to size I2C::segment_t (mirrored in the ISR)
+    FLASH     = 2, // buffer is in PROGMEM (mirrored in the ISR)
+    TRANSMITTING = 3, // only in bufferFlags: dataBuffer was given by I2C::transmitNoCopy and the read has not ended
+    CONTROLLING  = 4, // only in bufferFlags: the transaction at queueHead has started and has not ended or lost arbitration (mirrored in the ISR)
+};
+
+// The ISR reads the fields of the transaction at queueHead in declaration order.
+struct transaction_t {
+    uint8_t            slaRW;
+    I2C::size_type     size;
+    uint8_t           *buffer;
+    uint8_t            flags;
+#if I2C_QUEUE_BUFFER_SIZE
+    uint8_t            data[I2C_QUEUE_BUFFER_SIZE];
+#endif
+};
+
+transaction_t                  queue[I2C_QUEUE_SIZE];
+transaction_t         *volatile queueHead = queue; // transaction being sent (advanced by the ISR)
+transaction_t                 *queueTail = queue;  // next free transaction (advanced by the main loop)
+volatile uint8_t               queueCount;
+uint8_t                        queueIssued; // amount of transactions ever queued, used for tickets
+
+#if I2C_RECEIVE_QUEUE_SIZE
+// The ISR reads the fields of the frame at frameTail by offset.
+struct frame_t {
+    I2C::size_type     size;
+    uint8_t            generalCall;
+    uint8_t            data[I2C_RX_BUFFER_SIZE];
+};
+
+// One more frame than can be pending, so frameTail never points at the frame being polled.
+frame_t                 frames[I2C_RECEIVE_QUEUE_SIZE + 1];
+frame_t                *frameHead = frames; // frame being polled (only used by the main loop)
+frame_t                *frameTail = frames; // frame being received (only used by the ISR)
+volatile uint8_t        framesReceived;     // only written by the ISR
+volatile uint8_t        framesPolled;       // only written by the main loop
+#else
+uint8_t                 rxBuffer[I2C_RX_BUFFER_SIZE]; // filled by the ISR as a target (slave)
+#endif
+uint8_t                 txBuffer[I2C_TX_BUFFER_SIZE]; // filled by I2C::transmit
+volatile uint8_t       *dataBuffer;
+volatile I2C::size_type bufferIdx;
+volatile I2C::size_type bufferSize;
+volatile uint8_t        bufferFlags; // FLASH if dataBuffer is in PROGMEM, TRANSMITTING until a read ends, CONTROLLING while a transaction runs
+
+const I2C::segment_t *segment; // next segment of a segmented write
+uint8_t               segmentCount;
 
 volatile bool     active;
-volatile uint8_t  slaRW;
 volatile uint8_t  error;
+uint8_t           arbitrationRetries = I2C_ARBITRATION_RETRIES; // left for the transaction at queueHead
 
 void            (*onRequestFunction)();
+void            (*onRequestMoreFunction)();
+#ifdef I2C_ADAPTIVE_LINK
+void linkOnReceive();
+void linkOnComplete(uint8_t ticket, uint8_t error);
+
+void            (*onReceiveFunction)() = linkOnReceive; // takes the link messages, then calls linkReceiveFunction
+void            (*linkReceiveFunction)();
+#else
 void            (*onReceiveFunction)();
+#endif
+#if !I2C_RECEIVE_QUEUE_SIZE
+void            (*onReceiveChunkFunction)();
+#endif
+#ifdef I2C_ADAPTIVE_LINK
+void            (*onCompleteFunction)(uint8_t ticket, uint8_t error) = linkOnComplete; // counts errors, then calls linkCompleteFunction
+void            (*linkCompleteFunction)(uint8_t ticket, uint8_t error);
+#else
+void            (*onCompleteFunction)(uint8_t ticket, uint8_t error);
+#endif
+
+#ifdef I2C_ADAPTIVE_LINK
+const uint32_t linkFrequencies[] PROGMEM = { I2C_ADAPTIVE_FREQUENCIES };
+constexpr uint8_t linkRateCount = sizeof(linkFrequencies) / sizeof(linkFrequencies[0]);
+
+uint8_t          linkRate;         // index in linkFrequencies
+uint8_t          linkGeneration;   // counts the changes of linkRate, so every device follows the latest one
+#ifdef I2C_MAX_PLAYERS
+volatile bool    linkRatePending;  // set when linkRate changes, applied by applyLinkRate (first set after the handshake)
+volatile bool    linkAgreed;       // set when the rate agreed on in the handshake has been received
+#else
+volatile bool    linkRatePending = true; // no handshake, so the link starts with the first read/write
+#endif
+bool             linkStarted;      // errors are only counted once the first rate has been applied
+uint8_t          linkTransactions; // completed in the current window
+uint8_t          linkErrors;       // in the current window
+uint8_t          linkCleanWindows; // in a row without errors
+
+// A link message is a write of { linkMarker, linkGeneration, linkRate }. Each change of the rate is sent to every device
+// as a general call, and the rate agreed on in the handshake to each player.
+constexpr uint8_t linkMarker = 0xFE;
+uint8_t          linkMessage[3] = { linkMarker }; // borrowed by the write while linkBroadcasting
+volatile bool    linkBroadcastPending; // linkRate has changed and has not been sent (again) yet
+volatile bool    linkBroadcasting;     // the general call is queued
+uint8_t          linkBroadcastTicket;
+bool             chainOpen; // the last committed transaction continues with a repeated start, so nothing may come between
+
+// Must be called with interrupts disabled.
+void setLinkRate(uint8_t rate) {
+    linkRate = rate;
+    linkTransactions = 0;
+    linkErrors = 0;
+    linkCleanWindows = 0;
+    linkRatePending = true;
+}
+
+void startLink() {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        setLinkRate(linkRate);
+    }
+}
+
+// Steps the rate by one (from linkOnComplete in the interrupt), and sends it to the other devices.
+void changeLinkRate(uint8_t rate) {
+    setLinkRate(rate);
+    linkGeneration++;
+    linkBroadcastPending = true;
+}
+
+void linkOnReceive() {
+    const uint8_t *buffer = I2C::getBuffer();
+    if (I2C::getReceivedSize() == sizeof(linkMessage) && buffer[0] == linkMarker && buffer[2] < linkRateCount) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { // called by I2C::poll with the receive queue
+            // The newest change wins. If two devices changed the rate at once, the slower rate wins.
+            int8_t age = linkGeneration - buffer[1];
+            if (age < 0 || (!age && buffer[2] > linkRate)) {
+                linkGeneration = buffer[1];
+                setLinkRate(buffer[2]);
+            }
+        }
+#ifdef I2C_MAX_PLAYERS
+        linkAgreed = true;
+#endif
+        return;
+    }
+    if (linkReceiveFunction) {
+        linkReceiveFunction();
+    }
+}
+
+void linkOnComplete(uint8_t ticket, uint8_t code) {
+    if (linkBroadcasting && ticket == linkBroadcastTicket) {
+        linkBroadcasting = false;
+        // Sent again with the next read/write. An address NACK only means no other device listens to general calls.
+        if (code != TW_SUCCESS && code != TW_MT_SLA_NACK) {
+            linkBroadcastPending = true;
+        }
+    }
+    if (linkStarted) {
+        // Address NACKs only mean no device has the address, so they are not counted
+        if (code == TW_MT_DATA_NACK || code == TW_BUS_ERROR || code == TW_MT_ARB_LOST || code == TW_TIMEOUT) {
+            linkErrors++;
+        }
+        if (++linkTransactions == I2C_ADAPTIVE_WINDOW) {
+            if (linkErrors >= I2C_ADAPTIVE_MAX_ERRORS) {
+                if (linkRate < linkRateCount - 1) {
+                    changeLinkRate(linkRate + 1);
+                }
+                linkCleanWindows = 0;
+            } else if (linkErrors) {
+                linkCleanWindows = 0;
+            } else if (++linkCleanWindows == I2C_ADAPTIVE_PROBE_WINDOWS) {
+                if (linkRate) {
+                    changeLinkRate(linkRate - 1);
+                }
+                linkCleanWindows = 0;
+            }
+            linkTransactions = 0;
+            linkErrors = 0;
+        }
+    }
+    if (linkCompleteFunction) {
+        linkCompleteFunction(ticket, code);
+    }
+}
+
+// Called by start() with interrupts disabled while the TWI is not active, so the frequency never changes during a transfer.
+void applyLinkRate() {
+    bool pending;
+    uint8_t rate;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        pending = linkRatePending;
+        linkRatePending = false;
+        rate = linkRate;
+    }
+    if (pending) {
+        I2C::setFrequency(pgm_read_dword(&linkFrequencies[rate]));
+        linkStarted = true;
+    }
+}
+#endif
 
 #ifdef I2C_MAX_PLAYERS
 
@@ -385,112 +1270,654 @@ void handshakeOnReceive() {
 
 void handshakeOnRequest() {
     handshakeState++;
+#ifdef I2C_ADAPTIVE_LINK
+    // The last player to join also reads it at each rate, and checks it with the complement
+    uint8_t response[2] = { handshakeState, (uint8_t)~handshakeState };
+    I2C::transmit(&response);
+#else
     I2C::transmit(&handshakeState);
+#endif
 }
 #endif // #ifdef I2C_MAX_PLAYERS
 
+transaction_t *next(transaction_t *transaction) {
+    if (++transaction == queue + I2C_QUEUE_SIZE) {
+        transaction = queue;
+    }
+    return transaction;
+}
+
+// Each step of a timed wait lasts at least a microsecond (4 cycles per iteration of _delay_loop_2).
+constexpr uint16_t timeoutStepLoops = (F_CPU / 1000000 + 3) / 4;
+
+// Returns the levels of SCL (bit 0) and SDA (bit 1).
+uint8_t busLines() {
+    return (I2C_SCL_PIN & _BV(I2C_SCL_BIT) ? 1 : 0) | (I2C_SDA_PIN & _BV(I2C_SDA_BIT) ? 2 : 0);
+}
+
+// Returns whether both bus lines are high.
+bool busFree() {
+    return (I2C_SCL_PIN & _BV(I2C_SCL_BIT)) && (I2C_SDA_PIN & _BV(I2C_SDA_BIT));
+}
+
+// Spins until done() returns true. If neither this device nor the bus lines make progress for I2C_TIMEOUT milliseconds,
+// the bus is recovered and the wait ends (every transaction fails with TW_TIMEOUT, which ends the waits on them).
+// The lines change on every clock of a transfer, so waiting for a long transfer of another controller (master) does not time out.
+template<typename F>
+void wait(F done) {
+    I2C::size_type idx = bufferIdx;
+    uint8_t count = queueCount;
+    uint8_t lines = busLines();
+    uint32_t steps = (uint32_t)I2C_TIMEOUT * 1000;
+    while (!done()) {
+        uint8_t now = busLines();
+        if (bufferIdx != idx || queueCount != count || now != lines) {
+            idx = bufferIdx;
+            count = queueCount;
+            lines = now;
+            steps = (uint32_t)I2C_TIMEOUT * 1000;
+        } else if (I2C_TIMEOUT && !--steps) {
+            I2C::recover();
+        }
+        _delay_loop_2(timeoutStepLoops);
+    }
+}
+
+void backOff();
+
+// Blocking waits back off from arbitration losses, as the program has nothing else to do meanwhile.
+void wait(uint8_t ticket) {
+    wait([ticket] {
+        backOff();
+        return I2C::isComplete(ticket);
+    });
+}
+
+#ifdef I2C_MAX_PLAYERS
+// Returns false if the players have not joined within I2C_HANDSHAKE_TIMEOUT milliseconds.
+bool waitForPlayers(uint8_t count) {
+    uint32_t steps = (uint32_t)I2C_HANDSHAKE_TIMEOUT * 1000;
+#ifdef I2C_ADAPTIVE_LINK
+    // Every player but the last also waits for the agreed rate
+    while (handshakeState < count || (count && !linkAgreed)) {
+#if I2C_RECEIVE_QUEUE_SIZE
+        I2C::poll(); // calls handshakeOnReceive
+#endif
+#else
+    while (handshakeState < count) {
+#endif
+        if (I2C_HANDSHAKE_TIMEOUT && !--steps) {
+            return false;
+        }
+        _delay_loop_2(timeoutStepLoops);
+    }
+    return true;
+}
+#endif
+
+#ifdef I2C_ADAPTIVE_LINK
+void broadcastLinkRate();
+#endif
+
+transaction_t *reserve(uint8_t amount = 1) {
+#ifdef I2C_ADAPTIVE_LINK
+    // Queued before the read/write, so the other devices change their rate as soon as possible,
+    // but not in the middle of a batch, whose repeated start would then address the general call instead
+    if (linkBroadcastPending && !linkBroadcasting && !chainOpen) {
+        broadcastLinkRate();
+    }
+#endif
+    wait([amount] {
+        backOff();
+        return queueCount <= I2C_QUEUE_SIZE - amount;
+    });
+    return queueTail;
+}
+
+// Completes every queued transaction with the error. Must be called with interrupts disabled.
+void fail(uint8_t code) {
+    error = code;
+    while (queueCount) {
+        queueHead = next(queueHead);
+        queueCount--;
+        if (onCompleteFunction) {
+            onCompleteFunction(queueIssued - queueCount, error);
+        }
+    }
+}
+
+// Returns the amount of iterations of the sampling loop in start() which last at least the time in nanoseconds.
+// Each iteration takes at least 4 cycles.
+constexpr uint16_t busFreeSamplesFor(uint32_t ns) {
+    return (ns * (F_CPU / 100000) / 10000 + 3) / 4;
+}
+
+// The slowest frequency of the TWI (TWBR of 255 with a prescaler of 64), which slower ones are set to.
+constexpr uint32_t slowestFrequency = F_CPU / (16 + 2 * 255 * 64);
+
+// Returns the bus free time (t_BUF) of the speed mode of the frequency plus one SCL period, in nanoseconds.
+// Frequencies below slowestFrequency are clamped to it, which also keeps busFreeSamplesFor from overflowing.
+constexpr uint32_t busFreeTimeFor(uint32_t hz) {
+    return hz < slowestFrequency ? busFreeTimeFor(slowestFrequency) :
+           (hz <= 100000 ? 4700 : hz <= 400000 ? 1300 : 500) + 1000000000 / hz;
+}
+
+#ifdef I2C_BUS_FREE_TIME
+constexpr uint16_t busFreeSamples = busFreeSamplesFor(I2C_BUS_FREE_TIME);
+#else
+uint16_t busFreeSamples = busFreeSamplesFor(busFreeTimeFor(I2C_FREQUENCY)); // set by I2C::setFrequency
+#endif
+uint8_t randomState = 1; // seeded with the address in I2C::setAddress
+
+// 8-bit Galois LFSR, used to randomize the backoff in start()
+uint8_t nextRandom() {
+    randomState = (randomState >> 1) ^ (-(randomState & 1) & 0xB8);
+    return randomState;
+}
+
+bool busSeen; // the bus has been free since the TWI was enabled, so the TWI sees every START (cleared by I2C::init and I2C::recover)
+
+// Returns the smallest amount of CPU cycles per SCL period which is not faster than the frequency.
+constexpr uint32_t cyclesPerPeriodFor(uint32_t hz) {
+    return F_CPU / hz + (F_CPU % hz != 0);
+}
+
+// Returns the TWBR value for the frequency and prescaler (TWPS bits), rounded up so the frequency is never faster.
+constexpr uint32_t bitRateFor(uint32_t hz, uint8_t prescaler) {
+    return cyclesPerPeriodFor(hz) <= 16 ? 0 : (cyclesPerPeriodFor(hz) - 16 + (2 << 2 * prescaler) - 1) / (2 << 2 * prescaler);
+}
+
+// Returns TWBR in the low byte and the smallest prescaler (TWPS bits) it fits with in the high byte.
+constexpr uint16_t bitRateAndPrescalerFor(uint32_t hz, uint8_t prescaler = 0) {
+    return bitRateFor(hz, prescaler) <= 255 ? prescaler << 8 | bitRateFor(hz, prescaler) :
+           prescaler < 3                    ? bitRateAndPrescalerFor(hz, prescaler + 1) :
+                                              3 << 8 | 255; // slowest
+}
+
+void setBitRate(uint16_t rate) {
+    // Only the prescaler bits of TWSR are writable
+    TWSR = rate >> 8;
+    TWBR = rate;
+}
+
+// Starts the queued transactions unless the TWI is active, in which case the ISR starts them once it has finished.
+// Must be called with interrupts enabled, as it can wait for the bus. Only the final write of TWCR is atomic.
+void start() {
+    // The ISR does not wait for its STOP to be sent. Until it has been, SDA is still low
+    // and writing TWCR could cancel it, so wait here instead (only a few microseconds, and only right after a STOP).
+    // If SCL is held low the STOP is never sent, so the bus is recovered instead, which fails the queue.
+    wait([] { return !(TWCR & _BV(TWSTO)); });
+
+#ifdef I2C_ADAPTIVE_LINK
+    // Before sampling, as the bus free window follows the frequency
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (!active) {
+            applyLinkRate();
+        }
+    }
+#endif
+
+    // A TWI which was enabled during a transfer has not seen its START, so it would not wait for its STOP.
+    // Until the bus has been free once, wait for the whole window instead (or for the queue to fail if the bus is stuck).
+    if (!busSeen) {
+        wait([] {
+            if (!queueCount) {
+                return true;
+            }
+            for (uint16_t samples = busFreeSamples; samples; samples--) {
+                if (!busFree()) {
+                    return false;
+                }
+            }
+            busSeen = true;
+            return true;
+        });
+    }
+
+    // If a line goes low, another controller (master) has started a transfer and the TWI has seen its START,
+    // so TWSTA makes the TWI wait for its STOP however long the transfer is. Interrupts only make the window longer.
+    // After an arbitration loss, the window is one to five times longer, at random, so the losers do not start together again.
+    uint16_t samples = busFreeSamples;
+    if (arbitrationRetries != I2C_ARBITRATION_RETRIES) {
+        samples += ((uint32_t)busFreeSamples * nextRandom()) >> 6;
+    }
+    while (samples && busFree()) {
+        samples--;
+    }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        // A STOP sent by the ISR meanwhile would have come with TWSTA for the queue, so TWSTO is clear if it is still idle.
+        if (!active && queueCount) {
+            active = true;
+            // TWEA, so the device can still be addressed while the TWI waits for the bus
+            TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWEA) | _BV(TWSTA);
+        }
+    }
+}
+
+// After an arbitration loss, the ISR lets the TWI send the transaction again as soon as the bus is free. The other
+// controllers (masters) which lost do the same, so they start together again and the same one keeps losing
+// (a read always loses to a write to the same device). This cancels such a retry while the TWI is still waiting
+// for the bus, and starts it again after a random time instead. The ISR's retry stays for transactions nobody waits on.
+void backOff() {
+    if (arbitrationRetries == I2C_ARBITRATION_RETRIES) {
+        return;
+    }
+    bool cancelled = false;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (active && (TWCR & (_BV(TWINT) | _BV(TWSTA) | _BV(TWSTO))) == _BV(TWSTA)) {
+            TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWEA);
+            // Unless the START has been sent meanwhile, which the ISR then handles as usual
+            if (!(TWCR & _BV(TWINT))) {
+                active = false;
+                cancelled = true;
+            }
+        }
+    }
+    if (cancelled) {
+        start();
+    }
+}
+
+// Returns the ticket of the last transaction.
+uint8_t commit(uint8_t amount = 1) {
+#ifdef I2C_ADAPTIVE_LINK
+    bool closing = chainOpen;
+#endif
+    for (uint8_t i = 0; i < amount; i++) {
+#ifdef I2C_ADAPTIVE_LINK
+        chainOpen = queueTail->flags & _BV(RESTART);
+#endif
+        queueTail = next(queueTail);
+    }
+
+    uint8_t ticket;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        // The ISR computes tickets from both, so update them together
+        queueIssued += amount;
+        queueCount += amount;
+        ticket = queueIssued;
+    }
+    // If the TWI is busy, the ISR starts the transaction once it has finished.
+    if (!active) {
+        start();
+    }
+#ifdef I2C_ADAPTIVE_LINK
+    // The rate held back by reserve while the batch was queued follows it
+    if (closing && !chainOpen && linkBroadcastPending && !linkBroadcasting) {
+        broadcastLinkRate();
+    }
+#endif
+    return ticket;
+}
+
+#ifdef I2C_ADAPTIVE_LINK
+// Sends the current rate to every other device as a general call.
+void broadcastLinkRate() {
+    linkBroadcastPending = false; // before reserve, which would call this again
+    transaction_t *transaction = reserve();
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        linkMessage[1] = linkGeneration;
+        linkMessage[2] = linkRate;
+    }
+    transaction->buffer = linkMessage;
+    transaction->size = sizeof(linkMessage);
+    transaction->slaRW = 0x00 | TW_WRITE;
+    transaction->flags = 0;
+
+    // Set before the commit, as the write can complete before it returns
+    linkBroadcastTicket = queueIssued + 1;
+    linkBroadcasting = true;
+    commit();
+}
+
+#ifdef I2C_MAX_PLAYERS
+constexpr uint8_t linkProbes = 8; // reads of each player at each rate in the handshake
+constexpr uint8_t linkTries = 8;  // writes of the agreed rate to each player before giving up on it
+
+// Returns whether every other player answers linkProbes reads correctly at the current frequency.
+bool probeLinkRate() {
+    for (uint8_t id = 1; id < I2C_MAX_PLAYERS; id++) {
+        for (uint8_t i = 0; i < linkProbes; i++) {
+            uint8_t response[2]; // handshake state and its complement
+            I2C::read(I2C::getAddressFromId(id), &response);
+            if (I2C::getTWError() != TW_SUCCESS || response[1] != (uint8_t)~response[0]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Called by the last player to join once every other player has. Finds the fastest rate at which it can read every player,
+// and writes it to each of them (the slowest rate is used if no faster one works).
+void agreeLinkRate() {
+    uint8_t rate = 0;
+    for (; rate < linkRateCount - 1; rate++) {
+        // The STOP of the last read has to be sent before the frequency changes
+        wait([] { return !(TWCR & _BV(TWSTO)); });
+        I2C::setFrequency(pgm_read_dword(&linkFrequencies[rate]));
+        if (probeLinkRate()) {
+            break;
+        }
+    }
+    wait([] { return !(TWCR & _BV(TWSTO)); });
+    I2C::setFrequency(pgm_read_dword(&linkFrequencies[rate]));
+
+    linkRate = rate;
+    linkMessage[1] = linkGeneration;
+    linkMessage[2] = linkRate;
+    for (uint8_t id = 1; id < I2C_MAX_PLAYERS; id++) {
+        for (uint8_t tries = linkTries; tries; tries--) {
+            wait(I2C::writeNoCopy(I2C::getAddressFromId(id), linkMessage, sizeof(linkMessage)));
+            if (I2C::getTWError() == TW_SUCCESS) {
+                break;
+            }
+        }
+    }
+}
+#endif
+#endif
+
 }
 
 void I2C::init() {
     power_twi_enable();
     TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWEA);
-    TWSR = 0; // clear prescaler bits
-    TWBR = (F_CPU / I2C_FREQUENCY - 16) / 2;
+    i2c_detail::busSeen = false;
+    I2C::setFrequency<I2C_FREQUENCY>();
+}
+
+void I2C::setFrequency(uint32_t hz) {
+    i2c_detail::setBitRate(i2c_detail::bitRateAndPrescalerFor(hz));
+#ifndef I2C_BUS_FREE_TIME
+    i2c_detail::busFreeSamples = i2c_detail::busFreeSamplesFor(i2c_detail::busFreeTimeFor(hz));
+#endif
+}
+
+#ifdef I2C_ADAPTIVE_LINK
+inline uint32_t I2C::getLinkFrequency() {
+    return pgm_read_dword(&i2c_detail::linkFrequencies[i2c_detail::linkRate]);
+}
+#endif
+
+template<uint32_t hz>
+void I2C::setFrequency() {
+    static_assert(hz > 0, "hz cannot be zero.");
+    constexpr uint16_t rate = i2c_detail::bitRateAndPrescalerFor(hz);
+    i2c_detail::setBitRate(rate);
+#ifndef I2C_BUS_FREE_TIME
+    constexpr uint16_t samples = i2c_detail::busFreeSamplesFor(i2c_detail::busFreeTimeFor(hz));
+    i2c_detail::busFreeSamples = samples;
+#endif
+}
+
+void I2C::recover() {
+    // PINx, DDRx and PORTx are consecutive for every port
+    auto &sclDdr = *(&I2C_SCL_PIN + 1);
+    auto &sdaDdr = *(&I2C_SDA_PIN + 1);
+    auto &sclPort = *(&I2C_SCL_PIN + 2);
+    auto &sdaPort = *(&I2C_SDA_PIN + 2);
+    // Half of a 100kHz SCL period, which every target (slave) supports
+    constexpr uint16_t halfClockLoops = F_CPU / 800000 + 1;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        // Disabling the TWI resets its state machine and hands the pins back to the port.
+        // The lines are driven low by setting their DDR bits with their PORT bits cleared, and released by clearing the DDR bits.
+        TWCR = _BV(TWINT);
+        uint8_t sclPullup = sclPort & _BV(I2C_SCL_BIT);
+        uint8_t sdaPullup = sdaPort & _BV(I2C_SDA_BIT);
+        sclPort &= ~_BV(I2C_SCL_BIT);
+        sdaPort &= ~_BV(I2C_SDA_BIT);
+
+        // A target stuck in a read holds SDA low until it has sent the rest of its byte, which takes at most 9 clocks
+        for (uint8_t i = 0; i < 9 && !(I2C_SDA_PIN & _BV(I2C_SDA_BIT)); i++) {
+            sclDdr |= _BV(I2C_SCL_BIT);
+            _delay_loop_2(halfClockLoops);
+            sclDdr &= ~_BV(I2C_SCL_BIT);
+            _delay_loop_2(halfClockLoops);
+        }
+
+        // STOP: SDA rises while SCL is high
+        sclDdr |= _BV(I2C_SCL_BIT);
+        _delay_loop_2(halfClockLoops);
+        sdaDdr |= _BV(I2C_SDA_BIT);
+        _delay_loop_2(halfClockLoops);
+        sclDdr &= ~_BV(I2C_SCL_BIT);
+        _delay_loop_2(halfClockLoops);
+        sdaDdr &= ~_BV(I2C_SDA_BIT);
+
+        sclPort |= sclPullup;
+        sdaPort |= sdaPullup;
+
+        i2c_detail::fail(TW_TIMEOUT);
+        i2c_detail::active = false;
+        i2c_detail::bufferFlags = 0;
+        i2c_detail::arbitrationRetries = I2C_ARBITRATION_RETRIES;
+        i2c_detail::busSeen = false;
+        TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWEA);
+    }
 }
 
 void I2C::setAddress(uint8_t address, bool generalCall) {
     TWAR = address << 1 | generalCall;
+    i2c_detail::randomState = address | 0x80; // never 0, and different for every player
 }
 
-void I2C::write(uint8_t address, const void *buffer, uint8_t size, bool wait) {
-    while (i2c_detail::active) {}
-    
-    for (uint8_t i = 0; i < size; i++) {
-        i2c_detail::twiBuffer[i] = ((const uint8_t *)buffer)[i];
-    }
-    i2c_detail::bufferIdx = 0;
-    i2c_detail::bufferSize = size;
+#if I2C_QUEUE_BUFFER_SIZE
+uint8_t I2C::write(uint8_t address, const void *buffer, size_type size, bool wait) {
+    i2c_detail::transaction_t *transaction = i2c_detail::reserve();
 
-    i2c_detail::error = TW_SUCCESS;
-    
-    i2c_detail::active = true;
-    i2c_detail::slaRW = address << 1 | TW_WRITE;
+    for (size_type i = 0; i < size; i++) {
+        transaction->data[i] = ((const uint8_t *)buffer)[i];
+    }
+    transaction->buffer = transaction->data;
+    transaction->size = size;
+    transaction->slaRW = address << 1 | TW_WRITE;
+    transaction->flags = 0;
 
-    uint8_t busyChecks = I2C_BUS_BUSY_CHECKS;
-    while (busyChecks) {
-        if ((I2C_SCL_PIN & _BV(I2C_SCL_BIT)) && (I2C_SDA_PIN & _BV(I2C_SDA_BIT))) {
-            busyChecks--;
-        } else {
-            i2c_detail::error = TW_MT_ARB_LOST;
-            return;
-        }
+    uint8_t ticket = i2c_detail::commit();
+    if (wait) {
+        i2c_detail::wait(ticket);
     }
+    return ticket;
+}
+
+template<typename T>
+uint8_t I2C::write(uint8_t address, const T *buffer, bool wait) {
+    static_assert(sizeof(T) <= I2C_QUEUE_BUFFER_SIZE, "Size of T must be less than or equal to I2C_QUEUE_BUFFER_SIZE.");
+    return I2C::write(address, (const void *)buffer, sizeof(T), wait);
+}
+#endif
+
+uint8_t I2C::writeNoCopy(uint8_t address, const void *buffer, size_type size) {
+    i2c_detail::transaction_t *transaction = i2c_detail::reserve();
+
+    transaction->buffer = (uint8_t *)buffer;
+    transaction->size = size;
+    transaction->slaRW = address << 1 | TW_WRITE;
+    transaction->flags = 0;
+
+    return i2c_detail::commit();
+}
 
-    TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWSTA);
+template<typename T>
+uint8_t I2C::writeNoCopy(uint8_t address, const T *object) {
+    static_assert(sizeof(T) <= (size_type)-1, "Size of T must fit in I2C::size_type.");
+    return I2C::writeNoCopy(address, (const void *)object, sizeof(T));
+}
+
+uint8_t I2C::write_P(uint8_t address, const void *buffer, size_type size, bool wait) {
+    i2c_detail::transaction_t *transaction = i2c_detail::reserve();
+
+    transaction->buffer = (uint8_t *)buffer;
+    transaction->size = size;
+    transaction->slaRW = address << 1 | TW_WRITE;
+    transaction->flags = _BV(i2c_detail::FLASH);
+
+    uint8_t ticket = i2c_detail::commit();
     if (wait) {
-        while (i2c_detail::active) {}
+        i2c_detail::wait(ticket);
     }
+    return ticket;
 }
 
 template<typename T>
-void I2C::write(uint8_t address, const T *buffer, bool wait) {
-    static_assert(sizeof(T) <= I2C_BUFFER_SIZE, "Size of T must be less than or equal to I2C_BUFFER_SIZE.");
-    I2C::write(address, (const void *)buffer, sizeof(T), wait);
+uint8_t I2C::write_P(uint8_t address, const T *object, bool wait) {
+    static_assert(sizeof(T) <= (size_type)-1, "Size of T must fit in I2C::size_type.");
+    return I2C::write_P(address, (const void *)object, sizeof(T), wait);
 }
 
-void I2C::read(uint8_t address, void *buffer, uint8_t size) {
-    while (i2c_detail::active) {}
-    
-    i2c_detail::rxBuffer = (uint8_t *)buffer;
+uint8_t I2C::writeSegments(uint8_t address, const I2C::segment_t *segments, uint8_t count, bool wait) {
+    i2c_detail::transaction_t *transaction = i2c_detail::reserve();
 
-    i2c_detail::bufferIdx = 0;
-    i2c_detail::bufferSize = size - 1;
+    transaction->buffer = (uint8_t *)segments;
+    transaction->size = count;
+    transaction->slaRW = address << 1 | TW_WRITE;
+    transaction->flags = _BV(i2c_detail::SEGMENTED);
 
-    i2c_detail::error = TW_SUCCESS;
+    uint8_t ticket = i2c_detail::commit();
+    if (wait) {
+        i2c_detail::wait(ticket);
+    }
+    return ticket;
+}
 
-    i2c_detail::active = true;
-    i2c_detail::slaRW = address << 1 | TW_READ;
+inline bool I2C::isComplete(uint8_t ticket) {
+    // Transactions complete in order, so the amount of completed transactions is the amount queued minus the amount still pending.
+    return (int8_t)(i2c_detail::queueIssued - i2c_detail::queueCount - ticket) >= 0;
+}
 
-    uint8_t busyChecks = I2C_BUS_BUSY_CHECKS;
-    while (busyChecks) {
-        if ((I2C_SCL_PIN & _BV(I2C_SCL_BIT)) && (I2C_SDA_PIN & _BV(I2C_SDA_BIT))) {
-            busyChecks--;
-        } else {
-            i2c_detail::error = TW_MR_ARB_LOST;
-            return;
-        }
+uint8_t I2C::read(uint8_t address, void *buffer, size_type size, bool wait) {
+    i2c_detail::transaction_t *transaction = i2c_detail::reserve();
+
+    transaction->buffer = (uint8_t *)buffer;
+    transaction->size = size - 1;
+    transaction->slaRW = address << 1 | TW_READ;
+    transaction->flags = 0;
+
+    uint8_t ticket = i2c_detail::commit();
+    if (wait) {
+        i2c_detail::wait(ticket);
     }
+    return ticket;
+}
 
-    TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWSTA);
-    while (i2c_detail::active) {}
+template<typename T, typename W>
+typename i2c_detail::if_bool<W>::type I2C::read(uint8_t address, T *object, W wait) {
+    static_assert(sizeof(T) <= (size_type)-1, "Size of T must fit in I2C::size_type.");
+    return I2C::read(address, (void *)object, sizeof(T), wait);
 }
 
-template<typename T>
-void I2C::read(uint8_t address, T *object) {
-    static_assert(sizeof(T) < 256, "Size of T must be less than 256.");
-    I2C::read(address, (void *)object, sizeof(T));
+uint8_t I2C::batch(const I2C::transfer_t *transfers, uint8_t count, bool wait) {
+    uint8_t ticket = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        i2c_detail::transaction_t *transaction = i2c_detail::reserve();
+
+        transaction->buffer = (uint8_t *)transfers[i].buffer;
+        transaction->size = transfers[i].size - transfers[i].direction; // reads store size - 1
+        transaction->slaRW = transfers[i].address << 1 | transfers[i].direction;
+        transaction->flags = i < count - 1 ? _BV(i2c_detail::RESTART) : 0;
+
+        // The transaction is started while the next ones are queued, and continues with them if they are queued in time.
+        ticket = i2c_detail::commit();
+    }
+    if (wait) {
+        i2c_detail::wait(ticket);
+    }
+    return ticket;
 }
 
+#if I2C_QUEUE_SIZE > 1
+uint8_t I2C::writeRead(uint8_t address, const void *txBuffer, size_type txSize, void *rxBuffer, size_type rxSize, bool wait) {
+    i2c_detail::transaction_t *transaction = i2c_detail::reserve(2);
+
+    transaction->buffer = (uint8_t *)txBuffer;
+    transaction->size = txSize;
+    transaction->slaRW = address << 1 | TW_WRITE;
+    transaction->flags = _BV(i2c_detail::RESTART);
 
-void I2C::transmit(const void *buffer, uint8_t size) {
-    for (uint8_t i = 0; i < size; i++) {
-        i2c_detail::twiBuffer[i] = ((uint8_t *)buffer)[i];
+    transaction = i2c_detail::next(transaction);
+    transaction->buffer = (uint8_t *)rxBuffer;
+    transaction->size = rxSize - 1;
+    transaction->slaRW = address << 1 | TW_READ;
+    transaction->flags = 0;
+
+    uint8_t ticket = i2c_detail::commit(2);
+    if (wait) {
+        i2c_detail::wait(ticket);
     }
-    i2c_detail::bufferIdx = 0;
-    i2c_detail::bufferSize = size;
+    return ticket;
+}
+#endif
+
+
+void I2C::transmit(const void *buffer, size_type size) {
+    for (size_type i = 0; i < size; i++) {
+        i2c_detail::txBuffer[i] = ((uint8_t *)buffer)[i];
+    }
+    I2C::transmitNoCopy(i2c_detail::txBuffer, size);
 }
 
 template <typename T>
 void I2C::transmit(const T *object) {
-    static_assert(sizeof(T) <= I2C_BUFFER_SIZE, "Size of T must be less than or equal to I2C_BUFFER_SIZE.");
+    static_assert(sizeof(T) <= I2C_TX_BUFFER_SIZE, "Size of T must be less than or equal to I2C_TX_BUFFER_SIZE.");
     I2C::transmit((const void *)object, sizeof(T));
 }
 
+void I2C::transmitNoCopy(const void *buffer, size_type size) {
+    i2c_detail::dataBuffer = (uint8_t *)buffer;
+    i2c_detail::bufferIdx = 0;
+    i2c_detail::bufferSize = size;
+    i2c_detail::bufferFlags = _BV(i2c_detail::TRANSMITTING);
+}
+
+template <typename T>
+void I2C::transmitNoCopy(const T *object) {
+    static_assert(sizeof(T) <= (size_type)-1, "Size of T must fit in I2C::size_type.");
+    I2C::transmitNoCopy((const void *)object, sizeof(T));
+}
+
+void I2C::transmit_P(const void *buffer, size_type size) {
+    I2C::transmitNoCopy(buffer, size);
+    i2c_detail::bufferFlags = _BV(i2c_detail::TRANSMITTING) | _BV(i2c_detail::FLASH);
+}
+
+template <typename T>
+void I2C::transmit_P(const T *object) {
+    static_assert(sizeof(T) <= (size_type)-1, "Size of T must fit in I2C::size_type.");
+    I2C::transmit_P((const void *)object, sizeof(T));
+}
+
+inline bool I2C::isTransmitComplete() {
+    return !(i2c_detail::bufferFlags & _BV(i2c_detail::TRANSMITTING));
+}
+
 void I2C::onRequest(void (*function)()) {
     i2c_detail::onRequestFunction = function;
 }
+void I2C::onRequestMore(void (*function)()) {
+    i2c_detail::onRequestMoreFunction = function;
+}
 void I2C::onReceive(void (*function)()) {
+#ifdef I2C_ADAPTIVE_LINK
+    i2c_detail::linkReceiveFunction = function; // called by linkOnReceive
+#else
     i2c_detail::onReceiveFunction = function;
+#endif
+}
+#if !I2C_RECEIVE_QUEUE_SIZE
+void I2C::onReceiveChunk(void (*function)()) {
+    i2c_detail::onReceiveChunkFunction = function;
+}
+#endif
+void I2C::onComplete(void (*function)(uint8_t ticket, uint8_t error)) {
+#ifdef I2C_ADAPTIVE_LINK
+    i2c_detail::linkCompleteFunction = function; // called by linkOnComplete
+#else
+    i2c_detail::onCompleteFunction = function;
+#endif
 }
 
 inline uint8_t I2C::getTWError() {
@@ -498,8 +1925,42 @@ inline uint8_t I2C::getTWError() {
 }
 
 inline uint8_t *I2C::getBuffer() {
-    return i2c_detail::twiBuffer;
+#if I2C_RECEIVE_QUEUE_SIZE
+    return i2c_detail::frameHead->data;
+#else
+    return i2c_detail::rxBuffer;
+#endif
+}
+
+inline I2C::size_type I2C::getReceivedSize() {
+#if I2C_RECEIVE_QUEUE_SIZE
+    return i2c_detail::frameHead->size;
+#else
+    return i2c_detail::bufferIdx;
+#endif
+}
+
+#if I2C_RECEIVE_QUEUE_SIZE
+uint8_t I2C::poll() {
+    uint8_t count = 0;
+    // Each counter has a single writer, so no locking is needed.
+    while ((uint8_t)(i2c_detail::framesReceived - i2c_detail::framesPolled)) {
+        if (i2c_detail::onReceiveFunction) {
+            i2c_detail::onReceiveFunction();
+        }
+        if (++i2c_detail::frameHead == i2c_detail::frames + I2C_RECEIVE_QUEUE_SIZE + 1) {
+            i2c_detail::frameHead = i2c_detail::frames;
+        }
+        i2c_detail::framesPolled++;
+        count++;
+    }
+    return count;
+}
+
+inline bool I2C::isGeneralCall() {
+    return i2c_detail::frameHead->generalCall;
 }
+#endif
 
 inline bool I2C::detectEmulator() {
     // TWWC is set when TWDR is written to without TWINT being set
@@ -515,10 +1976,22 @@ inline uint8_t I2C::getAddressFromId(uint8_t id) {
 }
 
 uint8_t I2C::handshake() {
+#ifdef I2C_ADAPTIVE_LINK
+    i2c_detail::linkAgreed = false;
+    i2c_detail::linkStarted = false; // the reads at rates which do not work are not errors of the link
+    i2c_detail::linkRate = 0;
+    i2c_detail::linkGeneration = 0;
+#endif
     for (int8_t i = I2C_MAX_PLAYERS - 1; i >= 0; ) {
+#ifdef I2C_ADAPTIVE_LINK
+        uint8_t response[2]; // handshake state and its complement
+
+        I2C::read(I2C::getAddressFromId(i), &response);
+#else
         uint8_t dummy;
 
         I2C::read(I2C::getAddressFromId(i), &dummy, 1);
+#endif
 
         switch (I2C::getTWError()) {
         case TW_MR_SLA_NACK:
@@ -528,7 +2001,16 @@ uint8_t I2C::handshake() {
 
             // handshakeState is the number of times the callback has been called.
             // When the callback has been called i times, the final Arduboy has joined.
-            while (i2c_detail::handshakeState < i) { }
+            if (!i2c_detail::waitForPlayers(i)) {
+                return I2C_HANDSHAKE_TIMED_OUT;
+            }
+#ifdef I2C_ADAPTIVE_LINK
+            // The last player finds the rate every player can be read at, and sends it to the others
+            if (i == 0) {
+                i2c_detail::agreeLinkRate();
+            }
+            i2c_detail::startLink();
+#endif
 
             return i;
         case TW_SUCCESS:
@@ -541,7 +2023,11 @@ uint8_t I2C::handshake() {
 
 #endif
 
+#ifndef I2C_REFERENCE_ISR
 ISR(TWI_vect, ISR_NAKED) {
+#if I2C_RECEIVE_QUEUE_SIZE
+    static_assert(offsetof(i2c_detail::frame_t, data) == sizeof(i2c_detail::frame_t) - I2C_RX_BUFFER_SIZE, "The data of a frame must be at its end.");
+#endif
     asm volatile (
 R"(
 ; --------------------- defines ----------------------- ;
@@ -561,132 +2047,165 @@ R"(
 .equ REPLY_ACK, (1 << TWINT) | (1 << TWEN) | (1 << TWIE) | (1 << TWEA)
 .equ REPLY_NACK, (1 << TWINT) | (1 << TWEN) | (1 << TWIE)
 .equ STOP, (1 << TWINT) | (1 << TWEN) | (1 << TWIE) | (1 << TWSTO) | (1 << TWEA)
+.equ RESUME, (1 << TWEN) | (1 << TWIE) | (1 << TWEA) ; does not clear TWINT
+
+; i2c_detail::transaction_t::flags
+.equ RESTART, 0
+.equ SEGMENTED, 1
+.equ FLASH, 2
+.equ CONTROLLING, 4 ; only in bufferFlags
+
+.equ LONG_TRANSFERS, %[longTransfers] ; 16-bit bufferIdx/bufferSize, the high bytes are handled in .if blocks
 
 ; -------------------- registers ---------------------- ;
-; r18 - TWSR (never used after function call)
+; Only these are saved by the prologue, so no other register may be used outside call_saved.
+; r18 - TWSR (never used after function call), then the TWCR value passed to idle_reti
 ; r19 - general use
+; r24:r25 - bufferIdx in the data paths
 ; r30 - general use
 ; r31 - general use
+; With the epilogue and reti, this takes 39 cycles, where saving every call-clobbered register took 67, and
+; call_saved adds 38 to each callback (measured by extras/isr, see its results.txt).
 ; --------------------- prologue ---------------------- ;
 push r18
 in r18, __SREG__
 push r18
-push r30
-push r31
-; save and restore call-clobbered registers
-; target (slave) could call function pointer 
 push r19
-push r20
-push r21
-push r22
-push r23
 push r24
 push r25
-push r26
-push r27
-; save and restore tmp and zero registers (could be used in function calls)
-push __tmp_reg__
+push r30
+push r31
+; save and restore the zero register (interrupted code may be using it after a mul)
 push __zero_reg__
 clr __zero_reg__
 ; ----------------------------------------------------- ;
 
 ; switch (TWSR)
-lds r18, TWSR ; no mask needed because prescaler bits are cleared
-
-cpi r18, 0x08
-breq TW_START
-
-; MT_MR
-cpi r18, 0x18
-breq TW_MT_SLA_ACK
-cpi r18, 0x28 
-breq TW_MT_DATA_ACK
-cpi r18, 0x38
-breq TW_MT_ARB_LOST ; same as TW_MR_ARB_LOST
-cpi r18, 0x40
-breq TW_MR_SLA_ACK
-cpi r18, 0x50
-breq TW_MR_DATA_ACK
-cpi r18, 0x58
-breq TW_MR_DATA_NACK
-
-; 64 instruction limit on branches
-rjmp SR_ST 
-
-TW_START:
-    ; TWDR = i2c_detail::slaRW;
-    lds r30, %[slaRW]
-    sts TWDR, r30
-    ; TWCR = REPLY_NACK;
-    ldi r30, REPLY_NACK
-    sts TWCR, r30
-    ; return;
-    rjmp pop_reti
+lds r18, TWSR
+andi r18, 0xF8 ; mask out the prescaler bits
+
+; goto *jump_table[TWSR >> 3];
+; Every status reaches its label 15 cycles after the lds of TWSR starts, where the cpi/breq chain took 6 cycles for
+; TW_MT_SLA_ACK up to 50 for TW_ST_LAST_DATA and 51 for default (measured by extras/isr, see its results.txt).
+ldi r30, pm_lo8(jump_table)
+ldi r31, pm_hi8(jump_table)
+mov r19, r18
+lsr r19
+lsr r19
+lsr r19
+add r30, r19
+adc r31, __zero_reg__
+ijmp
+
+jump_table:
+rjmp default                  ; 0x00 TW_BUS_ERROR
+rjmp TW_START                 ; 0x08
+rjmp TW_REP_START             ; 0x10
+rjmp TW_MT_SLA_ACK            ; 0x18
+rjmp default                  ; 0x20 TW_MT_SLA_NACK
+rjmp TW_MT_DATA_ACK           ; 0x28
+rjmp default                  ; 0x30 TW_MT_DATA_NACK
+rjmp TW_MT_ARB_LOST           ; 0x38 same as TW_MR_ARB_LOST
+rjmp TW_MR_SLA_ACK            ; 0x40
+rjmp default                  ; 0x48 TW_MR_SLA_NACK
+rjmp TW_MR_DATA_ACK           ; 0x50
+rjmp TW_MR_DATA_NACK          ; 0x58
+rjmp TW_SR_SLA_ACK            ; 0x60
+rjmp TW_SR_ARB_LOST_SLA_ACK   ; 0x68
+rjmp TW_SR_GCALL_ACK          ; 0x70
+rjmp TW_SR_ARB_LOST_GCALL_ACK ; 0x78
+rjmp TW_SR_DATA_ACK           ; 0x80
+rjmp TW_SR_DATA_NACK          ; 0x88
+rjmp TW_SR_GCALL_DATA_ACK     ; 0x90
+rjmp TW_SR_GCALL_DATA_NACK    ; 0x98
+rjmp TW_SR_STOP               ; 0xA0
+rjmp TW_ST_SLA_ACK            ; 0xA8
+rjmp TW_ST_ARB_LOST_SLA_ACK   ; 0xB0
+rjmp TW_ST_DATA_ACK           ; 0xB8
+rjmp TW_ST_DATA_NACK          ; 0xC0
+rjmp TW_ST_LAST_DATA          ; 0xC8
+rjmp default                  ; 0xD0 (unused)
+rjmp default                  ; 0xD8 (unused)
+rjmp default                  ; 0xE0 (unused)
+rjmp default                  ; 0xE8 (unused)
+rjmp default                  ; 0xF0 (unused)
+rjmp default                  ; 0xF8 TW_NO_INFO
 
 TW_MT_SLA_ACK:
 TW_MT_DATA_ACK:
-    ; if (i2c_detail::bufferIdx >= bufferSize) { stop(); return; }
-    lds r30, %[bufferIdx]
-    lds r31, %[bufferSize]
-    cp r30, r31
-    
-    brlt 1f ; 64 instruction limit on branches
-    rjmp stop_reti
+    ; if (i2c_detail::bufferIdx >= bufferSize) { nextSegment(); return; }
+    lds r24, %[bufferIdx]
+    lds r30, %[bufferSize]
+    cp r24, r30
+.if LONG_TRANSFERS
+    lds r25, %[bufferIdx] + 1
+    lds r31, %[bufferSize] + 1
+    cpc r25, r31
+.endif
+    brlo 1f ; 64 instruction limit on branches
+    rjmp next_segment
     1:
 
-    ; TWDR = i2c_detail::twiBuffer[i2c_detail::bufferIdx++];
-    inc r30
-    sts %[bufferIdx], r30
+    ; TWDR = i2c_detail::dataBuffer[i2c_detail::bufferIdx++]; (from flash if bufferFlags & _BV(FLASH))
+    lds r30, %[dataBuffer]
+    lds r31, %[dataBuffer] + 1
 
-    ; Use SUBI and SBCI as (non-existant) ADDI and (non-existant) ADCI
-    ; bufferIdx is already incremented so decrement to compensate
+    add r30, r24
+.if LONG_TRANSFERS
+    adc r31, r25
+.else
+    adc r31, __zero_reg__
+.endif
 
-    clr r31
-    subi r30, lo8(-(%[twiBuffer] - 1))
-    sbci r31, hi8(-(%[twiBuffer] - 1))
+    lds r19, %[bufferFlags]
+    sbrs r19, FLASH
     ld r30, Z
+    sbrc r19, FLASH ; Z is only clobbered by ld if this skips
+    lpm r30, Z
     sts TWDR, r30
 
+.if LONG_TRANSFERS
+    adiw r24, 1
+    sts %[bufferIdx] + 1, r25
+.else
+    inc r24
+.endif
+    sts %[bufferIdx], r24
+
     ; TWCR = REPLY_NACK;
     ldi r30, REPLY_NACK
     sts TWCR, r30
     ; return;
     rjmp pop_reti
 
-TW_MT_ARB_LOST:
-    ; TWCR = REPLY_ACK;
-    ldi r30, REPLY_ACK
-    sts TWCR, r30
-    ; i2c_detail::error = TW_MT_ARB_LOST;
-    ldi r30, 0x38
-    sts %[error], r30
-    ; active = false;
-    ; return;
-    rjmp active_false_reti
-; ----------------------------------------------------- ;
 
 TW_MR_DATA_NACK:
 TW_MR_DATA_ACK:
-    ; i2c_detail::rxBuffer[i2c_detail::bufferIdx++] = TWDR;
-    lds r19, %[bufferIdx]
-    inc r19
-    sts %[bufferIdx], r19
-    dec r19
-
-    lds r30, %[rxBuffer]
-    lds r31, %[rxBuffer] + 1
-
-    add r30, r19
+    ; i2c_detail::dataBuffer[i2c_detail::bufferIdx++] = TWDR;
+    lds r24, %[bufferIdx]
+    lds r30, %[dataBuffer]
+    lds r31, %[dataBuffer] + 1
+
+    add r30, r24
+.if LONG_TRANSFERS
+    lds r25, %[bufferIdx] + 1
+    adc r31, r25
+    adiw r24, 1
+    sts %[bufferIdx] + 1, r25
+.else
     adc r31, __zero_reg__
+    inc r24
+.endif
+    sts %[bufferIdx], r24
 
     lds r19, TWDR
     st Z, r19
     
-    ; if (TWSR == TW_MR_DATA_NACK) { stop(); return; }
+    ; if (TWSR == TW_MR_DATA_NACK) { finish(); return; }
     ; r18 holds TWSR
     cpi r18, 0x58
     brne 1f ; 64 instruction limit on branches
-    rjmp stop_reti
+    rjmp finish_reti
     1:
 ; ------------------ fallthrough ---------------------- ;
 TW_MR_SLA_ACK:
@@ -700,49 +2219,114 @@ TW_MR_SLA_ACK:
     lds r30, %[bufferIdx]
     lds r31, %[bufferSize]
     cp r30, r31
+.if LONG_TRANSFERS
+    lds r30, %[bufferIdx] + 1
+    lds r31, %[bufferSize] + 1
+    cpc r30, r31
+.endif
     ldi r30, REPLY_ACK
-    brlt 1f
+    brlo 1f
     ldi r30, REPLY_NACK
     1:
     sts TWCR, r30
     rjmp pop_reti
+TW_START:
+TW_REP_START:
+    ; i2c_detail::error = TW_SUCCESS;
+    ldi r19, 0xFF
+    sts %[error], r19
+    ; i2c_detail::transaction_t *transaction = i2c_detail::queueHead;
+    lds r30, %[queueHead]
+    lds r31, %[queueHead] + 1
+    ; i2c_detail::bufferFlags = transaction->flags | _BV(CONTROLLING);
+    ldd r18, Z + %[flagsOffset] ; TWSR is no longer needed
+    ori r18, (1 << CONTROLLING)
+    sts %[bufferFlags], r18
+    ; TWDR = transaction->slaRW;
+    ld r19, Z+
+    sts TWDR, r19
+    ; r24(:r25) = transaction->size, r19:r30 = transaction->buffer
+    ld r24, Z+
+.if LONG_TRANSFERS
+    ld r25, Z+
+.endif
+    ld r19, Z+
+    ld r30, Z
+    ; i2c_detail::bufferIdx = 0;
+    sts %[bufferIdx], __zero_reg__
+.if LONG_TRANSFERS
+    sts %[bufferIdx] + 1, __zero_reg__
+.endif
+    ; if (transaction->flags & _BV(SEGMENTED)) {
+    ;     i2c_detail::segment = (const I2C::segment_t *)transaction->buffer;
+    ;     i2c_detail::segmentCount = transaction->size;
+    ;     i2c_detail::bufferSize = 0; (the first segment is loaded by TW_MT_SLA_ACK)
+    ; } else {
+    ;     i2c_detail::dataBuffer = transaction->buffer;
+    ;     i2c_detail::segmentCount = 0;
+    ;     i2c_detail::bufferSize = transaction->size;
+    ; }
+    sbrs r18, SEGMENTED
+    rjmp 1f
+    sts %[segment], r19
+    sts %[segment] + 1, r30
+    sts %[segmentCount], r24
+    clr r24
+    clr r25
+    rjmp 2f
+    1:
+    sts %[dataBuffer], r19
+    sts %[dataBuffer] + 1, r30
+    sts %[segmentCount], __zero_reg__
+    2:
+    sts %[bufferSize], r24
+.if LONG_TRANSFERS
+    sts %[bufferSize] + 1, r25
+.endif
+    ; TWCR = REPLY_NACK;
+    ldi r30, REPLY_NACK
+    sts TWCR, r30
+    ; return;
+    rjmp pop_reti
 ; ----------------------------------------------------- ;
-SR_ST:
-cpi r18, 0x60
-breq TW_SR_SLA_ACK
-cpi r18, 0x68
-breq TW_SR_ARB_LOST_SLA_ACK
-cpi r18, 0x70
-breq TW_SR_GCALL_ACK
-cpi r18, 0x78
-breq TW_SR_ARB_LOST_GCALL_ACK
-cpi r18, 0x80
-breq TW_SR_DATA_ACK
-cpi r18, 0x90
-breq TW_SR_GCALL_DATA_ACK
-cpi r18, 0xA0
-breq TW_SR_STOP
-cpi r18, 0xA8
-breq TW_ST_SLA_ACK
-cpi r18, 0xB0
-breq TW_ST_ARB_LOST_SLA_ACK
-cpi r18, 0xB8
-breq TW_ST_DATA_ACK
-cpi r18, 0xC0
-breq TW_ST_DATA_NACK
-cpi r18, 0xC8
-breq TW_ST_LAST_DATA
-
-rjmp default
+TW_ST_DATA_NACK:
+TW_ST_LAST_DATA:
+    ; i2c_detail::bufferFlags = 0; (clears TRANSMITTING)
+    sts %[bufferFlags], __zero_reg__
+    ; idle(REPLY_ACK);
+    ; return;
+    ldi r18, REPLY_ACK
+    rjmp idle_reti
 
-TW_SR_SLA_ACK:
 TW_SR_ARB_LOST_SLA_ACK:
-TW_SR_GCALL_ACK:
 TW_SR_ARB_LOST_GCALL_ACK:
-    ; i2c_detail::active = TWSR; (true)
-    sts %[active], r18 ; r18 holds TWSR
+    ; i2c_detail::bufferFlags &= ~_BV(CONTROLLING); (the transaction is sent again once the bus is free)
+    lds r19, %[bufferFlags]
+    andi r19, ~(1 << CONTROLLING)
+    sts %[bufferFlags], r19
+; ------------------ fallthrough ---------------------- ;
+TW_SR_SLA_ACK:
+TW_SR_GCALL_ACK:
+    ; i2c_detail::active = true;
+    ldi r19, 1
+    sts %[active], r19
     ; i2c_detail::bufferIdx = 0;
     sts %[bufferIdx], __zero_reg__
+.if LONG_TRANSFERS
+    sts %[bufferIdx] + 1, __zero_reg__
+.endif
+)"
+#if I2C_RECEIVE_QUEUE_SIZE
+R"(
+    ; i2c_detail::frameTail->generalCall = TWSR & 0x10; (TW_SR_GCALL_ACK and TW_SR_ARB_LOST_GCALL_ACK)
+    lds r30, %[frameTail]
+    lds r31, %[frameTail] + 1
+    mov r19, r18
+    andi r19, 0x10
+    std Z + %[frameGeneralCall], r19
+)"
+#endif
+R"(
     ; TWCR = REPLY_ACK;
     ldi r30, REPLY_ACK
     sts TWCR, r30
@@ -751,62 +2335,158 @@ TW_SR_ARB_LOST_GCALL_ACK:
 
 TW_SR_DATA_ACK:
 TW_SR_GCALL_DATA_ACK:
-    ; i2c_detail::twiBuffer[i2c_detail::bufferIdx++] = TWDR;
-    lds r30, %[bufferIdx]
-    inc r30
-    sts %[bufferIdx], r30
+)"
+#if I2C_RECEIVE_QUEUE_SIZE
+R"(
+    ; i2c_detail::frameTail->data[i2c_detail::bufferIdx++] = TWDR;
+    lds r24, %[bufferIdx]
+    lds r30, %[frameTail]
+    lds r31, %[frameTail] + 1
+
+    add r30, r24
+.if LONG_TRANSFERS
+    lds r25, %[bufferIdx] + 1
+    adc r31, r25
+    adiw r24, 1
+    sts %[bufferIdx] + 1, r25
+.else
+    adc r31, __zero_reg__
+    inc r24
+.endif
+    sts %[bufferIdx], r24
 
-    ; Use SUBI and SBCI as (non-existant) ADDI and (non-existant) ADCI
-    ; bufferIdx is already incremented so decrement to compensate
+    lds r19, TWDR
+    std Z + %[frameSize] - %[rxBufferSize], r19 ; data is the last member of frame_t
+)"
+#else
+R"(
+    ; i2c_detail::rxBuffer[i2c_detail::bufferIdx++] = TWDR;
+    lds r24, %[bufferIdx]
+    ldi r30, lo8(%[rxBuffer])
+    ldi r31, hi8(%[rxBuffer])
+
+    add r30, r24
+.if LONG_TRANSFERS
+    lds r25, %[bufferIdx] + 1
+    adc r31, r25
+    adiw r24, 1
+    sts %[bufferIdx] + 1, r25
+.else
+    adc r31, __zero_reg__
+    inc r24
+.endif
+    sts %[bufferIdx], r24
 
-    clr r31
-    subi r30, lo8(-(%[twiBuffer] - 1))
-    sbci r31, hi8(-(%[twiBuffer] - 1))
     lds r19, TWDR
     st Z, r19
+)"
+#endif
+R"(
+    ; if (i2c_detail::bufferIdx == I2C_RX_BUFFER_SIZE) { receiveFull(); return; }
+    cpi r24, lo8(%[rxBufferSize])
+.if LONG_TRANSFERS
+    ldi r19, hi8(%[rxBufferSize])
+    cpc r25, r19
+.endif
+    brne 1f ; 64 instruction limit on branches
+    rjmp receive_full
+    1:
 
     ; TWCR = REPLY_ACK;
     ldi r30, REPLY_ACK
     sts TWCR, r30
     ; return;
     rjmp pop_reti
+TW_SR_DATA_NACK:
+TW_SR_GCALL_DATA_NACK:
+    ; (the buffer was full, so the write is cut short and handled like a stop)
 TW_SR_STOP:
     ; TWCR = REPLY_ACK;
     ldi r30, REPLY_ACK
     sts TWCR, r30
+)"
+#if I2C_RECEIVE_QUEUE_SIZE
+R"(
+    ; queueFrame(); (out of line to keep the branches to the ST paths in range)
+    rjmp queue_frame
+)"
+#else
+R"(
     ; i2c_detail::onReceiveFunction();
     lds r30, %[onReceiveFunction]
     lds r31, %[onReceiveFunction] + 1
-    icall
-    ; i2c_detail::active = false;
+    rcall call_saved
+    ; idle(RESUME);
     ; return;
-    rjmp active_false_reti;
+    ldi r18, RESUME
+    rjmp idle_reti
+)"
+#endif
+R"(
 
 ; ----------------------------------------------------- ;
 TW_ST_ARB_LOST_SLA_ACK:
+    ; i2c_detail::bufferFlags &= ~_BV(CONTROLLING); (the transaction is sent again once the bus is free)
+    lds r19, %[bufferFlags]
+    andi r19, ~(1 << CONTROLLING)
+    sts %[bufferFlags], r19
+; ------------------ fallthrough ---------------------- ;
 TW_ST_SLA_ACK:
-    ; i2c_detail::active = TWSR; (true)
-    sts %[active], r18
+    ; i2c_detail::active = true;
+    ldi r19, 1
+    sts %[active], r19
     ; i2c_detail::onRequestFunction();
-    lds 30, %[onRequestFunction]
-    lds 31, %[onRequestFunction] + 1
-    icall
+    lds r30, %[onRequestFunction]
+    lds r31, %[onRequestFunction] + 1
+    rcall call_saved
 ; ------------------ fallthrough ---------------------- ;
 TW_ST_DATA_ACK:
-    ; TWDR = i2c_detail::twiBuffer[i2c_detail::bufferIdx++];
-    lds r30, %[bufferIdx] 
-    inc r30
-    sts %[bufferIdx], r30
+    ; TWDR = i2c_detail::dataBuffer[i2c_detail::bufferIdx++]; (from flash if bufferFlags & _BV(FLASH))
+    lds r24, %[bufferIdx]
+    lds r30, %[dataBuffer]
+    lds r31, %[dataBuffer] + 1
+
+    add r30, r24
+.if LONG_TRANSFERS
+    lds r25, %[bufferIdx] + 1
+    adc r31, r25
+.else
+    adc r31, __zero_reg__
+.endif
 
-    ; Use SUBI and SBCI as (non-existant) ADDI and (non-existant) ADCI
-    ; bufferIdx is already incremented so decrement to compensate
-    
-    clr r31
-    subi r30, lo8(-(%[twiBuffer] - 1))
-    sbci r31, hi8(-(%[twiBuffer] - 1))
+    lds r19, %[bufferFlags]
+    sbrs r19, FLASH
     ld r30, Z
+    sbrc r19, FLASH ; Z is only clobbered by ld if this skips
+    lpm r30, Z
     sts TWDR, r30
-    
+
+.if LONG_TRANSFERS
+    adiw r24, 1
+    sts %[bufferIdx] + 1, r25
+.else
+    inc r24
+.endif
+    sts %[bufferIdx], r24
+
+    ; if (i2c_detail::bufferIdx >= i2c_detail::bufferSize && i2c_detail::onRequestMoreFunction) {
+    ;     i2c_detail::onRequestMoreFunction(); (may give the next chunk)
+    ; }
+    lds r30, %[bufferSize]
+    cp r24, r30
+.if LONG_TRANSFERS
+    lds r31, %[bufferSize] + 1
+    cpc r25, r31
+.endif
+    brlo 1f
+    lds r30, %[onRequestMoreFunction]
+    lds r31, %[onRequestMoreFunction] + 1
+    mov r19, r30
+    or r19, r31
+    breq 1f
+    rcall call_saved
+    1:
+
     ; if (i2c_detail::bufferIdx < i2c_detail::bufferSize) {
     ;    TWCR = REPLY_ACK;
     ; } else {
@@ -815,96 +2495,447 @@ TW_ST_DATA_ACK:
     ; return;
     ; (reuse code in MR)
     rjmp TW_MR_SLA_ACK
-TW_ST_DATA_NACK:
-TW_ST_LAST_DATA:
-    ; TWCR = REPLY_ACK;
-    ldi r30, REPLY_ACK
+; ----------------------------------------------------- ;
+TW_MT_ARB_LOST:
+    ; i2c_detail::bufferFlags &= ~_BV(CONTROLLING);
+    lds r19, %[bufferFlags]
+    andi r19, ~(1 << CONTROLLING)
+    sts %[bufferFlags], r19
+    ; if (i2c_detail::arbitrationRetries) {
+    ;     i2c_detail::arbitrationRetries--;
+    ;     TWCR = REPLY_ACK | _BV(TWSTA); (the transaction is sent again once the bus is free)
+    ;     return;
+    ; }
+    lds r19, %[arbitrationRetries]
+    subi r19, 1
+    brcs 1f
+    sts %[arbitrationRetries], r19
+    ldi r30, REPLY_ACK | (1 << TWSTA)
+    sts TWCR, r30
+    rjmp pop_reti
+    1:
+    ; i2c_detail::error = TW_MT_ARB_LOST;
+    ldi r30, 0x38
+    sts %[error], r30
+    ; dequeue();
+    ; idle(REPLY_ACK);
+    ; return;
+    ldi r18, REPLY_ACK
+    rjmp dequeue_reti
+)"
+#if I2C_RECEIVE_QUEUE_SIZE
+R"(
+; ----------------------------------------------------- ;
+queue_frame:
+    ; if ((uint8_t)(i2c_detail::framesReceived - i2c_detail::framesPolled) < I2C_RECEIVE_QUEUE_SIZE) {
+    ;     i2c_detail::frameTail->size = i2c_detail::bufferIdx;
+    ;     i2c_detail::frameTail = next(i2c_detail::frameTail);
+    ;     i2c_detail::framesReceived++; (publishes the frame to I2C::poll)
+    ; }
+    ; (otherwise the queue is full and the frame is dropped)
+    lds r19, %[framesReceived]
+    lds r24, %[framesPolled]
+    mov r25, r19
+    sub r25, r24
+    cpi r25, %[receiveQueueSize]
+    brsh 2f
+
+    lds r30, %[frameTail]
+    lds r31, %[frameTail] + 1
+    lds r24, %[bufferIdx]
+    st Z, r24
+.if LONG_TRANSFERS
+    lds r24, %[bufferIdx] + 1
+    std Z + 1, r24
+.endif
+
+    subi r30, lo8(-(%[frameSize]))
+    sbci r31, hi8(-(%[frameSize]))
+    ldi r24, hi8(%[frames] + %[frameSize] * (%[receiveQueueSize] + 1))
+    cpi r30, lo8(%[frames] + %[frameSize] * (%[receiveQueueSize] + 1))
+    cpc r31, r24
+    brne 1f
+    ldi r30, lo8(%[frames])
+    ldi r31, hi8(%[frames])
+    1:
+    sts %[frameTail], r30
+    sts %[frameTail] + 1, r31
+
+    inc r19
+    sts %[framesReceived], r19
+    2:
+    ; idle(RESUME);
+    ; return;
+    ldi r18, RESUME
+    rjmp idle_reti
+)"
+#endif
+R"(
+)"
+#if I2C_RECEIVE_QUEUE_SIZE
+R"(
+; ----------------------------------------------------- ;
+receive_full:
+    ; TWCR = REPLY_NACK; (the frame is full, so NACK the next byte)
+    ; return;
+    ldi r30, REPLY_NACK
+    sts TWCR, r30
+    rjmp pop_reti
+)"
+#else
+R"(
+; ----------------------------------------------------- ;
+receive_full:
+    ; if (!i2c_detail::onReceiveChunkFunction) {
+    ;     TWCR = REPLY_NACK; (the buffer is full, so NACK the next byte)
+    ;     return;
+    ; }
+    lds r30, %[onReceiveChunkFunction]
+    lds r31, %[onReceiveChunkFunction] + 1
+    mov r19, r30
+    or r19, r31
+    brne 1f
+    ldi r30, REPLY_NACK
     sts TWCR, r30
-    ; i2c_detail::active = false;
+    rjmp pop_reti
+    1:
+    ; TWCR = REPLY_ACK; (receive the next byte while the chunk is handled)
+    ; i2c_detail::onReceiveChunkFunction();
+    ; i2c_detail::bufferIdx = 0;
     ; return;
-    rjmp active_false_reti
+    ldi r19, REPLY_ACK
+    sts TWCR, r19
+    rcall call_saved
+    sts %[bufferIdx], __zero_reg__
+.if LONG_TRANSFERS
+    sts %[bufferIdx] + 1, __zero_reg__
+.endif
+    rjmp pop_reti
+)"
+#endif
+R"(
+; ----------------------------------------------------- ;
+next_segment:
+    ; if (!i2c_detail::segmentCount) { finish(); return; }
+    ; i2c_detail::segmentCount--;
+    lds r19, %[segmentCount]
+    subi r19, 1
+    brcs finish_reti
+    sts %[segmentCount], r19
+    ; i2c_detail::dataBuffer = i2c_detail::segment->buffer;
+    ; i2c_detail::bufferSize = i2c_detail::segment->size;
+    ; i2c_detail::segment++;
+    lds r30, %[segment]
+    lds r31, %[segment] + 1
+    ld r19, Z+
+    sts %[dataBuffer], r19
+    ld r19, Z+
+    sts %[dataBuffer] + 1, r19
+    ld r19, Z+
+    sts %[bufferSize], r19
+.if LONG_TRANSFERS
+    ld r19, Z+
+    sts %[bufferSize] + 1, r19
+.endif
+    sts %[segment], r30
+    sts %[segment] + 1, r31
+    ; i2c_detail::bufferIdx = 0;
+    sts %[bufferIdx], __zero_reg__
+.if LONG_TRANSFERS
+    sts %[bufferIdx] + 1, __zero_reg__
+.endif
+    ; check the size again to skip empty segments
+    rjmp TW_MT_DATA_ACK
 ; ----------------------------------------------------- ;
 default:
+    ; if (TWSR == TW_BUS_ERROR && !(i2c_detail::bufferFlags & _BV(CONTROLLING))) {
+    ;     i2c_detail::bufferFlags = 0; (a read which was cut off has ended)
+    ;     idle(STOP); (as a target or while waiting for the bus, so a queued transaction has not started and is sent once it is free)
+    ;     return;
+    ; }
+    tst r18
+    brne 1f
+    lds r19, %[bufferFlags]
+    sbrc r19, CONTROLLING
+    rjmp 1f
+    sts %[bufferFlags], __zero_reg__
+    ldi r18, STOP
+    rjmp idle_reti
+    1:
     ; i2c_detail::error = TWSR;
     sts %[error], r18 
+    ; i2c_detail::bufferFlags = 0; (a read which was cut off by a bus error has ended too)
+    sts %[bufferFlags], __zero_reg__
+    ; if (TWSR == TW_BUS_ERROR) { stop(); return; } (the bus is released, so a repeated start is impossible)
+    tst r18
+    breq stop_reti
+
+    finish_reti:
+    ; if (i2c_detail::queueHead->flags & _BV(RESTART) && i2c_detail::queueCount > 1) {
+    ;     dequeue();
+    ;     idle(REPLY_NACK); (sends a repeated start for the next transaction)
+    ;     return;
+    ; }
+    lds r30, %[queueHead]
+    lds r31, %[queueHead] + 1
+    ldd r19, Z + %[flagsOffset]
+    sbrs r19, RESTART
+    rjmp stop_reti
+    lds r19, %[queueCount]
+    cpi r19, 2
+    brlo stop_reti
+    ldi r18, REPLY_NACK
+    rjmp dequeue_reti
 
     stop_reti:
+    ; reply = STOP;
+    ; (idle_reti writes it together with TWSTA if another transaction is queued, which sends a STOP followed by a START,
+    ; so the ISR returns without waiting for the STOP to be sent)
+    ldi r18, STOP
+
+    dequeue_reti:
+    ; i2c_detail::bufferFlags &= ~_BV(CONTROLLING);
+    lds r19, %[bufferFlags]
+    andi r19, ~(1 << CONTROLLING)
+    sts %[bufferFlags], r19
+    ; if (!i2c_detail::queueCount) { idle(reply); return; }
+    ; i2c_detail::queueCount--;
+    lds r19, %[queueCount]
+    subi r19, 1
+    brcs idle_reti
+    sts %[queueCount], r19
+    ; i2c_detail::arbitrationRetries = I2C_ARBITRATION_RETRIES;
+    ldi r24, %[arbitrationRetryLimit]
+    sts %[arbitrationRetries], r24
+
+    ; if (++i2c_detail::queueHead == i2c_detail::queue + I2C_QUEUE_SIZE) {
+    ;     i2c_detail::queueHead = i2c_detail::queue;
+    ; }
+    lds r30, %[queueHead]
+    lds r31, %[queueHead] + 1
+    subi r30, lo8(-(%[transactionSize]))
+    sbci r31, hi8(-(%[transactionSize]))
+    ldi r24, hi8(%[queue] + %[queueSize])
+    cpi r30, lo8(%[queue] + %[queueSize])
+    cpc r31, r24
+    brne 1f
+    ldi r30, lo8(%[queue])
+    ldi r31, hi8(%[queue])
+    1:
+    sts %[queueHead], r30
+    sts %[queueHead] + 1, r31
 
-    ; TWCR = STOP;
-    ldi r30, STOP
-    sts TWCR, r30
+    ; if (i2c_detail::onCompleteFunction) {
+    ;     i2c_detail::onCompleteFunction(i2c_detail::queueIssued - i2c_detail::queueCount, i2c_detail::error);
+    ; }
+    lds r30, %[onCompleteFunction]
+    lds r31, %[onCompleteFunction] + 1
+    mov r24, r30
+    or r24, r31
+    breq idle_reti
+    push r18 ; r18 holds the reply
+    push r22 ; not saved by the prologue, and call_saved would save it after it holds the argument
+    lds r24, %[queueIssued]
+    sub r24, r19 ; r19 holds queueCount
+    lds r22, %[error]
+    rcall call_saved
+    pop r22
+    pop r18
 
-    ; while (TWCR & _BV(TWSTO)) {}
+    idle_reti:
+    ; if (i2c_detail::queueCount) {
+    ;     TWCR = reply | _BV(TWSTA); (start the next transaction once the bus is free)
+    ;     i2c_detail::active = true;
+    ; } else {
+    ;     TWCR = reply;
+    ;     i2c_detail::active = false;
+    ; }
+    lds r19, %[queueCount]
+    tst r19
+    breq 1f
+    ori r18, (1 << TWSTA)
+    ldi r19, 1
     1:
-    lds r30, TWCR
-    sbrc r30, TWSTO ; skip if bit in register clear
-    rjmp 1b
-
-    active_false_reti:
-    ; i2c_detail::active = false;
-    sts %[active], __zero_reg__
+    sts TWCR, r18
+    sts %[active], r19
 
 ; --------------------- epilogue ---------------------- ;
     pop_reti:
     pop __zero_reg__
-    pop __tmp_reg__
-    pop r27
-    pop r26
+    pop r31
+    pop r30
     pop r25
     pop r24
-    pop r23
-    pop r22
-    pop r21
-    pop r20
     pop r19
-    pop r31
-    pop r30
     pop r18
     out __SREG__, r18
     pop r18
     reti
+
+; ----------------------------------------------------- ;
+call_saved:
+    ; Calls the function in Z, saving the call-clobbered registers the prologue did not.
+    ; Only the paths which call a callback pay for them.
+    push r20
+    push r21
+    push r22
+    push r23
+    push r26
+    push r27
+    push __tmp_reg__
+    icall
+    pop __tmp_reg__
+    pop r27
+    pop r26
+    pop r23
+    pop r22
+    pop r21
+    pop r20
+    ret
 )"
         : // Output Operands
         [error]            "=m" (i2c_detail::error),
         [active]           "=m" (i2c_detail::active),
         [bufferIdx]        "=m" (i2c_detail::bufferIdx),
+        [bufferSize]       "=m" (i2c_detail::bufferSize),
+        [dataBuffer]       "=m" (i2c_detail::dataBuffer),
+#if I2C_RECEIVE_QUEUE_SIZE
+        [frameTail]        "=m" (i2c_detail::frameTail),
+        [framesReceived]   "=m" (i2c_detail::framesReceived),
+#else
         [rxBuffer]         "=m" (i2c_detail::rxBuffer),
-        [twiBuffer]        "=m" (i2c_detail::twiBuffer)
+#endif
+        [queueHead]        "=m" (i2c_detail::queueHead),
+        [queueCount]       "=m" (i2c_detail::queueCount),
+        [segment]          "=m" (i2c_detail::segment),
+        [segmentCount]     "=m" (i2c_detail::segmentCount),
+        [bufferFlags]      "=m" (i2c_detail::bufferFlags),
+        [arbitrationRetries] "=m" (i2c_detail::arbitrationRetries)
         : // Input Operands
         [onRequestFunction] "m" (i2c_detail::onRequestFunction),
+        [onRequestMoreFunction] "m" (i2c_detail::onRequestMoreFunction),
         [onReceiveFunction] "m" (i2c_detail::onReceiveFunction),
-        [bufferSize]        "m" (i2c_detail::bufferSize),
-        [slaRW]             "m" (i2c_detail::slaRW)
+#if !I2C_RECEIVE_QUEUE_SIZE
+        [onReceiveChunkFunction] "m" (i2c_detail::onReceiveChunkFunction),
+#endif
+        [onCompleteFunction] "m" (i2c_detail::onCompleteFunction),
+        [queueIssued]       "m" (i2c_detail::queueIssued),
+        [queue]             "m" (i2c_detail::queue),
+#if I2C_RECEIVE_QUEUE_SIZE
+        [frames]            "m" (i2c_detail::frames),
+        [framesPolled]      "m" (i2c_detail::framesPolled),
+        [frameSize]         "i" (sizeof(i2c_detail::frame_t)),
+        [frameGeneralCall]  "i" (offsetof(i2c_detail::frame_t, generalCall)),
+        [receiveQueueSize]  "i" (I2C_RECEIVE_QUEUE_SIZE),
+#endif
+        [transactionSize]   "i" (sizeof(i2c_detail::transaction_t)),
+        [queueSize]         "i" (sizeof(i2c_detail::queue)),
+        [longTransfers]     "i" (sizeof(I2C::size_type) > 1),
+        [rxBufferSize]      "i" (I2C_RX_BUFFER_SIZE),
+        [arbitrationRetryLimit] "i" (I2C_ARBITRATION_RETRIES),
+        [flagsOffset]       "i" (offsetof(i2c_detail::transaction_t, flags))
     );
 }
+#else // #ifndef I2C_REFERENCE_ISR
+// The C version of the asm ISR, used by I2C_REFERENCE_ISR and the host build.
+namespace i2c_detail {
+
+void dequeue() {
+    bufferFlags &= ~_BV(CONTROLLING);
+    if (!queueCount) {
+        return;
+    }
+    queueCount--;
+    arbitrationRetries = I2C_ARBITRATION_RETRIES;
+    if (++queueHead == queue + I2C_QUEUE_SIZE) {
+        queueHead = queue;
+    }
+    if (onCompleteFunction) {
+        onCompleteFunction(queueIssued - queueCount, error);
+    }
+}
+
+void idle(uint8_t reply) {
+    if (queueCount) {
+        TWCR = reply | _BV(TWSTA); // start the next transaction once the bus is free
+        active = true;
+    } else {
+        TWCR = reply;
+        active = false;
+    }
+}
+
+uint8_t readBuffer() {
+    const uint8_t *address = (const uint8_t *)&dataBuffer[bufferIdx++];
+    return bufferFlags & _BV(FLASH) ? pgm_read_byte(address) : *address;
+}
+
+void stop() {
+    dequeue();
+    idle(_BV(TWINT) | _BV(TWEN) | _BV(TWIE) | _BV(TWSTO) | _BV(TWEA)); // with TWSTA, a STOP followed by a START
+}
+
+void finish() {
+    if (queueHead->flags & _BV(RESTART) && queueCount > 1) {
+        dequeue();
+        idle(_BV(TWINT) | _BV(TWEN) | _BV(TWIE)); // repeated start
+    } else {
+        stop();
+    }
+}
+
+}
 
-#if 0
 ISR(TWI_vect) {
-    switch (TWSR) { // prescaler bits are cleared, no mask needed
+    switch (TW_STATUS) { // prescaler bits are masked out
     case TW_START:
-        TWDR = i2c_detail::slaRW;
+    case TW_REP_START:
+        i2c_detail::error = TW_SUCCESS;
+        i2c_detail::bufferIdx = 0;
+        i2c_detail::bufferFlags = i2c_detail::queueHead->flags | _BV(i2c_detail::CONTROLLING);
+        if (i2c_detail::queueHead->flags & _BV(i2c_detail::SEGMENTED)) {
+            i2c_detail::segment = (const I2C::segment_t *)i2c_detail::queueHead->buffer;
+            i2c_detail::segmentCount = i2c_detail::queueHead->size;
+            i2c_detail::bufferSize = 0; // the first segment is loaded by TW_MT_SLA_ACK
+        } else {
+            i2c_detail::dataBuffer = i2c_detail::queueHead->buffer;
+            i2c_detail::segmentCount = 0;
+            i2c_detail::bufferSize = i2c_detail::queueHead->size;
+        }
+        TWDR = i2c_detail::queueHead->slaRW;
         TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE);
         break;
     // MT
     case TW_MT_SLA_ACK:
     case TW_MT_DATA_ACK:
-        if (i2c_detail::bufferIdx < i2c_detail::bufferSize) {
-            TWDR = i2c_detail::twiBuffer[i2c_detail::bufferIdx++];
-            TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE);
-        } else {
-            TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE) | _BV(TWSTO) | _BV(TWEA);
-            while (TWCR & _BV(TWSTO)) {  }
-            i2c_detail::active = false;
+        while (i2c_detail::bufferIdx >= i2c_detail::bufferSize) {
+            if (!i2c_detail::segmentCount) {
+                i2c_detail::finish();
+                return;
+            }
+            i2c_detail::segmentCount--;
+            i2c_detail::dataBuffer = (uint8_t *)i2c_detail::segment->buffer;
+            i2c_detail::bufferSize = i2c_detail::segment->size;
+            i2c_detail::segment++;
+            i2c_detail::bufferIdx = 0;
         }
+        TWDR = i2c_detail::readBuffer();
+        TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE);
         break;
     case TW_MT_ARB_LOST: // same as TW_MR_ARB_LOST
-        i2c_detail::active = false;
+        i2c_detail::bufferFlags &= ~_BV(i2c_detail::CONTROLLING);
+        if (i2c_detail::arbitrationRetries) {
+            i2c_detail::arbitrationRetries--;
+            TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE) | _BV(TWEA) | _BV(TWSTA); // sent again once the bus is free
+            break;
+        }
         i2c_detail::error = TW_MT_ARB_LOST;
-        TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE) | _BV(TWEA);
+        i2c_detail::dequeue();
+        i2c_detail::idle(_BV(TWINT) | _BV(TWEN) | _BV(TWIE) | _BV(TWEA));
         break;
     // MR
     case TW_MR_DATA_ACK:
-        i2c_detail::rxBuffer[i2c_detail::bufferIdx++] = TWDR;
+        i2c_detail::dataBuffer[i2c_detail::bufferIdx++] = TWDR;
         __attribute__((fallthrough));
     case TW_MR_SLA_ACK:
         if (i2c_detail::bufferIdx < i2c_detail::bufferSize) {
@@ -914,19 +2945,22 @@ ISR(TWI_vect) {
         }
         break;
     case TW_MR_DATA_NACK:
-        i2c_detail::rxBuffer[i2c_detail::bufferIdx++] = TWDR;
-        TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE) | _BV(TWSTO) | _BV(TWEA);
-        while (TWCR & _BV(TWSTO)) {  }
-        i2c_detail::active = false;
+        i2c_detail::dataBuffer[i2c_detail::bufferIdx++] = TWDR;
+        i2c_detail::finish();
         break;
     // ST
-    case TW_ST_SLA_ACK:
     case TW_ST_ARB_LOST_SLA_ACK:
+        i2c_detail::bufferFlags &= ~_BV(i2c_detail::CONTROLLING); // the transaction is sent again once the bus is free
+        __attribute__((fallthrough));
+    case TW_ST_SLA_ACK:
         i2c_detail::active = true;
         i2c_detail::onRequestFunction();
         __attribute__((fallthrough));
     case TW_ST_DATA_ACK:
-        TWDR = i2c_detail::twiBuffer[i2c_detail::bufferIdx++];
+        TWDR = i2c_detail::readBuffer();
+        if (i2c_detail::bufferIdx >= i2c_detail::bufferSize && i2c_detail::onRequestMoreFunction) {
+            i2c_detail::onRequestMoreFunction();
+        }
         if (i2c_detail::bufferIdx < i2c_detail::bufferSize) {
             TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE) | _BV(TWEA);
         } else {
@@ -935,36 +2969,82 @@ ISR(TWI_vect) {
         break;
     case TW_ST_DATA_NACK:
     case TW_ST_LAST_DATA: // last interrupt cleared TWEA
-        TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE) | _BV(TWEA);
-        i2c_detail::active = false;
+        i2c_detail::bufferFlags = 0; // clears TRANSMITTING
+        i2c_detail::idle(_BV(TWINT) | _BV(TWEN) | _BV(TWIE) | _BV(TWEA));
         break;
     // SR
-    case TW_SR_SLA_ACK:
-    case TW_SR_GCALL_ACK:
     case TW_SR_ARB_LOST_SLA_ACK:
     case TW_SR_ARB_LOST_GCALL_ACK:
+        i2c_detail::bufferFlags &= ~_BV(i2c_detail::CONTROLLING); // the transaction is sent again once the bus is free
+        __attribute__((fallthrough));
+    case TW_SR_SLA_ACK:
+    case TW_SR_GCALL_ACK:
         i2c_detail::bufferIdx = 0;
         i2c_detail::active = true;
+#if I2C_RECEIVE_QUEUE_SIZE
+        i2c_detail::frameTail->generalCall = TW_STATUS & 0x10;
+#endif
         TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE) | _BV(TWEA);
         break;
     case TW_SR_GCALL_DATA_ACK:
     case TW_SR_DATA_ACK:
-        i2c_detail::twiBuffer[i2c_detail::bufferIdx++] = TWDR;
+#if I2C_RECEIVE_QUEUE_SIZE
+        i2c_detail::frameTail->data[i2c_detail::bufferIdx++] = TWDR;
+        if (i2c_detail::bufferIdx == I2C_RX_BUFFER_SIZE) {
+            TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE); // the frame is full, so NACK the next byte
+            break;
+        }
+#else
+        i2c_detail::rxBuffer[i2c_detail::bufferIdx++] = TWDR;
+        if (i2c_detail::bufferIdx == I2C_RX_BUFFER_SIZE) {
+            if (!i2c_detail::onReceiveChunkFunction) {
+                TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE); // the buffer is full, so NACK the next byte
+                break;
+            }
+            TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE) | _BV(TWEA);
+            i2c_detail::onReceiveChunkFunction();
+            i2c_detail::bufferIdx = 0;
+            break;
+        }
+#endif
         TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE) | _BV(TWEA);
         break;
+    case TW_SR_DATA_NACK:
+    case TW_SR_GCALL_DATA_NACK: // the buffer was full
     case TW_SR_STOP:
         TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE) | _BV(TWEA);
-        i2c_detail::onReceiveFunction(i2c_detail::twiBuffer);
-        i2c_detail::active = false;
+#if I2C_RECEIVE_QUEUE_SIZE
+        if ((uint8_t)(i2c_detail::framesReceived - i2c_detail::framesPolled) < I2C_RECEIVE_QUEUE_SIZE) {
+            i2c_detail::frameTail->size = i2c_detail::bufferIdx;
+            if (++i2c_detail::frameTail == i2c_detail::frames + I2C_RECEIVE_QUEUE_SIZE + 1) {
+                i2c_detail::frameTail = i2c_detail::frames;
+            }
+            i2c_detail::framesReceived++;
+        }
+#else
+        i2c_detail::onReceiveFunction();
+#endif
+        i2c_detail::idle(_BV(TWEN) | _BV(TWIE) | _BV(TWEA));
         break;
+    case TW_BUS_ERROR:
+        if (!(i2c_detail::bufferFlags & _BV(i2c_detail::CONTROLLING))) {
+            // As a target or while waiting for the bus, so a queued transaction has not started and is sent once it is free
+            i2c_detail::bufferFlags = 0; // a read which was cut off has ended
+            i2c_detail::idle(_BV(TWINT) | _BV(TWEN) | _BV(TWIE) | _BV(TWSTO) | _BV(TWEA));
+            break;
+        }
+        __attribute__((fallthrough));
     default:
-        i2c_detail::error = TWSR;
-        TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE) | _BV(TWSTO) | _BV(TWEA);
-        while (TWCR & _BV(TWSTO)) {  }
-        i2c_detail::active = false;
+        i2c_detail::error = TW_STATUS;
+        i2c_detail::bufferFlags = 0; // a read which was cut off by a bus error has ended too
+        if (TW_STATUS == TW_BUS_ERROR) {
+            i2c_detail::stop();
+        } else {
+            i2c_detail::finish();
+        }
         break;
     }
 }
-#endif // #if 0
+#endif // #ifndef I2C_REFERENCE_ISR
 
 #endif // #ifdef I2C_IMPLEMENTATION
\ No newline at end of file
@@ -0,0 +1,1062 @@
+/*
+MIT License
+
+Copyright (c) 2024 sub1inear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+/** @file
+ * \brief
+ * A host model of the ATmega32u4 TWI, used by ArduboyI2C.h when it is not compiled for AVR.
+ * \details
+ * Replaces the avr-libc headers the library uses. The TWI registers, PIND, DDRD and PORTD are backed by an i2c_host::Node,
+ * which models the TWI state machine bit by bit on an open-drain SDA/SCL bus (i2c_host::Bus).
+ * Time is counted in CPU cycles. It only passes in `_delay_loop_2`, in reads of PIND (2 cycles each) and while the
+ * TWI interrupt runs (`I2C_HOST_ISR_CYCLES`), which is where the bus moves forward and the interrupt is taken.
+ * The SCL periods follow TWBR and the prescaler bits of TWSR like the hardware does. \n
+ * Several nodes can share a bus through an i2c_host::Scheduler, which extras/simulator uses to run several players. \n
+ * Only port D is modeled, so `I2C_SCL_PIN` and `I2C_SDA_PIN` must be left as PIND.
+ * Not part of the AVR build.
+ */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#ifndef F_CPU
+#define F_CPU 16000000UL
+#endif
+
+#ifndef I2C_HOST_ISR_CYCLES
+/** \brief
+ * The cycles the TWI interrupt takes in the host model, from the interrupt flag being seen to the return.
+ * \details
+ * Defaults to 80, about the cost of a data byte in the asm ISR. The interrupt body runs at the end of them.
+ */
+#define I2C_HOST_ISR_CYCLES 80
+#endif
+
+// ------------------------ avr-libc ------------------------ //
+
+#define _BV(bit) (1 << (bit))
+
+// avr/interrupt.h
+#define ISR(vector, ...) void vector()
+#define sei() (i2c_detail::hostNode.enableInterrupts())
+#define cli() (i2c_detail::hostNode.interrupts = false)
+
+// util/atomic.h (both ATOMIC_RESTORESTATE and ATOMIC_FORCEON restore the state, interrupts are always on outside of them)
+#define ATOMIC_BLOCK(type) for (i2c_host::AtomicBlock i2c_host_atomic(i2c_detail::hostNode); i2c_host_atomic.once(); )
+
+// avr/pgmspace.h (flash and RAM are the same on the host)
+#define PROGMEM
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+#define pgm_read_dword(address) (*(const uint32_t *)(address))
+
+// avr/power.h
+#define power_twi_enable()
+
+// util/delay_basic.h
+#define _delay_loop_2(count) (i2c_detail::hostNode.delayLoop(count))
+
+// avr/io.h
+#define PIND  (i2c_detail::hostNode.portD[0])
+#define DDRD  (i2c_detail::hostNode.portD[1])
+#define PORTD (i2c_detail::hostNode.portD[2])
+#define TWBR  (i2c_detail::hostNode.twbr)
+#define TWSR  (i2c_detail::hostNode.twsr)
+#define TWAR  (i2c_detail::hostNode.twar)
+#define TWDR  (i2c_detail::hostNode.twdr)
+#define TWCR  (i2c_detail::hostNode.twcr)
+
+#define PIND0 0
+#define PIND1 1
+
+#define TWPS0 0
+#define TWPS1 1
+#define TWGCE 0
+#define TWIE  0
+#define TWEN  2
+#define TWWC  3
+#define TWSTO 4
+#define TWSTA 5
+#define TWEA  6
+#define TWINT 7
+
+// util/twi.h
+#define TW_START                 0x08
+#define TW_REP_START             0x10
+#define TW_MT_SLA_ACK            0x18
+#define TW_MT_SLA_NACK           0x20
+#define TW_MT_DATA_ACK           0x28
+#define TW_MT_DATA_NACK          0x30
+#define TW_MT_ARB_LOST           0x38
+#define TW_MR_ARB_LOST           0x38
+#define TW_MR_SLA_ACK            0x40
+#define TW_MR_SLA_NACK           0x48
+#define TW_MR_DATA_ACK           0x50
+#define TW_MR_DATA_NACK          0x58
+#define TW_SR_SLA_ACK            0x60
+#define TW_SR_ARB_LOST_SLA_ACK   0x68
+#define TW_SR_GCALL_ACK          0x70
+#define TW_SR_ARB_LOST_GCALL_ACK 0x78
+#define TW_SR_DATA_ACK           0x80
+#define TW_SR_DATA_NACK          0x88
+#define TW_SR_GCALL_DATA_ACK     0x90
+#define TW_SR_GCALL_DATA_NACK    0x98
+#define TW_SR_STOP               0xA0
+#define TW_ST_SLA_ACK            0xA8
+#define TW_ST_ARB_LOST_SLA_ACK   0xB0
+#define TW_ST_DATA_ACK           0xB8
+#define TW_ST_DATA_NACK          0xC0
+#define TW_ST_LAST_DATA          0xC8
+#define TW_NO_INFO               0xF8
+#define TW_BUS_ERROR             0x00
+#define TW_STATUS_MASK           0xF8
+#define TW_STATUS                (TWSR & TW_STATUS_MASK)
+#define TW_READ                  1
+#define TW_WRITE                 0
+
+/** \brief
+ * The host model of the TWI. Not part of the library.
+ */
+namespace i2c_host {
+
+typedef uint64_t cycles_t;
+
+constexpr cycles_t never = ~(cycles_t)0;
+
+/** \brief
+ * Something on the bus with open-drain SCL/SDA outputs and at most one pending timed event.
+ */
+class Device {
+public:
+    bool     sclOut = true; // released
+    bool     sdaOut = true; // released
+    cycles_t eventTime = never;
+
+    // Called by Bus::run when eventTime is reached (it is reset to never first).
+    virtual void onEvent() = 0;
+    // Called after every change of the bus lines, with their levels before it.
+    virtual void onLines(bool scl, bool sda, bool lastScl, bool lastSda) = 0;
+    // Whether the device has an interrupt it can take, which stops Bus::run when watched.
+    virtual bool interruptPending() const { return false; }
+
+protected:
+    ~Device() = default;
+};
+
+/** \brief
+ * Lets several nodes share a bus, each running its own program. See extras/simulator.
+ */
+class Scheduler {
+public:
+    // The most cycles a node runs ahead before the other nodes get to catch up. It bounds how late an interrupt can be seen.
+    cycles_t quantum = 16;
+
+    // Called by a node before it runs up to the bus time. Returns once every other node has caught up with it.
+    virtual void sync(cycles_t time) = 0;
+
+protected:
+    ~Scheduler() = default;
+};
+
+/** \brief
+ * An open-drain bus with pull-ups: each line is low while any device drives it low.
+ */
+class Bus {
+public:
+    struct Stats {
+        uint32_t transfers = 0;  // STARTs on a free bus
+        uint32_t starts = 0;     // STARTs and repeated STARTs
+        cycles_t busyCycles = 0; // from each START on a free bus to the STOP after it
+    };
+
+    cycles_t   now = 0;
+    bool       scl = true;
+    bool       sda = true;
+
+    // Cycles a released line takes to rise, from the pull-up charging the bus capacitance. Falling edges are immediate.
+    cycles_t   riseCycles = 0;
+    // A START must have been on the bus for this long before a TWI waits for the bus instead of sending its own,
+    // which is what lets two controllers collide.
+    cycles_t   startSyncCycles = 3;
+
+    Scheduler *scheduler = nullptr;
+    Stats      stats;
+
+    void attach(Device &device) {
+        devices.push_back(&device);
+    }
+
+    // Recomputes the lines after devices changed their outputs, and notifies every device of each change until they settle.
+    void update() {
+        if (updating) {
+            dirty = true;
+            return;
+        }
+        updating = true;
+        do {
+            dirty = false;
+            bool newScl = true;
+            bool newSda = true;
+            for (Device *device : devices) {
+                newScl &= device->sclOut;
+                newSda &= device->sdaOut;
+            }
+            newScl = settle(newScl, scl, sclRise);
+            newSda = settle(newSda, sda, sdaRise);
+            // Data settles before a rising clock and after a falling one,
+            // so a data change in the same step is never mistaken for a START or STOP.
+            if (newScl && !scl) {
+                setSda(newSda);
+                setScl(newScl);
+            } else {
+                setScl(newScl);
+                setSda(newSda);
+            }
+        } while (dirty);
+        updating = false;
+    }
+
+    // Runs the timed events of the devices and the rising lines up to the time in order.
+    // Stops early once the watched device has an interrupt pending, and returns the time it got to.
+    cycles_t run(cycles_t until, const Device *watch = nullptr) {
+        for (;;) {
+            if (watch && watch->interruptPending()) {
+                return now;
+            }
+            Device  *next = nullptr;
+            cycles_t time = sclRise < sdaRise ? sclRise : sdaRise;
+            for (Device *device : devices) {
+                if (device->eventTime < time) {
+                    next = device;
+                    time = device->eventTime;
+                }
+            }
+            if (time > until) {
+                break;
+            }
+            if (time > now) {
+                now = time;
+            }
+            if (next) {
+                next->eventTime = never;
+                next->onEvent();
+            } else {
+                update();
+            }
+        }
+        if (until > now) {
+            now = until;
+        }
+        return until;
+    }
+
+private:
+    std::vector<Device *> devices;
+    bool                  updating = false;
+    bool                  dirty = false;
+    cycles_t              sclRise = never; // when a released line reaches the high level
+    cycles_t              sdaRise = never;
+    bool                  busy = false; // for the stats
+    cycles_t              busySince = 0;
+
+    // Delays a rising line by riseCycles.
+    bool settle(bool level, bool current, cycles_t &rise) {
+        if (!level || current || !riseCycles) {
+            rise = never;
+            return level;
+        }
+        if (rise == never) {
+            rise = now + riseCycles;
+        }
+        if (rise > now) {
+            return false;
+        }
+        rise = never;
+        return true;
+    }
+
+    void setScl(bool level) {
+        if (level != scl) {
+            scl = level;
+            notify(!level, sda);
+        }
+    }
+
+    void setSda(bool level) {
+        if (level != sda) {
+            sda = level;
+            if (scl) {
+                if (!level) {
+                    stats.starts++;
+                    if (!busy) {
+                        busy = true;
+                        busySince = now;
+                        stats.transfers++;
+                    }
+                } else if (busy) {
+                    busy = false;
+                    stats.busyCycles += now - busySince;
+                }
+            }
+            notify(scl, !level);
+        }
+    }
+
+    void notify(bool lastScl, bool lastSda) {
+        for (Device *device : devices) {
+            device->onLines(scl, sda, lastScl, lastSda);
+        }
+    }
+};
+
+// The bus every node is attached to unless given another one.
+inline Bus &defaultBus() {
+    static Bus bus;
+    return bus;
+}
+
+class Node;
+
+/** \brief
+ * Takes the place of the TWI registers of a Node while set as its registerHook, so its ISR can be run on its own with
+ * the statuses a test chooses. See extras/isr.
+ */
+class RegisterHook {
+public:
+    virtual uint8_t read(uint8_t address) = 0;
+    virtual void write(uint8_t address, uint8_t value) = 0;
+
+protected:
+    ~RegisterHook() = default;
+};
+
+/** \brief
+ * An I/O register of a Node. Reads and writes go through the model.
+ */
+class Register {
+public:
+    Register(Node &node, uint8_t address) : node(&node), address(address) {}
+    Register(const Register &) = default;
+
+    operator uint8_t() const;
+    Register &operator=(uint8_t value);
+    Register &operator=(const Register &other) { return *this = (uint8_t)other; }
+    Register &operator|=(uint8_t value) { return *this = *this | value; }
+    Register &operator&=(uint8_t value) { return *this = *this & value; }
+    Register &operator^=(uint8_t value) { return *this = *this ^ value; }
+
+private:
+    Node   *node;
+    uint8_t address;
+};
+
+/** \brief
+ * An ATmega32u4 as seen by the library: the CPU cycle count, the global interrupt flag, port D and the TWI.
+ * \details
+ * The register addresses are those of the data space.
+ */
+class Node : public Device {
+public:
+    enum : uint8_t {
+        PIND_ADDRESS = 0x29,
+        DDRD_ADDRESS = 0x2A,
+        PORTD_ADDRESS = 0x2B,
+        TWBR_ADDRESS = 0xB8,
+        TWSR_ADDRESS = 0xB9,
+        TWAR_ADDRESS = 0xBA,
+        TWDR_ADDRESS = 0xBB,
+        TWCR_ADDRESS = 0xBC,
+    };
+
+    // PIND, DDRD and PORTD, consecutive like on the hardware
+    Register portD[3];
+    Register twbr;
+    Register twsr;
+    Register twar;
+    Register twdr;
+    Register twcr;
+
+    struct Stats {
+        uint32_t starts = 0;            // STARTs and repeated STARTs sent
+        uint32_t arbitrationLosses = 0;
+        uint32_t busErrors = 0;
+        uint32_t bytesSent = 0;         // data bytes, as a controller or a target
+        uint32_t bytesReceived = 0;
+        uint32_t interrupts = 0;
+    };
+
+    cycles_t cycles = 0;
+    bool     interrupts = true; // the I bit of SREG, set by the Arduino core before setup()
+    uint16_t isrCycles = I2C_HOST_ISR_CYCLES;
+
+    RegisterHook *registerHook = nullptr; // if set, TWBR to TWCR are read and written through it, and the bus is left alone
+
+    cycles_t origin = 0;        // the bus time of cycle 0, when the node was powered on
+    int32_t  clockError = 0;    // in parts per million, positive for a fast clock
+    Stats    stats;
+
+    explicit Node(void (*isr)(), Bus &bus = defaultBus()) :
+        portD{ Register(*this, PIND_ADDRESS), Register(*this, DDRD_ADDRESS), Register(*this, PORTD_ADDRESS) },
+        twbr(*this, TWBR_ADDRESS),
+        twsr(*this, TWSR_ADDRESS),
+        twar(*this, TWAR_ADDRESS),
+        twdr(*this, TWDR_ADDRESS),
+        twcr(*this, TWCR_ADDRESS),
+        bus(bus),
+        isr(isr) {
+        bus.attach(*this);
+        origin = bus.now;
+    }
+
+    // Converts cycles of the node to cycles of the bus, which are counted at F_CPU.
+    cycles_t busCycles(cycles_t amount) const {
+        return amount * 1000000 / (1000000 + clockError);
+    }
+
+    cycles_t busTime() const {
+        return origin + busCycles(cycles);
+    }
+
+    // Lets the cycles pass, taking the TWI interrupt as soon as it is pending.
+    // With a scheduler, they pass a quantum at a time so the other nodes keep up.
+    void delay(cycles_t amount) {
+        cycles_t end = cycles + amount;
+        while (cycles < end) {
+            cycles_t step = end;
+            if (bus.scheduler && step - cycles > bus.scheduler->quantum) {
+                step = cycles + bus.scheduler->quantum;
+            }
+            cycles_t until = origin + busCycles(step);
+            if (bus.scheduler) {
+                bus.scheduler->sync(until);
+            }
+            cycles_t reached = bus.run(until, interrupts ? this : nullptr);
+            if (reached < until) {
+                // interrupted: back to the cycle the bus got to
+                cycles_t at = (reached > origin ? reached - origin : 0) * (1000000 + clockError) / 1000000;
+                if (at > cycles) {
+                    cycles = at;
+                }
+            } else {
+                cycles = step;
+            }
+            takeInterrupt();
+        }
+    }
+
+    // _delay_loop_2: 4 cycles per iteration, and 0 is 65536 iterations
+    void delayLoop(uint16_t count) {
+        delay(4 * (count ? (cycles_t)count : 65536));
+    }
+
+    void enableInterrupts() {
+        interrupts = true;
+        takeInterrupt();
+    }
+
+    bool interruptPending() const override {
+        return twint && (control & _BV(TWIE)) && (control & _BV(TWEN));
+    }
+
+    void takeInterrupt() {
+        if (!interrupts || !interruptPending()) {
+            return;
+        }
+        interrupts = false;
+        stats.interrupts++;
+        delay(isrCycles);
+        isr();
+        interrupts = true;
+    }
+
+    uint8_t read(uint8_t address) {
+        if (registerHook && address >= TWBR_ADDRESS && address <= TWCR_ADDRESS) {
+            return registerHook->read(address);
+        }
+        switch (address) {
+        case PIND_ADDRESS:
+            delay(2);
+            return (pinLevels() & (_BV(PIND0) | _BV(PIND1))) | (port & ~(_BV(PIND0) | _BV(PIND1)));
+        case DDRD_ADDRESS:
+            return ddr;
+        case PORTD_ADDRESS:
+            return port;
+        case TWBR_ADDRESS:
+            return bitRate;
+        case TWSR_ADDRESS:
+            return (twint ? status : TW_NO_INFO) | prescaler;
+        case TWAR_ADDRESS:
+            return addressRegister;
+        case TWDR_ADDRESS:
+            return data;
+        case TWCR_ADDRESS:
+            return twint << TWINT | twwc << TWWC | control;
+        }
+        return 0;
+    }
+
+    void write(uint8_t address, uint8_t value) {
+        if (registerHook && address >= TWBR_ADDRESS && address <= TWCR_ADDRESS) {
+            registerHook->write(address, value);
+            return;
+        }
+        switch (address) {
+        case PIND_ADDRESS:
+            port ^= value; // writing ones toggles PORTD
+            updatePins();
+            break;
+        case DDRD_ADDRESS:
+            ddr = value;
+            updatePins();
+            break;
+        case PORTD_ADDRESS:
+            port = value;
+            updatePins();
+            break;
+        case TWBR_ADDRESS:
+            bitRate = value;
+            break;
+        case TWSR_ADDRESS:
+            prescaler = value & (_BV(TWPS0) | _BV(TWPS1)); // only the prescaler bits are writable
+            break;
+        case TWAR_ADDRESS:
+            addressRegister = value;
+            break;
+        case TWDR_ADDRESS:
+            // Writes while TWINT is clear are ignored and set TWWC
+            twwc = !twint;
+            if (twint) {
+                data = value;
+            }
+            break;
+        case TWCR_ADDRESS:
+            writeControl(value);
+            break;
+        }
+    }
+
+    // Half of an SCL period: the low and the high time.
+    cycles_t halfPeriod() const {
+        return 8 + ((cycles_t)bitRate << 2 * prescaler);
+    }
+
+    void onEvent() override {
+        switch (phase) {
+        case WAIT_FREE:
+            // A START seen during the last few cycles has not reached the TWI yet, which is what lets two controllers collide
+            if (busy && bus.now - busySince >= bus.startSyncCycles) {
+                return; // started again by the next STOP
+            }
+            master = true;
+            phase = START;
+            stats.starts++;
+            drive(true, false);
+            eventTime = bus.now + busCycles(halfPeriod());
+            break;
+        case START:
+            drive(false, false);
+            phase = HOLD;
+            raise(restart ? TW_REP_START : TW_START, false);
+            restart = false;
+            addressByte = true;
+            break;
+        case LOW:
+            phase = HIGH_WAIT;
+            drive(true, sdaOut);
+            break;
+        case HIGH:
+            endBit();
+            break;
+        case STOP_LOW:
+        case RESTART_LOW:
+            phase = phase == STOP_LOW ? STOP_HIGH_WAIT : RESTART_HIGH_WAIT;
+            drive(true, sdaOut);
+            break;
+        case STOP_HIGH:
+            // The STOP ends the transfer, then a START follows if TWSTA is still set
+            master = false;
+            control &= ~_BV(TWSTO);
+            phase = control & _BV(TWSTA) ? WAIT_FREE : IDLE;
+            drive(true, true);
+            break;
+        case RESTART_HIGH:
+            phase = START;
+            stats.starts++;
+            restart = true;
+            drive(true, false);
+            eventTime = bus.now + busCycles(halfPeriod());
+            break;
+        default:
+            break;
+        }
+    }
+
+    void onLines(bool scl, bool sda, bool lastScl, bool lastSda) override {
+        if (!(control & _BV(TWEN))) {
+            return;
+        }
+        if (scl && lastScl && sda != lastSda) {
+            if (sda) {
+                onStop();
+            } else {
+                onStart();
+            }
+            return;
+        }
+        if (scl && !lastScl) {
+            onRise(sda);
+        } else if (!scl && lastScl) {
+            onFall();
+        }
+    }
+
+private:
+    enum Phase : uint8_t {
+        IDLE,
+        WAIT_FREE,         // TWSTA is set, waiting for the bus to be free
+        START,             // SDA low while SCL is high
+        HOLD,              // SCL held low while TWINT is set
+        LOW,               // low half of a bit
+        HIGH_WAIT,         // SCL released, waiting for it to rise (clock stretching)
+        HIGH,              // high half of a bit
+        STOP_LOW,
+        STOP_HIGH_WAIT,
+        STOP_HIGH,
+        RESTART_LOW,
+        RESTART_HIGH_WAIT,
+        RESTART_HIGH,
+    };
+
+    enum Target : uint8_t {
+        NOT_ADDRESSED,
+        RECEIVER,
+        TRANSMITTER,
+    };
+
+    Bus        &bus;
+    void      (*isr)();
+
+    uint8_t     ddr = 0;
+    uint8_t     port = 0;
+
+    uint8_t     bitRate = 0;
+    uint8_t     prescaler = 0;
+    uint8_t     addressRegister = 0;
+    uint8_t     data = 0xFF;
+    uint8_t     control = 0;  // TWEA, TWSTA, TWSTO, TWEN and TWIE
+    uint8_t     status = TW_NO_INFO;
+    bool        twint = false;
+    bool        twwc = false;
+
+    bool        busy = false; // a START has been seen without a STOP after it
+    cycles_t    busySince = 0;
+
+    // controller (master)
+    Phase       phase = IDLE;
+    bool        master = false;
+    bool        restart = false;
+    bool        addressByte = false;
+    bool        reading = false;    // in master receiver mode
+    bool        transmitting = false;
+    bool        acked = false;
+    uint8_t     shift = 0;
+    uint8_t     bit = 0;
+
+    // target (slave), which also follows the transfers of this node and of other controllers
+    Target      target = NOT_ADDRESSED;
+    bool        targetAddressByte = false;
+    bool        targetAcking = false; // driving the ACK bit
+    bool        targetAcked = false;
+    bool        targetLast = false;   // TWEA was clear when the byte was loaded
+    bool        generalCall = false;
+    bool        arbitrationLost = false;
+    bool        holding = false;      // holding SCL low while TWINT is set
+    uint8_t     targetShift = 0;  // the bits on the bus, whoever sends them
+    uint8_t     targetData = 0;   // the byte being sent as a transmitter, which targetShift would lose bits of
+    uint8_t     targetBits = 0;
+
+    uint8_t pinLevels() const {
+        return bus.scl << PIND0 | bus.sda << PIND1;
+    }
+
+    // With the TWI off, the pins are driven low by setting their DDR bits with their PORT bits cleared.
+    void updatePins() {
+        if (!(control & _BV(TWEN))) {
+            sclOut = !(ddr & ~port & _BV(PIND0));
+            sdaOut = !(ddr & ~port & _BV(PIND1));
+            bus.update();
+        }
+    }
+
+    void drive(bool scl, bool sda) {
+        sclOut = scl;
+        sdaOut = sda;
+        bus.update();
+    }
+
+    void raise(uint8_t code, bool hold) {
+        status = code;
+        twint = true;
+        holding = hold;
+        if (hold) {
+            drive(false, sdaOut);
+        }
+    }
+
+    void reset() {
+        phase = IDLE;
+        eventTime = never;
+        master = false;
+        restart = false;
+        busy = false;
+        target = NOT_ADDRESSED;
+        targetBits = 0;
+        targetAcking = false;
+        arbitrationLost = false;
+        holding = false;
+    }
+
+    void writeControl(uint8_t value) {
+        bool enabled = control & _BV(TWEN);
+        if (value & _BV(TWINT)) {
+            twint = false; // cleared by writing a one
+        }
+        control = value & (_BV(TWEA) | _BV(TWSTA) | _BV(TWSTO) | _BV(TWEN) | _BV(TWIE));
+        if (!(control & _BV(TWEN))) {
+            // Disabling resets the TWI and hands the pins back to the port
+            reset();
+            updatePins();
+            return;
+        }
+        if (!enabled) {
+            reset();
+            drive(true, true);
+        }
+        if (phase == WAIT_FREE && !(control & _BV(TWSTA))) {
+            phase = IDLE; // the START is cancelled
+            eventTime = never;
+        }
+        if (twint) {
+            return; // nothing happens until TWINT is cleared
+        }
+
+        if (master && phase == HOLD) {
+            // TWINT was just cleared
+            if (control & _BV(TWSTO)) {
+                phase = STOP_LOW;
+                drive(false, false);
+                eventTime = bus.now + busCycles(halfPeriod());
+            } else if (control & _BV(TWSTA)) {
+                phase = RESTART_LOW;
+                drive(false, true);
+                eventTime = bus.now + busCycles(halfPeriod());
+            } else {
+                startByte();
+            }
+            return;
+        }
+
+        if (holding) {
+            holding = false;
+            if (target == TRANSMITTER && !(control & _BV(TWSTO))) {
+                // The first bit goes on SDA while SCL is still held low, before the controller can sample it
+                targetData = data;
+                targetLast = !(control & _BV(TWEA));
+                drive(false, targetData & 0x80);
+            }
+            drive(true, sdaOut);
+        }
+        if (control & _BV(TWSTO)) {
+            // Not a controller, so TWSTO only recovers from an error
+            control &= ~_BV(TWSTO);
+            target = NOT_ADDRESSED;
+            drive(true, true);
+        }
+        if ((control & _BV(TWSTA)) && phase == IDLE) {
+            phase = WAIT_FREE;
+            if (!busy) {
+                eventTime = bus.now + 1;
+            }
+        }
+    }
+
+    // Starts a byte with SCL low: the address after a START, or data.
+    void startByte() {
+        if (addressByte) {
+            shift = data;
+            reading = data & TW_READ;
+            transmitting = true;
+        } else {
+            shift = data;
+            transmitting = !reading;
+            acked = control & _BV(TWEA);
+        }
+        bit = 0;
+        startBit();
+    }
+
+    void startBit() {
+        bool level;
+        if (bit < 8) {
+            level = transmitting ? shift & (0x80 >> bit) : true;
+        } else {
+            level = transmitting ? true : !acked; // the receiver sends the ACK
+        }
+        phase = LOW;
+        drive(false, level);
+        eventTime = bus.now + busCycles(halfPeriod());
+    }
+
+    void endBit() {
+        eventTime = never;
+        phase = LOW; // so the falling edge is not taken for another controller's
+        drive(false, sdaOut);
+        if (++bit < 9) {
+            startBit();
+            return;
+        }
+        drive(false, true);
+        phase = HOLD;
+        if (addressByte) {
+            addressByte = false;
+            raise(reading ? (acked ? TW_MR_SLA_ACK : TW_MR_SLA_NACK) : (acked ? TW_MT_SLA_ACK : TW_MT_SLA_NACK), false);
+        } else if (reading) {
+            data = shift;
+            stats.bytesReceived++;
+            raise(acked ? TW_MR_DATA_ACK : TW_MR_DATA_NACK, false);
+        } else {
+            stats.bytesSent++;
+            raise(acked ? TW_MT_DATA_ACK : TW_MT_DATA_NACK, false);
+        }
+    }
+
+    void loseArbitration() {
+        master = false;
+        phase = IDLE;
+        eventTime = never;
+        arbitrationLost = true;
+        stats.arbitrationLosses++;
+        drive(true, true);
+    }
+
+    void busError() {
+        master = false;
+        phase = IDLE;
+        eventTime = never;
+        target = NOT_ADDRESSED;
+        targetAcking = false;
+        stats.busErrors++;
+        drive(true, true);
+        raise(TW_BUS_ERROR, false);
+    }
+
+    // A START or STOP inside a byte. They normally come while SCL is high for what would be the first bit of the next one.
+    bool misplaced() const {
+        return (master && phase >= LOW && phase <= HIGH) || (target != NOT_ADDRESSED && targetBits > 1);
+    }
+
+    void onStart() {
+        if (misplaced()) {
+            busError();
+        } else if (target == RECEIVER && !master) {
+            raise(TW_SR_STOP, true); // a repeated START while addressed
+        }
+        if (!busy) {
+            busy = true;
+            busySince = bus.now;
+        }
+        target = NOT_ADDRESSED;
+        targetAddressByte = true;
+        targetBits = 0;
+    }
+
+    void onStop() {
+        if (misplaced()) {
+            busError();
+        } else if (target == RECEIVER && !master) {
+            raise(TW_SR_STOP, false);
+        }
+        busy = false;
+        target = NOT_ADDRESSED;
+        targetAddressByte = false;
+        targetBits = 0;
+        if (phase == WAIT_FREE) {
+            eventTime = bus.now + busCycles(halfPeriod()); // the bus free time
+        }
+    }
+
+    void onRise(bool sda) {
+        // As a controller, SDA is sampled on the rising edge of SCL
+        switch (phase) {
+        case HIGH_WAIT:
+            if (bit < 8) {
+                if (!transmitting) {
+                    shift = shift << 1 | sda;
+                } else if (sdaOut && !sda) {
+                    loseArbitration(); // sent a one while another controller sent a zero
+                }
+            } else if (transmitting) {
+                acked = !sda;
+            }
+            if (master) {
+                phase = HIGH;
+                eventTime = bus.now + busCycles(halfPeriod());
+            }
+            break;
+        case STOP_HIGH_WAIT:
+            phase = STOP_HIGH;
+            eventTime = bus.now + busCycles(halfPeriod());
+            break;
+        case RESTART_HIGH_WAIT:
+            phase = RESTART_HIGH;
+            eventTime = bus.now + busCycles(halfPeriod());
+            break;
+        default:
+            break;
+        }
+
+        if (!busy) {
+            return;
+        }
+        if (targetBits < 8) {
+            targetShift = targetShift << 1 | sda;
+        } else {
+            targetAcked = !sda;
+        }
+        targetBits++;
+    }
+
+    void onFall() {
+        // Another controller ended the high half early (clock synchronization)
+        if (phase == HIGH) {
+            endBit();
+        }
+
+        if (!busy) {
+            return;
+        }
+        if (targetBits == 8) {
+            if (master) {
+                return;
+            }
+            if (targetAddressByte) {
+                uint8_t slaRW = targetShift;
+                bool ownAddress = slaRW >> 1 && slaRW >> 1 == addressRegister >> 1; // 0 is only the general call
+                bool generalAddress = slaRW == 0 && (addressRegister & _BV(TWGCE));
+                if ((control & _BV(TWEA)) && (ownAddress || generalAddress)) {
+                    target = slaRW & TW_READ ? TRANSMITTER : RECEIVER;
+                    generalCall = generalAddress;
+                    targetAcking = true;
+                    drive(sclOut, false);
+                }
+            } else if (target == RECEIVER) {
+                data = targetShift;
+                targetAcked = control & _BV(TWEA);
+                if (targetAcked) {
+                    targetAcking = true;
+                    drive(sclOut, false);
+                }
+            } else if (target == TRANSMITTER) {
+                drive(sclOut, true); // the controller sends the ACK
+            }
+        } else if (targetBits == 9) {
+            targetBits = 0;
+            if (targetAcking) {
+                targetAcking = false;
+                drive(sclOut, true);
+            }
+            if (master) {
+                targetAddressByte = false;
+                return;
+            }
+            bool lost = arbitrationLost;
+            arbitrationLost = false;
+            if (targetAddressByte) {
+                targetAddressByte = false;
+                if (target == TRANSMITTER) {
+                    raise(lost ? TW_ST_ARB_LOST_SLA_ACK : TW_ST_SLA_ACK, true);
+                } else if (target == RECEIVER) {
+                    data = targetShift;
+                    raise(generalCall ? (lost ? TW_SR_ARB_LOST_GCALL_ACK : TW_SR_GCALL_ACK) :
+                                        (lost ? TW_SR_ARB_LOST_SLA_ACK : TW_SR_SLA_ACK), true);
+                } else if (lost) {
+                    raise(TW_MT_ARB_LOST, false);
+                }
+            } else if (target == RECEIVER) {
+                stats.bytesReceived++;
+                if (targetAcked) {
+                    raise(generalCall ? TW_SR_GCALL_DATA_ACK : TW_SR_DATA_ACK, true);
+                } else {
+                    target = NOT_ADDRESSED;
+                    raise(generalCall ? TW_SR_GCALL_DATA_NACK : TW_SR_DATA_NACK, false);
+                }
+            } else if (target == TRANSMITTER) {
+                stats.bytesSent++;
+                if (targetAcked && !targetLast) {
+                    raise(TW_ST_DATA_ACK, true);
+                } else {
+                    target = NOT_ADDRESSED;
+                    raise(targetAcked ? TW_ST_LAST_DATA : TW_ST_DATA_NACK, false);
+                }
+            } else if (lost) {
+                raise(TW_MT_ARB_LOST, false);
+            }
+        } else if (target == TRANSMITTER && !master) {
+            drive(sclOut, targetData & (0x80 >> targetBits));
+        }
+    }
+};
+
+inline Register::operator uint8_t() const {
+    return node->read(address);
+}
+
+inline Register &Register::operator=(uint8_t value) {
+    node->write(address, value);
+    return *this;
+}
+
+/** \brief
+ * Clears the interrupt flag of a node for the scope of ATOMIC_BLOCK and restores it afterwards.
+ */
+class AtomicBlock {
+public:
+    explicit AtomicBlock(Node &node) : node(node), interrupts(node.interrupts) {
+        node.interrupts = false;
+    }
+    ~AtomicBlock() {
+        if (interrupts) {
+            node.enableInterrupts();
+        }
+    }
+    bool once() {
+        return !done && (done = true);
+    }
+
+private:
+    Node &node;
+    bool  interrupts;
+    bool  done = false;
+};
+
+}